@@ -96,6 +96,20 @@ static zcm_trans_t *transport_sub_create(zcm_url_t *url)
     return &sub_trans;
 }
 
+static zcm_trans_methods_t stats_methods;
+static zcm_trans_t stats_trans;
+static int stats_get_stats(zcm_trans_t *zt, zcm_trans_stats_t *stats)
+{
+    stats->packets_sent = 42;
+    return ZCM_EOK;
+}
+static zcm_trans_t *transport_stats_create(zcm_url_t *url)
+{
+    init_generic(&stats_trans, &stats_methods);
+    stats_methods.get_stats = stats_get_stats;
+    return &stats_trans;
+}
+
 static void register_transports(void)
 {
     ENSURE(zcm_transport_register(
@@ -109,6 +123,9 @@ static void register_transports(void)
 
     ENSURE(zcm_transport_register(
         "test-sub", "", transport_sub_create));
+
+    ENSURE(zcm_transport_register(
+        "test-stats", "", transport_stats_create));
 }
 
 static void test_fail_construct(void)
@@ -215,6 +232,28 @@ static void test_sub(void)
     zcm_cleanup(&zcm);
 }
 
+static void test_trans_stats(void)
+{
+    zcm_t zcm;
+    zcm_trans_stats_t stats;
+
+    /* transport without statistics */
+    zcm_init(&zcm, "test-generic");
+    memset(&stats, 0xff, sizeof(stats));
+    ENSURE(ZCM_EINVALID == zcm_get_trans_stats(&zcm, &stats));
+    ENSURE(0 == stats.packets_sent && 0 == stats.kernel_drops);
+    ENSURE(ZCM_EINVALID == zcm_set_loss_handler(&zcm, NULL, NULL));
+    zcm_cleanup(&zcm);
+
+    /* counters the transport doesn't fill in are zero */
+    zcm_init(&zcm, "test-stats");
+    memset(&stats, 0xff, sizeof(stats));
+    ENSURE(ZCM_EOK == zcm_get_trans_stats(&zcm, &stats));
+    ENSURE(42 == stats.packets_sent);
+    ENSURE(0 == stats.packets_recv && 0 == stats.kernel_drops);
+    zcm_cleanup(&zcm);
+}
+
 int main(void)
 {
     register_transports();
@@ -223,4 +262,5 @@ int main(void)
     test_publish();
     test_publish_msgdrop();
     test_sub();
+    test_trans_stats();
 }
@@ -3,6 +3,7 @@
 #include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <unistd.h>
 
 #include "zcm/zcm.h"
@@ -73,6 +74,144 @@ static void test_spawn2()
     zcm_destroy(zcm);
 }
 
+static void test_pool1()
+{
+    zcm_t *zcm = zcm_create("ipc");
+    assert(zcm);
+
+    zcm_start_pool(zcm, 4);
+    zcm_stop(zcm);
+
+    zcm_destroy(zcm);
+}
+
+static void test_pool2()
+{
+    zcm_t *zcm = zcm_create("ipc");
+    assert(zcm);
+
+    zcm_start_pool(zcm, 4);
+    usleep(100*1000);
+    zcm_dispatch_stats_t stats[4];
+    assert(zcm_get_dispatch_stats(zcm, stats, 4) == 4);
+    zcm_stop(zcm);
+    assert(zcm_get_dispatch_stats(zcm, stats, 4) == 0);
+
+    zcm_destroy(zcm);
+}
+
+#ifdef USING_TRANS_SHM
+static zcm_t *flushZcm;
+static std::atomic<int> numFlushed;
+
+static void flushHandler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    // Must not wait for this very callback to finish
+    zcm_flush(flushZcm);
+    numFlushed++;
+}
+
+static void test_pool_flush()
+{
+    flushZcm = zcm_create("shm://dispatch_loop_flush");
+    assert(flushZcm);
+    zcm_subscribe(flushZcm, "FLUSH", flushHandler, NULL);
+    zcm_subscribe(flushZcm, "FLUSH", flushHandler, NULL);
+
+    numFlushed = 0;
+    running = true;
+    std::thread kill {killThread};
+
+    zcm_start_pool(flushZcm, 4);
+    uint8_t data = 0;
+    for (int i = 0; i < 10; ++i) zcm_publish(flushZcm, "FLUSH", &data, 1);
+    while (numFlushed < 20) usleep(1000);
+    zcm_stop(flushZcm);
+
+    running = false;
+    kill.join();
+
+    zcm_destroy(flushZcm);
+}
+
+static std::atomic<int> numSlow;
+
+static void slowHandler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    usleep(2000);
+    numSlow++;
+}
+
+static void test_pool_stop()
+{
+    zcm_t *zcm = zcm_create("shm://dispatch_loop_stop");
+    assert(zcm);
+    zcm_subscribe(zcm, "SLOW", slowHandler, NULL);
+
+    numSlow = 0;
+    running = true;
+    std::thread kill {killThread};
+
+    zcm_start_pool(zcm, 2);
+    uint8_t data = 0;
+    // Faster than the handler, but slow enough not to overflow the send queue
+    for (int i = 0; i < 20; ++i) {
+        zcm_publish(zcm, "SLOW", &data, 1);
+        usleep(500);
+    }
+    // By now the last messages wait in the pool, stopping must not drop them
+    usleep(5000);
+    zcm_stop(zcm);
+    assert(numSlow == 20);
+
+    running = false;
+    kill.join();
+
+    zcm_destroy(zcm);
+}
+#endif
+
+static std::atomic<int> numRecv;
+
+static void recvHandler(const zcm_recv_buf_t *rbuf, const char *channel, void *usr)
+{
+    if (rbuf->data_size == 4 && memcmp(rbuf->data, "ping", 4) == 0)
+        numRecv++;
+}
+
+// Publishes on 'pubUrl' until a subscriber on 'subUrl' got a few messages. The subscriber
+// subscribes twice and drops one of them, which must not stop the other
+static void test_roundtrip(const char *pubUrl, const char *subUrl)
+{
+    zcm_t *sub = zcm_create(subUrl);
+    assert(sub);
+    zcm_t *pub = zcm_create(pubUrl);
+    assert(pub);
+
+    zcm_sub_t *extra = zcm_subscribe(sub, "PING", recvHandler, NULL);
+    zcm_subscribe(sub, "PING", recvHandler, NULL);
+    zcm_unsubscribe(sub, extra);
+
+    numRecv = 0;
+    running = true;
+    std::thread kill {killThread};
+
+    zcm_start(sub);
+    zcm_start(pub);
+    while (numRecv < 10) {
+        zcm_publish(pub, "PING", (const uint8_t*) "ping", 4);
+        usleep(1000);
+    }
+    zcm_stop(pub);
+    zcm_stop(sub);
+
+    running = false;
+    kill.join();
+
+    zcm_destroy(pub);
+    zcm_destroy(sub);
+}
+
 static void test_handle()
 {
     zcm_t *zcm = zcm_create("ipc");
@@ -96,7 +235,19 @@ int main()
     test_run();
     test_spawn1();
     test_spawn2();
+    test_pool1();
+    test_pool2();
+#ifdef USING_TRANS_SHM
+    test_pool_flush();
+    test_pool_stop();
+#endif
     test_handle();
+#ifdef USING_TRANS_SHM
+    test_roundtrip("shm://dispatch_loop", "shm://dispatch_loop");
+#endif
+#ifdef USING_TRANS_TCP
+    test_roundtrip("tcp://127.0.0.1:7795", "tcp://127.0.0.1:7795?mode=listen");
+#endif
 
     return 0;
 }
@@ -1,6 +1,7 @@
 #include "zcm/eventlog.h"
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
 #include <string>
 #include <iostream>
 
@@ -14,7 +15,7 @@ int main(int argc, const char *argv[])
     event.channellen = testChannel.length();
     event.channel    = (char*) testChannel.c_str();
     event.datalen    = testData.length();
-    event.data       = (void*) testData.c_str();
+    event.data       = (uint8_t*) testData.c_str();
 
     zcm_eventlog_t *l = zcm_eventlog_create("testlog.log", "w");
     assert(l && "Failed to open log for writing");
@@ -89,9 +90,206 @@ int main(int argc, const char *argv[])
            "Incorrect data inside of offset event");
     zcm_eventlog_free_event(le);
 
+    // Views, mixed with the other read methods
+    fseeko(zcm_eventlog_get_fileptr(l), 0, SEEK_SET);
+    zcm_eventlog_event_view_t view;
+    for (size_t i = 0; i < 100; ++i) {
+        if (i == 50) {
+            assert(ftello(zcm_eventlog_get_fileptr(l)) == offset * 5 &&
+                   "View reader left the file at the wrong position");
+            le = zcm_eventlog_read_prev_event(l);
+            assert(le && le->eventnum == 49 && "Incorrect prev event after views");
+            zcm_eventlog_free_event(le);
+            le = zcm_eventlog_read_next_event(l);
+            zcm_eventlog_free_event(le);
+        }
+        assert(zcm_eventlog_read_next_event_view(l, &view) == 0 && "Failed to read view");
+        assert(view.eventnum == (int64_t) i && "Incorrect eventnum inside of view");
+        assert(view.timestamp == (int64_t) i + 1 && "Incorrect timestamp inside of view");
+        assert(view.channellen == event.channellen &&
+               strncmp(view.channel, testChannel.c_str(), view.channellen) == 0 &&
+               "Incorrect channel inside of view");
+        assert(view.datalen == event.datalen &&
+               memcmp(view.data, testData.c_str(), view.datalen) == 0 &&
+               "Incorrect data inside of view");
+    }
+    assert(zcm_eventlog_read_next_event_view(l, &view) != 0 &&
+           "Requesting view after last event succeeded");
+
+    zcm_eventlog_destroy(l);
+
+    // The memory-mapped reader, first with a built index and then with the one the
+    // writer produces. Both indexes must be the same
+    for (size_t pass = 0; pass < 2; ++pass) {
+        if (pass == 0) {
+            zcm_eventlog_reader_t *r = zcm_eventlog_reader_create("testlog.log", NULL);
+            assert(r && zcm_eventlog_reader_num_indexed(r) == -1 &&
+                   "Reader used an index that doesn't exist");
+            zcm_eventlog_reader_destroy(r);
+            assert(access("testlog.log.idx", F_OK) != 0 && "Reader wrote an index");
+            assert(zcm_eventlog_build_index("testlog.log", "testlog.log.idx") == 0 &&
+                   "Failed to build the index");
+        } else {
+            int ret = system("mv testlog.log.idx testlog.built.idx");
+            (void) ret;
+            l = zcm_eventlog_create("testlog.log", "w");
+            assert(zcm_eventlog_enable_index(l, "testlog.log.idx") == 0 &&
+                   "Failed to enable the index");
+            event.eventnum  = 0;
+            event.timestamp = 1;
+            for (size_t i = 0; i < 100; ++i) {
+                assert(zcm_eventlog_write_event(l, &event) == 0 &&
+                       "Unable to write log event to log");
+                event.eventnum++;
+                event.timestamp++;
+            }
+            zcm_eventlog_destroy(l);
+            ret = system("cmp -s testlog.log.idx testlog.built.idx");
+            assert(ret == 0 && "Written index differs from the built one");
+        }
+
+        zcm_eventlog_reader_t *r = zcm_eventlog_reader_create("testlog.log", NULL);
+        assert(r && "Failed to open log for reading");
+        assert(zcm_eventlog_reader_num_indexed(r) == 100 && "Index is incomplete");
+
+        assert(zcm_eventlog_reader_seek_to_timestamp(r, 42) == 0 && "Failed to seek");
+        const zcm_eventlog_event_t *re = zcm_eventlog_reader_read_next(r);
+        assert(re && re->timestamp == 42 && "Seek ended up at the wrong event");
+        assert(strcmp(re->channel, testChannel.c_str()) == 0 && "Incorrect channel");
+        assert(re->datalen == (int32_t) testData.length() &&
+               memcmp(re->data, testData.c_str(), re->datalen) == 0 && "Incorrect data");
+
+        for (int64_t ts = 42; ts >= 1; --ts) {
+            re = zcm_eventlog_reader_read_prev(r);
+            assert(re && re->timestamp == ts && "Incorrect prev event");
+        }
+        assert(zcm_eventlog_reader_read_prev(r) == NULL &&
+               "Requesting event before first event didn't return NULL");
+
+        assert(zcm_eventlog_reader_read_at_offset(r, offset)->eventnum == 10 &&
+               "Incorrect offset event");
+        assert(zcm_eventlog_reader_seek_to_timestamp(r, 1000) != 0 &&
+               "Seeking past the end succeeded");
+        zcm_eventlog_reader_destroy(r);
+    }
+
+    // Appending continues an index only if it ends where the log does
+    l = zcm_eventlog_create("testlog.log", "a");
+    assert(zcm_eventlog_enable_index(l, "testlog.log.idx") == 0 &&
+           "Failed to continue the index");
+    event.timestamp = 101;
+    assert(zcm_eventlog_write_event(l, &event) == 0 && "Unable to write log event to log");
+    zcm_eventlog_destroy(l);
+    l = zcm_eventlog_create("testlog.log", "a");
+    assert(zcm_eventlog_enable_index(l, "testlog.built.idx") != 0 &&
+           "Continued an index that is behind the log");
     zcm_eventlog_destroy(l);
+    {
+        zcm_eventlog_reader_t *r = zcm_eventlog_reader_create("testlog.log", NULL);
+        assert(r && zcm_eventlog_reader_num_indexed(r) == 101 && "Index is incomplete");
+        zcm_eventlog_reader_destroy(r);
+    }
+
+    // Seeking a plain log goes through the index next to it, or bisects without one
+    for (size_t pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+            int ret = system("mv testlog.log.idx testlog.moved.idx");
+            (void) ret;
+        }
+        l = zcm_eventlog_create("testlog.log", "r");
+        assert(zcm_eventlog_seek_to_timestamp(l, 42) == 0 && "Failed to seek");
+        assert((l->seekreader != NULL) == (pass == 0) && "Seek ignored the index");
+        le = zcm_eventlog_read_next_event(l);
+        assert(le && le->timestamp == 42 && le->eventnum == 41 && "Incorrect seek");
+        zcm_eventlog_free_event(le);
+        assert(zcm_eventlog_seek_to_timestamp(l, 101) == 0 && "Failed to seek");
+        le = zcm_eventlog_read_next_event(l);
+        assert(le && le->timestamp == 101 && "Incorrect seek");
+        zcm_eventlog_free_event(le);
+        zcm_eventlog_destroy(l);
+    }
+    {
+        int ret = system("mv testlog.moved.idx testlog.log.idx");
+        (void) ret;
+    }
+
+    // Without an index, the same through scanning
+    zcm_eventlog_reader_t *r = zcm_eventlog_reader_create("testlog.log", "");
+    assert(r && zcm_eventlog_reader_num_indexed(r) == -1 && "Reader used an index");
+    assert(zcm_eventlog_reader_seek_to_timestamp(r, 77) == 0 && "Failed to seek");
+    assert(zcm_eventlog_reader_read_next(r)->timestamp == 77 && "Incorrect seek");
+    assert(zcm_eventlog_reader_read_prev(r)->timestamp == 77 && "Incorrect prev event");
+    assert(zcm_eventlog_reader_read_prev(r)->timestamp == 76 && "Incorrect prev event");
+    zcm_eventlog_reader_destroy(r);
+
+    // Block-compressed logs, big enough for several blocks. They have to read just
+    // like plain ones, with offsets into the uncompressed stream
+    std::string bigData;
+    for (size_t i = 0; i < 1000; ++i) bigData += (char) ('a' + i % 7);
+    event.datalen = bigData.length();
+    event.data    = (uint8_t*) bigData.c_str();
+    const int64_t eventSize = 4 + 8 + 8 + 4 + 4 + event.channellen + event.datalen;
+    for (int codec = 0; codec < 3; ++codec) {
+        if (!zcm_eventlog_codec_supported(codec)) continue;
+        for (int nthreads = 0; nthreads < 4; nthreads += 3) {
+            // The second half is appended, after losing the block index the first
+            // time around (as if the writer had crashed)
+            for (size_t half = 0; half < 2; ++half) {
+                l = zcm_eventlog_create("testlog.log", half == 0 ? "w" : "a");
+                assert(l && zcm_eventlog_set_compression(l, codec, 0, nthreads) == 0 &&
+                       "Failed to enable compression");
+                for (size_t i = 0; i < 3000; ++i) {
+                    event.timestamp = half * 3000 + i + 1;
+                    assert(zcm_eventlog_write_event(l, &event) == 0 &&
+                           "Unable to write log event to log");
+                }
+                zcm_eventlog_destroy(l);
+                if (nthreads == 0 && half == 0) {
+                    int ret = system("truncate -s -1 testlog.log");
+                    (void) ret;
+                }
+            }
+
+            l = zcm_eventlog_create("testlog.log", "r");
+            assert(l && "Failed to open compressed log for reading");
+            for (int64_t i = 0; i < 6000; ++i) {
+                zcm_eventlog_event_t *le = zcm_eventlog_read_next_event(l);
+                assert(le && le->eventnum == i % 3000 && le->timestamp == i + 1 &&
+                       "Incorrect compressed event");
+                assert(le->datalen == event.datalen &&
+                       memcmp(le->data, bigData.c_str(), le->datalen) == 0 &&
+                       "Incorrect data inside of compressed event");
+                zcm_eventlog_free_event(le);
+            }
+            assert(zcm_eventlog_read_next_event(l) == NULL &&
+                   "Requesting event after last compressed event didn't return NULL");
+            assert(ftello(zcm_eventlog_get_fileptr(l)) == 6000 * eventSize &&
+                   "Incorrect uncompressed size");
+
+            le = zcm_eventlog_read_event_at_offset(l, 4321 * eventSize);
+            assert(le && le->timestamp == 4322 && "Incorrect compressed offset event");
+            zcm_eventlog_free_event(le);
+            le = zcm_eventlog_read_prev_event(l);
+            assert(le && le->timestamp == 4322 && "Incorrect compressed prev event");
+            zcm_eventlog_free_event(le);
+            le = zcm_eventlog_read_prev_event(l);
+            assert(le && le->timestamp == 4321 && "Incorrect compressed prev event");
+            zcm_eventlog_free_event(le);
+
+            assert(zcm_eventlog_seek_to_timestamp(l, 2500) == 0 && "Failed to seek");
+            assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+                   view.timestamp == 2500 && "Incorrect compressed seek");
+            for (int64_t ts = 2501; ts <= 6000; ++ts) {
+                assert(zcm_eventlog_read_next_event_view(l, &view) == 0 &&
+                       view.timestamp == ts && "Incorrect compressed view");
+            }
+            assert(zcm_eventlog_seek_to_timestamp(l, 6001) != 0 &&
+                   "Seeking past the end succeeded");
+            zcm_eventlog_destroy(l);
+        }
+    }
 
-    int ret = system("rm testlog.log");
+    int ret = system("rm testlog.log testlog.log.idx testlog.built.idx");
     (void) ret;
 
     return 0;
@@ -99,6 +99,7 @@ static void recv()
         int ret = zcm_trans_recvmsg(trans, &msg, 100);
         if (ret == ZCM_EOK) {
             verifySame(&master, &msg);
+            zcm_trans_recvmsg_release(trans, &msg);
         }
     }
     uint64_t end = TimeUtil::utime();
@@ -0,0 +1,289 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "AsyncLogWriter.hpp"
+
+using namespace std;
+
+#define MAGIC ((int32_t) 0xEDA1DA01L)
+
+// Stands in for the buffer of a Pending that only asks for a sync
+static const size_t NO_BUF = (size_t) -1;
+
+static inline size_t alignDown(size_t v, size_t a) { return v - v % a; }
+static inline size_t alignUp(size_t v, size_t a) { return alignDown(v + a - 1, a); }
+
+static inline void put32(uint8_t* p, int32_t v)
+{
+    uint32_t n = htonl((uint32_t) v);
+    memcpy(p, &n, 4);
+}
+
+static inline void put64(uint8_t* p, int64_t v)
+{
+    put32(p, (int32_t) ((uint64_t) v >> 32));
+    put32(p + 4, (int32_t) (v & 0xffffffff));
+}
+
+AsyncLogWriter::AsyncLogWriter(bool directIO, size_t bufSize) :
+    directIO(directIO), bufSize(alignUp(bufSize, BLOCK_SIZE))
+{
+    for (size_t i = 0; i < NUM_BUFFERS; ++i) {
+        void* data = nullptr;
+        if (posix_memalign(&data, BLOCK_SIZE, this->bufSize) != 0) {
+            cerr << "Unable to allocate log write buffers" << endl;
+            abort();
+        }
+        bufs.push_back({(uint8_t*) data, 0});
+    }
+}
+
+AsyncLogWriter::~AsyncLogWriter()
+{
+    close();
+    for (auto& b : bufs) free(b.data);
+}
+
+bool AsyncLogWriter::open(const string& path, bool append)
+{
+    if (fd >= 0) close();
+
+    int flags = O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC);
+    usingDirect = false;
+    if (directIO) {
+        // Note: read access for the partial block at the end of the file, see below
+        fd = ::open(path.c_str(), (flags & ~O_WRONLY) | O_RDWR | O_DIRECT, 0644);
+        if (fd >= 0) {
+            usingDirect = true;
+        } else if (errno == EINVAL) {
+            cerr << "O_DIRECT is not supported for \"" << path
+                 << "\", writing through the page cache" << endl;
+        }
+    }
+    if (fd < 0) fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        fd = -1;
+        errno = err;
+        return false;
+    }
+
+    for (auto& b : bufs) b.len = 0;
+    freeBufs.clear();
+    for (size_t i = 1; i < NUM_BUFFERS; ++i) freeBufs.push_back(i);
+    cur = 0;
+    curOffset = st.st_size;
+    eventcount = 0;
+    writeErrno = 0;
+    stopping = false;
+
+    // Whole blocks only: start from the block that holds the end of the file
+    if (usingDirect && st.st_size % BLOCK_SIZE != 0) {
+        curOffset = alignDown(st.st_size, BLOCK_SIZE);
+        ssize_t ret = pread(fd, bufs[cur].data, BLOCK_SIZE, curOffset);
+        if (ret != st.st_size - curOffset) {
+            int err = ret < 0 ? errno : EIO;
+            ::close(fd);
+            fd = -1;
+            errno = err;
+            return false;
+        }
+        bufs[cur].len = ret;
+    }
+
+    thr = thread(&AsyncLogWriter::writerThread, this);
+    return true;
+}
+
+void AsyncLogWriter::close()
+{
+    if (fd < 0) return;
+
+    submit(true);
+    {
+        unique_lock<mutex> lock(lk);
+        stopping = true;
+    }
+    cond.notify_all();
+    thr.join();
+
+    ::close(fd);
+    fd = -1;
+}
+
+int AsyncLogWriter::writeEvent(const zcm::LogEvent* le)
+{
+    int err = writeErrno;
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+
+    uint8_t hdr[4 + 8 + 8 + 4 + 4];
+    put32(hdr, MAGIC);
+    put64(hdr + 4, eventcount);
+    put64(hdr + 12, le->timestamp);
+    put32(hdr + 20, (int32_t) le->channel.size());
+    put32(hdr + 24, le->datalen);
+
+    append(hdr, sizeof(hdr));
+    append(le->channel.data(), le->channel.size());
+    append(le->data, le->datalen);
+
+    eventcount++;
+    return 0;
+}
+
+void AsyncLogWriter::flush()
+{
+    if (fd >= 0) submit(true);
+}
+
+void AsyncLogWriter::append(const void* data, size_t len)
+{
+    const uint8_t* p = (const uint8_t*) data;
+    while (len > 0) {
+        Buffer& b = bufs[cur];
+        size_t n = min(len, bufSize - b.len);
+        memcpy(b.data + b.len, p, n);
+        b.len += n;
+        p += n;
+        len -= n;
+        if (b.len == bufSize) submit(false);
+    }
+}
+
+void AsyncLogWriter::submit(bool sync)
+{
+    Buffer& b = bufs[cur];
+    // In direct mode the buffer may start with the tail of the previous one
+    size_t carried = usingDirect ? (size_t) (curOffset % BLOCK_SIZE) : 0;
+    size_t tail = 0;
+    {
+        unique_lock<mutex> lock(lk);
+        if (b.len == carried) {
+            // Nothing new since the last submit
+            if (sync) pending.push_back({NO_BUF, 0, 0, true});
+        } else {
+            pending.push_back({cur, curOffset, b.len, sync});
+            while (freeBufs.empty()) cond.wait(lock);
+            size_t next = freeBufs.back();
+            freeBufs.pop_back();
+
+            // Note: the writer thread only reads the old buffer, copying from it is fine
+            if (usingDirect) tail = b.len % BLOCK_SIZE;
+            if (tail > 0) {
+                memcpy(bufs[next].data, b.data + b.len - tail, tail);
+                curOffset += b.len - tail;
+            } else {
+                curOffset += b.len;
+            }
+            // Note: the previous block is padded with whatever comes after the tail,
+            //       which the writer thread truncates away
+            bufs[next].len = tail;
+            cur = next;
+        }
+    }
+    cond.notify_all();
+}
+
+void AsyncLogWriter::writerThread()
+{
+    vector<Pending> batch;
+    while (true) {
+        {
+            unique_lock<mutex> lock(lk);
+            while (pending.empty() && !stopping) cond.wait(lock);
+            if (pending.empty()) return;
+            batch.assign(pending.begin(), pending.end());
+            pending.clear();
+        }
+
+        bool sync = false;
+        for (size_t i = 0; i < batch.size(); ) {
+            if (batch[i].buf == NO_BUF) {
+                sync |= batch[i].sync;
+                ++i;
+                continue;
+            }
+            size_t n = writeErrno == 0 ? writeBatch(batch, i) : 0;
+            if (n == 0) n = 1; // Failed, keep going to give the buffers back
+            for (size_t j = i; j < i + n; ++j) sync |= batch[j].sync;
+            i += n;
+        }
+        if (sync && writeErrno == 0 && fdatasync(fd) != 0) writeErrno = errno;
+
+        {
+            unique_lock<mutex> lock(lk);
+            for (auto& p : batch)
+                if (p.buf != NO_BUF) freeBufs.push_back(p.buf);
+        }
+        cond.notify_all();
+    }
+}
+
+size_t AsyncLogWriter::writeBatch(const vector<Pending>& batch, size_t first)
+{
+    struct iovec iov[NUM_BUFFERS];
+    size_t n = 0;
+    size_t total = 0;
+    off_t end = batch[first].offset;
+    for (size_t i = first; i < batch.size() && n < NUM_BUFFERS; ++i) {
+        const Pending& p = batch[i];
+        if (p.buf == NO_BUF || p.offset != end) break;
+        size_t len = usingDirect ? alignUp(p.len, BLOCK_SIZE) : p.len;
+        iov[n].iov_base = bufs[p.buf].data;
+        iov[n].iov_len = len;
+        total += len;
+        end += len;
+        ++n;
+    }
+
+    struct iovec* v = iov;
+    size_t nv = n;
+    off_t offset = batch[first].offset;
+    while (total > 0) {
+        ssize_t ret = pwritev(fd, v, nv, offset);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret < 0 && errno == EINVAL && usingDirect) {
+            // Some filesystems accept O_DIRECT on open() but not on write()
+            int flags = fcntl(fd, F_GETFL);
+            if (flags >= 0 && fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0) continue;
+        }
+        if (ret <= 0) {
+            writeErrno = ret < 0 ? errno : EIO;
+            return 0;
+        }
+        total -= ret;
+        offset += ret;
+        while (nv > 0 && (size_t) ret >= v->iov_len) {
+            ret -= v->iov_len;
+            ++v;
+            --nv;
+        }
+        if (nv > 0) {
+            v->iov_base = (uint8_t*) v->iov_base + ret;
+            v->iov_len -= ret;
+        }
+    }
+
+    // Cut off the padding of a partial block
+    const Pending& last = batch[first + n - 1];
+    if (usingDirect && last.len % BLOCK_SIZE != 0 &&
+        ftruncate(fd, last.offset + last.len) != 0) {
+        writeErrno = errno;
+    }
+    return n;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include "zcm/zcm-cpp.hpp"
+
+// Writes events in the same format as zcm::LogFile, but instead of a few small
+// fwrite()s per event it serializes them into a handful of large buffers. A thread
+// of its own hands every filled buffer to the kernel (several at once with pwritev()
+// when they queue up) while the next one is being filled, and does the fdatasync()s
+// too, so the caller only blocks when all buffers are waiting on the disk.
+//
+// With directIO the file is opened with O_DIRECT, skipping the page cache. Buffers
+// are then written in whole blocks: a partial block at the end is padded, the file
+// is truncated back to its real size and the block is written again once it has
+// grown. Filesystems that don't support O_DIRECT fall back to normal writes.
+class AsyncLogWriter
+{
+  public:
+    AsyncLogWriter(bool directIO, size_t bufSize = DEFAULT_BUF_SIZE);
+    ~AsyncLogWriter();
+
+    // Returns false on failure, with errno set
+    bool open(const std::string& path, bool append);
+    // Waits until everything written so far is on disk
+    void close();
+    bool good() const { return fd >= 0; }
+
+    // Returns 0 on success, or -1 with errno set if this or an earlier write failed
+    int writeEvent(const zcm::LogEvent* le);
+    // Submits what is buffered and has it synced to disk, without waiting for either
+    void flush();
+
+    static const size_t DEFAULT_BUF_SIZE = 4 << 20;
+    static const size_t NUM_BUFFERS = 4;
+    // Alignment of buffers, offsets and lengths for O_DIRECT
+    static const size_t BLOCK_SIZE = 4096;
+
+  private:
+    struct Buffer
+    {
+        uint8_t* data;
+        size_t   len;
+    };
+
+    // A buffer handed to the writer thread
+    struct Pending
+    {
+        size_t buf;
+        off_t  offset;
+        size_t len;
+        bool   sync;
+    };
+
+    void append(const void* data, size_t len);
+    // Hands the current buffer to the writer thread and takes a free one
+    void submit(bool sync);
+    void writerThread();
+    // Writes the pending buffers at the front of 'batch' that are contiguous in the
+    // file with a single pwritev(). Returns how many were written, 0 on failure
+    size_t writeBatch(const std::vector<Pending>& batch, size_t first);
+
+    bool directIO;
+    size_t bufSize;
+    int fd = -1;
+    bool usingDirect = false;
+
+    std::vector<Buffer> bufs;
+    size_t cur = 0;        // buffer being filled, owned by the caller
+    off_t curOffset = 0;   // where it goes in the file
+    int64_t eventcount = 0;
+
+    std::mutex lk;
+    std::condition_variable cond;
+    std::deque<Pending> pending;
+    std::vector<size_t> freeBufs;
+    bool stopping = false;
+    std::atomic<int> writeErrno {0};
+    std::thread thr;
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+// A single-producer single-consumer queue of log events that lives in one block of
+// memory allocated up front. The producer copies every event straight into the
+// block and the consumer reads them from there, so there are no allocations per
+// event and the memory used for buffering events never exceeds the size of the
+// block. Neither side takes a lock, except for the consumer going to sleep and the
+// producer waking it back up.
+//
+// Events are stored as Records, each contiguous in memory and starting at a multiple
+// of 8 bytes. A Record that doesn't fit before the end of the block goes to its
+// start, the space left behind is skipped (marked by a Record of size 0, if there is
+// room for one).
+class EventRing
+{
+  public:
+    struct Record
+    {
+        uint32_t size;       // of the whole record, including channel, data and padding
+        uint32_t channellen;
+        int32_t  datalen;
+        uint32_t unused;
+        int64_t  timestamp;
+
+        const char* channel() const { return (const char*) (this + 1); }
+        const uint8_t* data() const { return (const uint8_t*) (this + 1) + channellen; }
+    };
+
+    EventRing() {}
+    ~EventRing() { free(buf); }
+
+    // Returns false if the memory couldn't be allocated
+    bool init(size_t size)
+    {
+        cap = size - size % 8;
+        buf = (uint8_t*) malloc(cap);
+        return buf != nullptr;
+    }
+
+    /**** Producer ****/
+    // Returns false (and drops the event) if there isn't enough room left
+    bool push(int64_t timestamp, const char* channel, uint32_t channellen,
+              const uint8_t* data, int32_t datalen)
+    {
+        size_t need = sizeof(Record) + channellen + datalen;
+        need = (need + 7) & ~(size_t) 7;
+        if (need > cap) return false;
+
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        size_t off = t % cap;
+        size_t toEnd = cap - off;
+        size_t skip = toEnd < need ? toEnd : 0;
+        if (t + skip + need - h > cap) return false;
+
+        if (skip > 0) {
+            if (skip >= sizeof(Record)) ((Record*) (buf + off))->size = 0;
+            off = 0;
+        }
+        Record* r = (Record*) (buf + off);
+        r->size = need;
+        r->channellen = channellen;
+        r->datalen = datalen;
+        r->timestamp = timestamp;
+        memcpy((char*) (r + 1), channel, channellen);
+        memcpy((uint8_t*) (r + 1) + channellen, data, datalen);
+
+        // Note: sequentially consistent, so that either this sees the consumer going
+        //       to sleep or the consumer sees the new tail, see wait()
+        tail.store(t + skip + need);
+        if (waiting.load()) wakeup();
+        return true;
+    }
+
+    /**** Consumer ****/
+    // Sets 'span' to the records at the front of the ring that are contiguous in
+    // memory and returns their total size, 0 if the ring is empty. They stay where
+    // they are until release()
+    size_t peek(const uint8_t** span)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        uint64_t t = tail.load(std::memory_order_acquire);
+        while (h != t) {
+            size_t off = h % cap;
+            size_t toEnd = cap - off;
+            if (toEnd < sizeof(Record) || ((const Record*) (buf + off))->size == 0) {
+                h += toEnd;
+                head.store(h, std::memory_order_release);
+                continue;
+            }
+            *span = buf + off;
+            // Note: stops at a skip, which is handled by the next peek()
+            size_t len = 0;
+            while (len < t - h && len + sizeof(Record) <= toEnd) {
+                const Record* r = (const Record*) (buf + off + len);
+                if (r->size == 0) break;
+                len += r->size;
+            }
+            return len;
+        }
+        return 0;
+    }
+
+    // Hands the first 'len' bytes of the last peek() back to the producer
+    void release(size_t len)
+    {
+        head.store(head.load(std::memory_order_relaxed) + len, std::memory_order_release);
+    }
+
+    // Bytes taken by the events that haven't been released yet
+    size_t used() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    size_t size() const { return cap; }
+
+    // Sleeps until there is something to peek() at, wakeup() is called or the
+    // timeout passes
+    void wait(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(lk);
+        waiting.store(true);
+        if (tail.load() == head.load(std::memory_order_relaxed))
+            cond.wait_for(lock, timeout);
+        waiting.store(false);
+    }
+
+    void wakeup()
+    {
+        std::unique_lock<std::mutex> lock(lk);
+        cond.notify_all();
+    }
+
+  private:
+    uint8_t* buf = nullptr;
+    size_t cap = 0;
+
+    // Total bytes ever pushed and released. Each on a cache line of its own, they
+    // are written by different threads
+    alignas(64) std::atomic<uint64_t> tail {0};
+    alignas(64) std::atomic<uint64_t> head {0};
+    alignas(64) std::atomic<bool> waiting {false};
+
+    std::mutex lk;
+    std::condition_variable cond;
+
+    EventRing(const EventRing&) = delete;
+    EventRing& operator=(const EventRing&) = delete;
+};
@@ -6,10 +6,6 @@
 #include <cinttypes>
 #include <regex>
 #include <atomic>
-#include <mutex>
-#include <condition_variable>
-#include <thread>
-#include <queue>
 #include <vector>
 #include <signal.h>
 #include <string>
@@ -31,6 +27,8 @@
 using namespace std;
 
 #include "platform.hpp"
+#include "AsyncLogWriter.hpp"
+#include "EventRing.hpp"
 
 static atomic_int done {0};
 
@@ -49,13 +47,19 @@ struct Args
     i64    max_target_memory  = 0;
     string plugin_path        = "";
     bool   debug              = false;
+    bool   write_index        = false;
+    bool   async_write        = false;
+    bool   direct_io          = false;
+    int    compress_codec     = -1;
+    int    compress_level     = 0;
+    int    compress_threads   = 2;
 
     string input_fname;
 
     bool parse(int argc, char *argv[])
     {
         // set some defaults
-        const char *optstring = "hb:c:fiu:r:s:qvl:m:p:d";
+        const char *optstring = "hb:c:fiu:r:s:qvl:m:p:dxaDz:t:";
         struct option long_opts[] = {
             { "help",              no_argument,       0, 'h' },
             { "split-mb",          required_argument, 0, 'b' },
@@ -71,6 +75,11 @@ struct Args
             { "max-target-memory", required_argument, 0, 'm' },
             { "plugin-path",       required_argument, 0, 'p' },
             { "debug",             no_argument,       0, 'd' },
+            { "index",             no_argument,       0, 'x' },
+            { "async-write",       no_argument,       0, 'a' },
+            { "direct-io",         no_argument,       0, 'D' },
+            { "compress",          required_argument, 0, 'z' },
+            { "compress-threads",  required_argument, 0, 't' },
 
             { 0, 0, 0, 0 }
         };
@@ -124,6 +133,38 @@ struct Args
                 case 'd':
                     debug = true;
                     break;
+                case 'x':
+                    write_index = true;
+                    break;
+                case 'a':
+                    async_write = true;
+                    break;
+                case 'D':
+                    async_write = true;
+                    direct_io = true;
+                    break;
+                case 'z': {
+                    string codec = optarg;
+                    size_t colon = codec.find(':');
+                    if (colon != string::npos) {
+                        compress_level = atoi(codec.c_str() + colon + 1);
+                        codec = codec.substr(0, colon);
+                    }
+                    if (codec == "lz4")       compress_codec = ZCM_EVENTLOG_CODEC_LZ4;
+                    else if (codec == "zstd") compress_codec = ZCM_EVENTLOG_CODEC_ZSTD;
+                    else if (codec == "none") compress_codec = ZCM_EVENTLOG_CODEC_NONE;
+                    else return false;
+                    if (!zcm_eventlog_codec_supported(compress_codec)) {
+                        cerr << "ERROR.  This build of zcm doesn't support " << codec
+                             << " compression" << endl;
+                        return false;
+                    }
+                } break;
+                case 't':
+                    compress_threads = atoi(optarg);
+                    if (compress_threads < 0)
+                        return false;
+                    break;
                 case 'h': default: usage(); return false;
             };
         }
@@ -148,6 +189,16 @@ struct Args
             return false;
         }
 
+        if (write_index && async_write) {
+            cerr << "ERROR.  --index can't be used with --async-write" << endl;
+            return false;
+        }
+
+        if (compress_codec >= 0 && (write_index || async_write)) {
+            cerr << "ERROR.  --compress can't be used with --index or --async-write" << endl;
+            return false;
+        }
+
         return true;
     }
 
@@ -173,9 +224,6 @@ struct Args
              << "                             already exist.  This option precludes -f and" << endl
              << "                             --rotate" << endl
              << "  -u, --zcm-url=URL          Log messages on the specified ZCM URL" << endl
-             << "  -m, --max-unwritten-mb=SZ  Maximum size of received but unwritten" << endl
-             << "                             messages to store in memory before dropping" << endl
-             << "                             messages.  (default: 100 MB)" << endl
              << "  -r, --rotate=NUM           When creating a new log file, rename existing files" << endl
              << "                             out of the way and always write to FILE.0.  If" << endl
              << "                             FILE.0 already exists, it is renamed to FILE.1.  If" << endl
@@ -190,12 +238,29 @@ struct Args
              << "  -s, --strftime             Format FILE with strftime." << endl
              << "  -v, --invert-channels      Invert channels.  Log everything that CHAN" << endl
              << "                             does not match." << endl
-             << "  -m, --max-target-memory    Attempt to limit the total buffer usage to this" << endl
-             << "                             amount of memory. If specified, ensure that this" << endl
-             << "                             number is at least as large as the maximum message" << endl
-             << "                             size you expect to receive. This argument is" << endl
-             << "                             specified in bytes. Suffixes are not yet supported." << endl
+             << "  -m, --max-target-memory    Size of the buffer for received but unwritten" << endl
+             << "                             messages, allocated up front. Messages that don't" << endl
+             << "                             fit are dropped, so ensure that this number is" << endl
+             << "                             well above the maximum message size you expect to" << endl
+             << "                             receive. This argument is specified in bytes." << endl
+             << "                             Suffixes are not yet supported. (default: 100 MB)" << endl
              << "  -p, --plugin-path=path     Path to shared library containing transcoder plugins" << endl
+             << "  -x, --index                Also write an index of the events next to every" << endl
+             << "                             log file (FILE" ZCM_EVENTLOG_INDEX_SUFFIX ") for fast seeking." << endl
+             << "  -a, --async-write          Collect events in large buffers and write them" << endl
+             << "                             to disk from a separate thread. Uses an extra" << endl
+             << "                             " << AsyncLogWriter::NUM_BUFFERS *
+                                                   AsyncLogWriter::DEFAULT_BUF_SIZE / (1 << 20)
+                                              << " MB of memory. This option precludes --index." << endl
+             << "  -D, --direct-io            Like --async-write, but bypass the page cache" << endl
+             << "                             (O_DIRECT) when writing." << endl
+             << "  -z, --compress=CODEC[:LVL] Write a block-compressed log, with CODEC lz4 or" << endl
+             << "                             zstd (if zcm was built with them) at an optional" << endl
+             << "                             compression level. All zcm log readers read these" << endl
+             << "                             logs. --split-mb counts uncompressed bytes. This" << endl
+             << "                             option precludes --index and --async-write." << endl
+             << "  -t, --compress-threads=N   Compress with N threads of their own. 0 compresses" << endl
+             << "                             while writing.  (default: 2)" << endl
              << endl
              << "Rotating / splitting log files" << endl
              << "==============================" << endl
@@ -212,17 +277,8 @@ struct Args
     }
 };
 
-static zcm::LogEvent* cloneLogEvent(const zcm::LogEvent* evt)
-{
-    zcm::LogEvent* ret = new zcm::LogEvent;
-    ret->eventnum  = evt->eventnum;
-    ret->timestamp = evt->timestamp;
-    ret->channel   = evt->channel;
-    ret->datalen   = evt->datalen;
-    ret->data      = new uint8_t[evt->datalen];
-    memcpy(ret->data, evt->data, evt->datalen * sizeof(uint8_t));
-    return ret;
-}
+// Size of the buffer for received but unwritten events without --max-target-memory
+static const size_t DEFAULT_BUFFER_SIZE = 100 << 20;
 
 struct Logger
 {
@@ -232,6 +288,7 @@ struct Logger
     string fname_prefix;
 
     zcm::LogFile* log = nullptr;
+    AsyncLogWriter* writer = nullptr;
 
     int next_increment_num          = 0;
 
@@ -253,12 +310,11 @@ struct Logger
 
     int    num_splits               = 0;
 
-    i64    totalMemoryUsage         = 0;
-
-    mutex lk;
-    condition_variable newEventCond;
-
-    queue<zcm::LogEvent*> q;
+    // Events travel from handler() to flushWhenReady() through here
+    EventRing ring;
+    // Reused for every event, to keep their channels from being allocated each time
+    zcm::LogEvent handlerEvent;
+    zcm::LogEvent writeEvent;
 
     TranscoderPluginDb* pluginDb = nullptr;
     vector<zcm::TranscoderPlugin*> plugins;
@@ -268,13 +324,7 @@ struct Logger
     ~Logger()
     {
         if (pluginDb) { delete pluginDb; pluginDb = nullptr; }
-        if (log)      { log->close(); delete log; }
-
-        while (!q.empty()) {
-            delete[] q.front()->data;
-            delete q.front();
-            q.pop();
-        }
+        closeLogfile();
     }
 
     bool init(int argc, char *argv[])
@@ -282,6 +332,13 @@ struct Logger
         if (!args.parse(argc, argv))
             return false;
 
+        size_t bufSize = args.max_target_memory > 0 ? args.max_target_memory :
+                                                      DEFAULT_BUFFER_SIZE;
+        if (!ring.init(bufSize)) {
+            cerr << "Unable to allocate " << bufSize << " bytes for buffering" << endl;
+            return false;
+        }
+
         if (!openLogfile())
             return false;
 
@@ -333,6 +390,12 @@ struct Logger
             if (FileUtil::exists(tomove))
                 if (0 != FileUtil::rename(tomove, newname))
                     cerr << "ERROR!  Unable to rotate [" << tomove << "]" << endl;
+            // Indexes travel with their logs, stale ones must not stay behind
+            string idx = newname + ZCM_EVENTLOG_INDEX_SUFFIX;
+            if (FileUtil::exists(tomove + ZCM_EVENTLOG_INDEX_SUFFIX))
+                FileUtil::rename(tomove + ZCM_EVENTLOG_INDEX_SUFFIX, idx);
+            else if (FileUtil::exists(idx))
+                FileUtil::remove(idx);
         }
     }
 
@@ -387,15 +450,53 @@ struct Logger
 
         // open output file in append mode if we're rotating log files, or write
         // mode if not.
+        if (args.async_write) {
+            writer = new AsyncLogWriter(args.direct_io);
+            if (!writer->open(filename, args.rotate > 0)) {
+                perror("Error: open failed");
+                delete writer;
+                writer = nullptr;
+                return false;
+            }
+            return true;
+        }
+
         log = new zcm::LogFile(filename, (args.rotate > 0) ? "a" : "w");
         if (!log->good()) {
             perror("Error: fopen failed");
             delete log;
+            log = nullptr;
             return false;
         }
+
+        if (args.compress_codec >= 0 &&
+            log->setCompression(args.compress_codec, args.compress_level,
+                                args.compress_threads) != 0) {
+            cerr << "Unable to compress \"" << filename << "\", it has to be empty "
+                 << "or already compressed" << endl;
+            delete log;
+            log = nullptr;
+            return false;
+        }
+
+        if (args.write_index) {
+            // Appending needs an index of what is already there
+            string idxname = filename + ZCM_EVENTLOG_INDEX_SUFFIX;
+            fseeko(log->getFilePtr(), 0, SEEK_END);
+            if (ftello(log->getFilePtr()) > 0)
+                zcm_eventlog_build_index(filename.c_str(), idxname.c_str());
+            if (log->enableIndex(idxname) != 0)
+                cerr << "Unable to write the index \"" << idxname << "\"" << endl;
+        }
         return true;
     }
 
+    void closeLogfile()
+    {
+        if (writer) { writer->close(); delete writer; writer = nullptr; }
+        if (log)    { log->close(); delete log; log = nullptr; }
+    }
+
     void handler(const zcm::ReceiveBuffer* rbuf, const string& channel)
     {
         if (args.invert_channels) {
@@ -404,95 +505,79 @@ struct Logger
             if (match.size() > 0) return;
         }
 
-        vector<zcm::LogEvent*> evts;
-
-        zcm::LogEvent* le = new zcm::LogEvent;
-        le->timestamp = rbuf->recv_utime;
-        le->channel   = channel;
-        le->datalen   = rbuf->data_size;
-
         if (!plugins.empty()) {
-            le->data = rbuf->data;
+            zcm::LogEvent* le = &handlerEvent;
+            le->timestamp = rbuf->recv_utime;
+            le->channel   = channel;
+            le->datalen   = rbuf->data_size;
+            le->data      = rbuf->data;
 
             int64_t msg_hash;
             __int64_t_decode_array(le->data, 0, 8, &msg_hash, 1);
 
+            // Plugins that return anything replace the original event, null entries
+            // included, which drop it
+            bool transcoded = false;
             for (auto& p : plugins) {
                 vector<const zcm::LogEvent*> pevts =
                     p->transcodeEvent((uint64_t) msg_hash, le);
-                for (auto* evt : pevts)
-                    if (evt) evts.emplace_back(cloneLogEvent(evt));
-                    else     evts.emplace_back(nullptr);
+                for (auto* evt : pevts) {
+                    transcoded = true;
+                    if (evt && !enqueue(evt->timestamp, evt->channel, evt->data, evt->datalen))
+                        return;
+                }
             }
+            if (transcoded) return;
         }
 
-        if (evts.empty()) {
-            le->data = new uint8_t[rbuf->data_size];
-            memcpy(le->data, rbuf->data, sizeof(uint8_t) * rbuf->data_size);
-            evts.push_back(le);
-        } else {
-            delete le;
-        }
+        enqueue(rbuf->recv_utime, channel, rbuf->data, rbuf->data_size);
+    }
 
-        bool stillRoom = true;
-        {
-            unique_lock<mutex> lock{lk};
-            while (!evts.empty()) {
-                if (stillRoom) {
-                    zcm::LogEvent* le = evts.back();
-                    if (!le) {
-                        evts.pop_back();
-                        continue;
-                    }
-                    q.push(le);
-                    totalMemoryUsage += le->datalen + le->channel.size() + sizeof(*le);
-                    stillRoom = (args.max_target_memory == 0) ? true :
-                        (totalMemoryUsage + rbuf->data_size < args.max_target_memory);
-                    evts.pop_back();
-                } else {
-                    ZCM_DEBUG("Dropping message due to enforced memory constraints");
-                    ZCM_DEBUG("Current memory estimations are at %" PRId64 " bytes",
-                              totalMemoryUsage);
-                    while (!evts.empty()) {
-                        delete[] evts.back()->data;
-                        delete evts.back();
-                        evts.pop_back();
-                    }
-                    break;
-                }
-            }
-        }
-        newEventCond.notify_all();
+    bool enqueue(int64_t timestamp, const string& channel, const uint8_t* data, int32_t datalen)
+    {
+        if (ring.push(timestamp, channel.data(), channel.size(), data, datalen))
+            return true;
+        ZCM_DEBUG("Dropping message due to enforced memory constraints");
+        ZCM_DEBUG("Current memory usage is at %zu bytes", ring.used());
+        return false;
     }
 
     void flushWhenReady()
     {
-        zcm::LogEvent *le = nullptr;
-        size_t qSize = 0;
-        i64 memUsed = 0;
-        {
-            unique_lock<mutex> lock{lk};
-
-            while (q.empty()) {
-                if (done) return;
-                newEventCond.wait(lock);
-            }
+        const uint8_t* span;
+        size_t len;
+        while ((len = ring.peek(&span)) == 0) {
             if (done) return;
-
-            le = q.front();
-            q.pop();
-            qSize = q.size();
-            memUsed = totalMemoryUsage; // want to capture the max mem used, not post flush
-            totalMemoryUsage -= (le->datalen + le->channel.size() + sizeof(*le));
+            ring.wait(chrono::milliseconds(100));
+        }
+        if (done) return;
+
+        // want to capture the max mem used, not post flush
+        i64 memUsed = ring.used();
+
+        // Note: the events are written straight out of the ring, which only gets
+        //       them back once they are all written
+        size_t pos = 0;
+        while (pos < len) {
+            auto* r = (const EventRing::Record*) (span + pos);
+            writeEvent.timestamp = r->timestamp;
+            writeEvent.channel.assign(r->channel(), r->channellen);
+            writeEvent.datalen   = r->datalen;
+            writeEvent.data      = (uint8_t*) r->data();
+            write(&writeEvent, memUsed);
+            pos += r->size;
         }
-        if (qSize != 0) ZCM_DEBUG("Queue size = %zu\n", qSize);
+        ring.release(len);
+    }
 
+    void write(const zcm::LogEvent* le, i64 memUsed)
+    {
         // Is it time to start a new logfile?
         if (args.auto_split_mb) {
             double logsize_mb = (double)logsize / (1 << 20);
             if (logsize_mb > args.auto_split_mb) {
                 // Yes.  open up a new log file
-                log->close();
+                closeLogfile();
                 if (args.rotate > 0)
                     rotate_logfiles();
                 if (!openLogfile()) exit(1);
@@ -502,7 +587,8 @@ struct Logger
             }
         }
 
-        if (log->writeEvent(le) != 0) {
+        int ret = writer ? writer->writeEvent(le) : log->writeEvent(le);
+        if (ret != 0) {
             static u64 last_spew_utime = 0;
             string reason = strerror(errno);
             u64 now = TimeUtil::utime();
@@ -513,14 +599,13 @@ struct Logger
             if (errno == ENOSPC)
                 exit(1);
 
-            delete[] le->data;
-            delete le;
             return;
         }
 
         if (args.fflush_interval_ms >= 0 &&
             (le->timestamp - last_fflush_time) > (u64)args.fflush_interval_ms * 1000) {
-            Platform::fflush(log->getFilePtr());
+            if (writer) writer->flush();
+            else        Platform::fflush(log->getFilePtr());
             last_fflush_time = le->timestamp;
         }
 
@@ -545,15 +630,11 @@ struct Logger
             events_since_last_report = 0;
             last_report_logsize = logsize;
         }
-
-        delete[] le->data;
-        delete le;
     }
 
     void wakeup()
     {
-        unique_lock<mutex> lock(lk);
-        newEventCond.notify_all();
+        ring.wakeup();
     }
 };
 
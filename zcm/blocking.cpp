@@ -2,7 +2,10 @@
 #include "zcm/zcm_private.h"
 #include "zcm/blocking.h"
 #include "zcm/transport.h"
-#include "zcm/util/threadsafe_queue.hpp"
+#include "zcm/util/spsc_queue.hpp"
+#include "zcm/util/dispatch_pool.hpp"
+#include "zcm/util/rcu_ptr.hpp"
+#include "zcm/util/mempool.hpp"
 #include "zcm/util/debug.h"
 
 #include "util/TimeUtil.hpp"
@@ -12,6 +15,9 @@
 #include <cstring>
 
 #include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <chrono>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -22,6 +28,9 @@
 using namespace std;
 
 #define RECV_TIMEOUT 100
+// Most messages handed to/taken from the transport per wakeup of the send/recv threads
+#define SEND_BATCH_SIZE 16
+#define RECV_BATCH_SIZE 16
 
 // Define a macro to set thread names. The function call is
 // different for some operating systems
@@ -42,24 +51,43 @@ struct Msg
 {
     zcm_msg_t msg;
 
-    // NOTE: copy the provided data into this object
+    // The transport that leased us the memory behind 'msg' (null if we own a copy)
+    zcm_trans_t* lessor = nullptr;
+
+    // NOTE: copy the provided data into this object. The copy comes from the
+    //       process-wide MemPool so that large messages don't churn the allocator
     Msg(uint64_t utime, const char* channel, size_t len, const uint8_t* buf)
     {
         msg.utime = utime;
         msg.channel = strdup(channel);
         msg.len = len;
-        msg.buf = (uint8_t*)malloc(len);
+        msg.buf = (uint8_t*)MemPool::global().alloc(len);
         memcpy(msg.buf, buf, len);
     }
 
     Msg(zcm_msg_t* msg) : Msg(msg->utime, msg->channel, msg->len, msg->buf) {}
 
+    // NOTE: take over the transport's lease on the provided message, no copy is made.
+    //       The memory is handed back to the transport when this object is destroyed
+    Msg(zcm_msg_t* msg, zcm_trans_t* lessor) : msg(*msg), lessor(lessor) {}
+
+    // NOTE: take over whatever the other Msg holds (copy or lease), leaving it empty
+    explicit Msg(Msg* other) : msg(other->msg), lessor(other->lessor)
+    {
+        memset(&other->msg, 0, sizeof(other->msg));
+        other->lessor = nullptr;
+    }
+
     ~Msg()
     {
-        if (msg.channel)
-            free((void*)msg.channel);
-        if (msg.buf)
-            free((void*)msg.buf);
+        if (lessor) {
+            zcm_trans_recvmsg_release(lessor, &msg);
+        } else {
+            if (msg.channel)
+                free((void*)msg.channel);
+            if (msg.buf)
+                MemPool::global().free((char*)msg.buf, msg.len);
+        }
         memset(&msg, 0, sizeof(msg));
     }
 
@@ -76,6 +104,44 @@ struct Msg
     Msg& operator=(Msg&& other) = delete;
 };
 
+// Everything we know about one subscription. It is owned by its strand, which in turn
+// is shared by every subscription table version, channel cache and pending pool task
+// that refers to it, so the zcm_sub_t is only freed once nothing can reach it anymore
+struct SubRecord
+{
+    zcm_sub_t* sub;
+
+    // Set once the subscription has been removed, no callback starts after that
+    atomic<bool> closed {false};
+    // Set while the callback may be running (there is never more than one at a time)
+    atomic<bool> active {false};
+
+    explicit SubRecord(zcm_sub_t* sub) : sub(sub) {}
+
+    ~SubRecord()
+    {
+        if (sub->regex) delete (std::regex*) sub->regexobj;
+        delete sub;
+    }
+};
+
+// Number of callbacks the current thread is in the middle of (see unsubscribe())
+static thread_local int callbackDepth = 0;
+// The instance whose dispatch pool the current thread belongs to (see flush())
+static thread_local const zcm_blocking_t* poolOwner = nullptr;
+
+static void callSub(SubRecord& rec, const zcm_recv_buf_t* rbuf, const char* channel)
+{
+    // Note: pairs with unsubscribe(): either we see 'closed' or it sees 'active'
+    rec.active.store(true, memory_order_seq_cst);
+    if (!rec.closed.load(memory_order_seq_cst)) {
+        ++callbackDepth;
+        rec.sub->callback(rbuf, channel, rec.sub->usr);
+        --callbackDepth;
+    }
+    rec.active.store(false, memory_order_release);
+}
+
 static bool isRegexChannel(const string& channel)
 {
     // These chars are considered regex
@@ -94,14 +160,43 @@ static bool isRegexChannel(const string& channel)
 struct zcm_blocking
 {
   private:
-    using SubList = vector<zcm_sub_t*>;
+    // Messages handed to the dispatch pool are shared by every subscription they
+    // are dispatched to. Each subscription gets its own strand so that its
+    // callback never runs concurrently with itself and sees messages in order
+    using Pool = DispatchPool<unique_ptr<SubRecord>, shared_ptr<Msg>>;
+    using SubRef = Pool::StrandPtr;
+    using SubList = vector<SubRef>;
+
+    // An immutable version of the subscription table. subscribe() and unsubscribe()
+    // publish a modified copy instead of changing it in place, so readers never lock
+    struct SubTable
+    {
+        uint64_t version = 1;
+        unordered_map<string, SubList> subs;
+        SubList subRegex;
+    };
+
+    // Memoized result of matching a channel against all of the subscriptions (exact
+    // matches first, then regex matches, in subscription order). Entries are built
+    // the first time a channel is seen and the whole cache is dropped whenever a new
+    // table version is seen, so its size follows the number of distinct channels
+    struct ChannelCache
+    {
+        uint64_t version = 0;
+        unordered_map<string, SubList> matches;
+        string key; // scratch space to avoid allocating a std::string per lookup
+    };
+    static constexpr size_t MAX_CACHED_CHANNELS = 4096;
+
+    // The readers of the subscription table, each one has its own RcuPtr slot
+    enum { READER_RECV = 0, READER_DISP, NUM_READERS };
 
   public:
     zcm_blocking(zcm_t* z, zcm_trans_t* zt_);
     ~zcm_blocking();
 
     void run();
-    void start();
+    void start(size_t nthreads = 0);
     int stop(bool block);
     int handle();
 
@@ -115,37 +210,58 @@ struct zcm_blocking
 
     int setQueueSize(uint32_t numMsgs, bool block);
 
+    size_t getDispatchStats(zcm_dispatch_stats_t* stats, size_t n);
+    int getTransStats(zcm_trans_stats_t* stats) { return zcm_trans_get_stats(zt, stats); }
+    int setLossHandler(zcm_loss_handler_t cb, void* usr)
+    { return zcm_trans_set_loss_handler(zt, cb, usr); }
+
   private:
     void sendThreadFunc();
     void recvThreadFunc();
     void hndlThreadFunc();
 
     void dispatchMsg(zcm_msg_t* msg);
+    void dispatchMsgToPool(Msg* m);
+    void runPoolTask(Pool::Strand& strand, shared_ptr<Msg>& m);
     bool dispatchOneMessage(bool returnIfPaused);
-    bool sendOneMessage(bool returnIfPaused);
+    size_t sendMessages(bool returnIfPaused, size_t maxMsgs);
 
-    // Mutexes protecting the ...OneMessage() functions
+    // Mutexes protecting dispatchOneMessage() and sendMessages()
     mutex dispOneMutex;
     mutex sendOneMutex;
 
-    bool deleteSubEntry(zcm_sub_t* sub, size_t nentriesleft);
-    bool deleteFromSubList(SubList& slist, zcm_sub_t* sub);
+    static const SubList& matchingSubs(ChannelCache& cache, const SubTable& table,
+                                       const char* channel);
 
     zcm_t* z;
     zcm_trans_t* zt;
-    unordered_map<string, SubList> subs;
-    SubList subRegex;
     size_t mtu;
 
-    // These 2 mutexes used to implement a read-write style infrastructure on the subscription
-    // lists. Both the recvThread and the message dispatch may read the subscriptions
-    // concurrently, but subscribe() and unsubscribe() need both locks in order to write to it.
-    mutex subDispMutex;
-    mutex subRecvMutex;
+    // The subscription table. The recvThread reads it through READER_RECV and whoever
+    // dispatches (always under dispOneMutex) through READER_DISP, neither takes a lock.
+    // subscribe() and unsubscribe() are serialized by subWriteMutex, which also protects
+    // 'subRefs', and never wait for the readers
+    RcuPtr<SubTable> subTable {new SubTable(), NUM_READERS};
+    mutex subWriteMutex;
+    unordered_map<zcm_sub_t*, SubRef> subRefs;
+
+    // One cache per reader: recvCache is only used by the recvThread, dispCache only
+    // under dispOneMutex
+    ChannelCache recvCache;
+    ChannelCache dispCache;
+
+    // The dispatch pool only exists while the hndlThread runs in pool mode. The pointer is
+    // written with both dispOneMutex and poolMutex held, so holding either one is enough
+    // to use it
+    size_t poolThreads {0};
+    unique_ptr<Pool> pool;
+    mutex poolMutex;
 
     static constexpr size_t QUEUE_SIZE = 16;
-    ThreadsafeQueue<Msg> sendQueue {QUEUE_SIZE};
-    ThreadsafeQueue<Msg> recvQueue {QUEUE_SIZE};
+    // Note: every thread that publishes pushes to sendQueue, only the recv thread
+    //       pushes to recvQueue
+    SpscQueue<Msg, true> sendQueue {QUEUE_SIZE};
+    SpscQueue<Msg> recvQueue {QUEUE_SIZE};
 
     typedef enum {
         RECV_MODE_NONE = 0,
@@ -187,8 +303,9 @@ struct zcm_blocking
     condition_variable hndlPauseCond;
 };
 
-zcm_blocking_t::zcm_blocking(zcm_t* z, zcm_trans_t* zt_)
+zcm_blocking_t::zcm_blocking(zcm_t* z_, zcm_trans_t* zt_)
 {
+    z = z_;
     zt = zt_;
     mtu = zcm_trans_get_mtu(zt);
 }
@@ -198,19 +315,15 @@ zcm_blocking_t::~zcm_blocking()
     // Shutdown all threads
     stop(true);
 
+    // Any messages still queued may be leased from the transport, so they
+    // must be handed back before the transport goes away
+    while (recvQueue.hasMessage()) recvQueue.pop();
+
     // Destroy the transport
     zcm_trans_destroy(zt);
 
-    // Need to delete all subs
-    for (auto& it : subs) {
-        for (auto& sub : it.second) {
-            delete sub;
-        }
-    }
-    for (auto& sub : subRegex) {
-        delete (regex*) sub->regexobj;
-        delete sub;
-    }
+    // Note: the subscriptions are freed along with the last table version and cache
+    //       that refers to them
 }
 
 void zcm_blocking_t::run()
@@ -221,6 +334,7 @@ void zcm_blocking_t::run()
         return;
     }
     recvMode = RECV_MODE_RUN;
+    poolThreads = 0;
 
     // Run it!
     {
@@ -237,7 +351,7 @@ void zcm_blocking_t::run()
 }
 
 // TODO: should this call be thread safe?
-void zcm_blocking_t::start()
+void zcm_blocking_t::start(size_t nthreads)
 {
     unique_lock<mutex> lk1(recvModeMutex);
     if (recvMode != RECV_MODE_NONE) {
@@ -245,6 +359,7 @@ void zcm_blocking_t::start()
         return;
     }
     recvMode = RECV_MODE_SPAWN;
+    poolThreads = nthreads;
 
     unique_lock<mutex> lk2(hndlStateMutex);
     lk1.unlock();
@@ -410,25 +525,27 @@ int zcm_blocking_t::publish(const string& channel, const uint8_t* data, uint32_t
 }
 
 // Note: We use a lock on subscribe() to make sure it can be
-// called concurrently. Without the lock, there is a race
-// on modifying and reading the 'subs' and 'subRegex' containers
+// called concurrently. Readers of the subscription table are
+// not blocked, they keep using the previous version until they
+// pick up the new one. This means subscribe() may be called
+// from within a callback.
 zcm_sub_t* zcm_blocking_t::subscribe(const string& channel,
                                      zcm_msg_handler_t cb, void* usr,
                                      bool block)
 {
-    unique_lock<mutex> lk1(subDispMutex, std::defer_lock);
-    unique_lock<mutex> lk2(subRecvMutex, std::defer_lock);
+    unique_lock<mutex> lk(subWriteMutex, std::defer_lock);
     if (block) {
-        lk1.lock();
-        lk2.lock();
-    } else if (!lk1.try_lock() || !lk2.try_lock()) {
+        lk.lock();
+    } else if (!lk.try_lock()) {
         return nullptr;
     }
     int rc;
 
+    const SubTable* cur = subTable.current();
+
     bool regex = isRegexChannel(channel);
     if (regex) {
-        if (subRegex.size() == 0) {
+        if (cur->subRegex.size() == 0) {
             rc = zcm_trans_recvmsg_enable(zt, NULL, true);
         } else {
             rc = ZCM_EOK;
@@ -453,44 +570,85 @@ zcm_sub_t* zcm_blocking_t::subscribe(const string& channel,
     if (regex) {
         sub->regexobj = (void*) new std::regex(sub->channel);
         ZCM_ASSERT(sub->regexobj);
-        subRegex.push_back(sub);
-    } else {
-        subs[channel].push_back(sub);
     }
 
+    SubRef ref = make_shared<Pool::Strand>(unique_ptr<SubRecord>(new SubRecord(sub)));
+    subRefs[sub] = ref;
+
+    SubTable* next = new SubTable(*cur);
+    next->version++;
+    if (regex) next->subRegex.push_back(ref);
+    else       next->subs[channel].push_back(ref);
+    subTable.publish(next);
+
     return sub;
 }
 
 // Note: We use a lock on unsubscribe() to make sure it can be
-// called concurrently. Without the lock, there is a race
-// on modifying and reading the 'subs' and 'subRegex' containers
+// called concurrently. Like subscribe(), it does not block the
+// readers and may be called from within a callback. When called
+// from outside of a callback, the subscription's callback is
+// guaranteed to not be running anymore once this returns.
 int zcm_blocking_t::unsubscribe(zcm_sub_t* sub, bool block)
 {
-    unique_lock<mutex> lk1(subDispMutex, std::defer_lock);
-    unique_lock<mutex> lk2(subRecvMutex, std::defer_lock);
+    unique_lock<mutex> lk(subWriteMutex, std::defer_lock);
     if (block) {
-        lk1.lock();
-        lk2.lock();
-    } else if (!lk1.try_lock() || !lk2.try_lock()) {
+        lk.lock();
+    } else if (!lk.try_lock()) {
         return ZCM_EAGAIN;
     }
 
-    bool success = true;
+    auto rit = subRefs.find(sub);
+    if (rit == subRefs.end()) {
+        ZCM_DEBUG("failed to find the subscription entry in unsubscribe()");
+        return ZCM_EINVALID;
+    }
+    SubRef ref = rit->second;
+    subRefs.erase(rit);
+
+    auto removeFrom = [&](SubList& slist) {
+        for (size_t i = 0; i < slist.size(); i++) {
+            if (slist[i] == ref) {
+                slist.erase(slist.begin() + i);
+                return;
+            }
+        }
+    };
+
+    SubTable* next = new SubTable(*subTable.current());
+    next->version++;
+    int rc;
     if (sub->regex) {
-        success = deleteFromSubList(subRegex, sub);
+        removeFrom(next->subRegex);
+        rc = next->subRegex.empty() ? zcm_trans_recvmsg_enable(zt, NULL, false) : ZCM_EOK;
     } else {
-        auto it = subs.find(sub->channel);
-        if (it == subs.end()) {
-            ZCM_DEBUG("failed to find the subscription channel in unsubscribe()");
-            return ZCM_EINVALID;
+        auto it = next->subs.find(sub->channel);
+        if (it != next->subs.end()) {
+            removeFrom(it->second);
+            if (it->second.empty()) next->subs.erase(it);
+        }
+        rc = zcm_trans_recvmsg_enable(zt, sub->channel, false);
+    }
+    subTable.publish(next);
+
+    // Messages for this subscription may still be on their way to the callback
+    // (e.g. waiting in the dispatch pool). Closing it turns them into no-ops
+    SubRecord& rec = *ref->key;
+    rec.closed.store(true, memory_order_seq_cst);
+    lk.unlock();
+
+    // Wait for a callback that is already running to return, unless we are being
+    // called from a callback ourselves: that one might be the callback we would
+    // wait for, or might be waited on by it
+    if (callbackDepth == 0) {
+        for (size_t i = 0; rec.active.load(memory_order_seq_cst); ++i) {
+            if (i < 100) this_thread::yield();
+            else         this_thread::sleep_for(chrono::microseconds(100));
         }
-
-        SubList& slist = it->second;
-        success = deleteFromSubList(slist, sub);
     }
 
-    if (!success) {
-        ZCM_DEBUG("failed to find the subscription entry in unsubscribe()");
+    if (rc != ZCM_EOK) {
+        ZCM_DEBUG("zcm_trans_recvmsg_enable() didn't return ZCM_EOK: %d", rc);
         return ZCM_EINVALID;
     }
 
@@ -514,7 +672,11 @@ int zcm_blocking_t::flush(bool block)
 
         sendQueue.enable();
         n = sendQueue.numMessages();
-        for (size_t i = 0; i < n; ++i) sendOneMessage(false);
+        for (size_t i = 0; i < n;) {
+            size_t sent = sendMessages(false, n - i);
+            if (sent == 0) break;
+            i += sent;
+        }
     }
 
     {
@@ -531,6 +693,11 @@ int zcm_blocking_t::flush(bool block)
         recvQueue.enable();
         n = recvQueue.numMessages();
         for (size_t i = 0; i < n; ++i) dispatchOneMessage(false);
+
+        // In pool mode, the messages have only been handed to the pool so far.
+        // Note: a callback on a pool thread counts as a task that hasn't finished,
+        //       waiting for the pool to go idle from there would never return
+        if (pool && poolOwner != this) pool->waitIdle();
     }
 
     return ZCM_EOK;
@@ -568,6 +735,8 @@ int zcm_blocking_t::setQueueSize(uint32_t numMsgs, bool block)
 
         recvQueue.setCapacity(numMsgs);
         recvQueue.enable();
+
+        if (pool) pool->setMaxPending(numMsgs);
     }
 
     return ZCM_EOK;
@@ -587,7 +756,7 @@ void zcm_blocking_t::sendThreadFunc()
             if (sendThreadState == THREAD_STATE_HALTING) break;
         }
         unique_lock<mutex> lk(sendOneMutex);
-        sendOneMessage(true);
+        sendMessages(true, SEND_BATCH_SIZE);
     }
 
     unique_lock<mutex> lk(sendStateMutex);
@@ -599,38 +768,38 @@ void zcm_blocking_t::recvThreadFunc()
     // Name the recv thread
     SET_THREAD_NAME("ZeroCM_receiver");
 
+    // If the transport leases its receive buffers, we can pass them through
+    // the queue as-is rather than copying every message
+    bool leased = zcm_trans_leases_recvmsg(zt);
+
     while (true) {
         {
             unique_lock<mutex> lk(recvStateMutex);
             if (recvThreadState == THREAD_STATE_HALTING) break;
         }
-        zcm_msg_t msg;
-        int rc = zcm_trans_recvmsg(zt, &msg, RECV_TIMEOUT);
-        if (rc == ZCM_EOK) {
-            {
-                unique_lock<mutex> lk(subRecvMutex);
-
-                // Check if message matches a non regex channel
-                auto it = subs.find(msg.channel);
-                if (it == subs.end()) {
-                    // Check if message matches a regex channel
-                    bool foundRegex = false;
-                    for (zcm_sub_t* sub : subRegex) {
-                        regex* r = (regex*)sub->regexobj;
-                        if (regex_match(msg.channel, *r)) {
-                            foundRegex = true;
-                            break;
-                        }
-                    }
-                    // No subscription actually wants the message
-                    if (!foundRegex) continue;
-                }
-            }
+        zcm_msg_t msgs[RECV_BATCH_SIZE];
+        size_t n = RECV_BATCH_SIZE;
+        int rc = zcm_trans_recvmsg_batch(zt, msgs, &n, RECV_TIMEOUT);
+        if (rc != ZCM_EOK) continue;
+
+        bool wanted[RECV_BATCH_SIZE];
+        {
+            auto table = subTable.read(READER_RECV);
+            // Check if any subscription actually wants each message
+            for (size_t i = 0; i < n; ++i)
+                wanted[i] = !matchingSubs(recvCache, *table, msgs[i].channel).empty();
+        }
 
-            // Note: After this returns, you have either successfully pushed a message
+        bool pushed = true;
+        for (size_t i = 0; i < n; ++i) {
+            zcm_msg_t* msg = &msgs[i];
+            // Note: After push() returns, you have either successfully pushed a message
             //       into the queue, or the queue was disabled and you will quit out of
-            //       this loop when you re-check the running condition
-            recvQueue.push(&msg);
+            //       this loop when you re-check the running condition. The rest of the
+            //       batch is dropped in that case
+            if (wanted[i] && pushed)
+                pushed = leased ? recvQueue.push(msg, zt) : recvQueue.push(msg);
+            if ((!wanted[i] || !pushed) && leased) zcm_trans_recvmsg_release(zt, msg);
         }
     }
     unique_lock<mutex> lk(recvStateMutex);
@@ -649,6 +818,17 @@ void zcm_blocking_t::hndlThreadFunc()
         recvThread = thread{&zcm_blocking::recvThreadFunc, this};
     }
 
+    if (poolThreads > 0) {
+        unique_lock<mutex> lk1(dispOneMutex);
+        unique_lock<mutex> lk2(poolMutex);
+        pool.reset(new Pool(poolThreads, recvQueue.getCapacity(),
+                            [this](Pool::Strand& s, shared_ptr<Msg>& m) { runPoolTask(s, m); },
+                            [this](size_t) {
+                                SET_THREAD_NAME("ZeroCM_pool");
+                                poolOwner = this;
+                            }));
+    }
+
     // Become the handle thread
     while (true) {
         {
@@ -671,6 +851,16 @@ void zcm_blocking_t::hndlThreadFunc()
         recvThread.join();
     }
 
+    if (pool) {
+        // Shutdown the dispatch pool. The messages it was handed have already left
+        // recvQueue, so they have to be dispatched before it goes away.
+        // Note: no locks here, callbacks may still flush or dispatch
+        pool->waitIdle();
+        unique_lock<mutex> lk1(dispOneMutex);
+        unique_lock<mutex> lk2(poolMutex);
+        pool.reset();
+    }
+
     unique_lock<mutex> lk(hndlStateMutex);
     hndlThreadState = THREAD_STATE_HALTED;
 }
@@ -683,31 +873,69 @@ void zcm_blocking_t::dispatchMsg(zcm_msg_t* msg)
     rbuf.data = msg->buf;
     rbuf.data_size = msg->len;
 
-    // Note: We use a lock on dispatch to ensure there is not
-    // a race on modifying and reading the 'subs' container.
-    // This means users cannot call zcm_subscribe or
-    // zcm_unsubscribe from a callback without deadlocking.
-    {
-        unique_lock<mutex> lk(subDispMutex);
+    // Note: holding on to the table version keeps every subscription in it alive,
+    // but does not keep anybody from subscribing or unsubscribing (even from a
+    // callback). Subscriptions removed in the meantime are skipped by callSub()
+    auto table = subTable.read(READER_DISP);
+    for (const SubRef& ref : matchingSubs(dispCache, *table, msg->channel)) {
+        callSub(*ref->key, &rbuf, msg->channel);
+    }
+}
 
-        // dispatch to a non regex channel
-        auto it = subs.find(msg->channel);
-        if (it != subs.end()) {
-            for (zcm_sub_t* sub : it->second) {
-                sub->callback(&rbuf, msg->channel, sub->usr);
-            }
-        }
+void zcm_blocking_t::dispatchMsgToPool(Msg* m)
+{
+    shared_ptr<Msg> shared = make_shared<Msg>(m);
+    const char* channel = shared->get()->channel;
 
-        // dispatch to any regex channels
-        for (zcm_sub_t* sub : subRegex) {
-            regex* r = (regex*)sub->regexobj;
-            if (regex_match(msg->channel, *r)) {
-                sub->callback(&rbuf, msg->channel, sub->usr);
-            }
-        }
+    auto table = subTable.read(READER_DISP);
+    for (const SubRef& ref : matchingSubs(dispCache, *table, channel)) {
+        pool->post(ref, shared_ptr<Msg>(shared));
     }
 }
 
+void zcm_blocking_t::runPoolTask(Pool::Strand& strand, shared_ptr<Msg>& m)
+{
+    zcm_msg_t* msg = m->get();
+
+    zcm_recv_buf_t rbuf;
+    rbuf.recv_utime = msg->utime;
+    rbuf.zcm = z;
+    rbuf.data = msg->buf;
+    rbuf.data_size = msg->len;
+
+    // Note: the strand keeps the subscription alive
+    callSub(*strand.key, &rbuf, msg->channel);
+}
+
+const zcm_blocking_t::SubList& zcm_blocking_t::matchingSubs(ChannelCache& cache,
+                                                            const SubTable& table,
+                                                            const char* channel)
+{
+    if (cache.version != table.version) {
+        cache.matches.clear();
+        cache.version = table.version;
+    }
+
+    cache.key.assign(channel);
+    auto it = cache.matches.find(cache.key);
+    if (it != cache.matches.end()) return it->second;
+
+    // Only a pathological number of distinct channels gets us here
+    if (cache.matches.size() >= MAX_CACHED_CHANNELS) cache.matches.clear();
+
+    SubList& list = cache.matches[cache.key];
+
+    auto sit = table.subs.find(cache.key);
+    if (sit != table.subs.end()) list = sit->second;
+
+    for (const SubRef& ref : table.subRegex) {
+        regex* r = (regex*)ref->key->sub->regexobj;
+        if (regex_match(channel, *r)) list.push_back(ref);
+    }
+
+    return list;
+}
+
 bool zcm_blocking_t::dispatchOneMessage(bool returnIfPaused)
 {
     Msg* m = recvQueue.top();
@@ -720,58 +948,61 @@ bool zcm_blocking_t::dispatchOneMessage(bool returnIfPaused)
         if (paused || hndlThreadState == THREAD_STATE_HALTING) return false;
     }
 
-    dispatchMsg(m->get());
+    if (pool) dispatchMsgToPool(m);
+    else      dispatchMsg(m->get());
     recvQueue.pop();
     return true;
 }
 
-bool zcm_blocking_t::sendOneMessage(bool returnIfPaused)
+// Hands up to maxMsgs queued messages to the transport at once and returns how many
+// of them left the queue (sent or dropped)
+size_t zcm_blocking_t::sendMessages(bool returnIfPaused, size_t maxMsgs)
 {
     Msg* m = sendQueue.top();
     // If the Queue was forcibly woken-up, recheck the
     // running condition, and then retry.
-    if (m == nullptr) return false;
+    if (m == nullptr) return 0;
 
     if (returnIfPaused) {
         unique_lock<mutex> lk(sendStateMutex);
-        if (paused || sendThreadState == THREAD_STATE_HALTING) return false;
+        if (paused || sendThreadState == THREAD_STATE_HALTING) return 0;
     }
 
-    zcm_msg_t* msg = m->get();
-    int ret = zcm_trans_sendmsg(zt, *msg);
-    if (ret != ZCM_EOK) ZCM_DEBUG("zcm_trans_sendmsg() returned error, dropping the msg!");
-    sendQueue.pop();
-    return true;
-}
+    if (maxMsgs > SEND_BATCH_SIZE) maxMsgs = SEND_BATCH_SIZE;
 
-bool zcm_blocking_t::deleteSubEntry(zcm_sub_t* sub, size_t nentriesleft)
-{
-    int rc = ZCM_EOK;
-    if (sub->regex) {
-        delete (std::regex*) sub->regexobj;
-        if (nentriesleft == 0) {
-            rc = zcm_trans_recvmsg_enable(zt, NULL, false);
-        }
-    } else {
-        rc = zcm_trans_recvmsg_enable(zt, sub->channel, false);
+    zcm_msg_t msgs[SEND_BATCH_SIZE];
+    size_t n = 0;
+    msgs[n++] = *m->get();
+    while (n < maxMsgs && (m = sendQueue.peek(n)) != nullptr)
+        msgs[n++] = *m->get();
+
+    size_t consumed = n;
+    int ret = zcm_trans_sendmsg_batch(zt, msgs, &consumed);
+    if (ret != ZCM_EOK) {
+        ZCM_DEBUG("zcm_trans_sendmsg_batch() returned error, dropping the msg!");
+        // Never leave the failing message at the front of the queue
+        if (consumed == 0) consumed = 1;
     }
-    delete sub;
-    return rc == ZCM_EOK;
+    if (consumed > n) consumed = n;
+
+    for (size_t i = 0; i < consumed; ++i) sendQueue.pop();
+    return consumed;
 }
 
-bool zcm_blocking_t::deleteFromSubList(SubList& slist, zcm_sub_t* sub)
+size_t zcm_blocking_t::getDispatchStats(zcm_dispatch_stats_t* stats, size_t n)
 {
-    for (size_t i = 0; i < slist.size(); i++) {
-        if (slist[i] == sub) {
-            // shrink the array by moving the last element
-            size_t last = slist.size()-1;
-            slist[i] = slist[last];
-            slist.resize(last);
-            // delete the element
-            return deleteSubEntry(sub, slist.size());
-        }
+    unique_lock<mutex> lk(poolMutex);
+    if (!pool) return 0;
+
+    auto st = pool->getStats();
+    for (size_t i = 0; i < n && i < st.size(); ++i) {
+        stats[i].thread      = i;
+        stats[i].queue_depth = st[i].queueDepth;
+        stats[i].dispatched  = st[i].dispatched;
+        stats[i].stolen      = st[i].stolen;
+        stats[i].dropped     = st[i].dropped;
     }
-    return false;
+    return st.size();
 }
 
 /////////////// C Interface Functions ////////////////
@@ -834,6 +1065,11 @@ void zcm_blocking_start(zcm_blocking_t* zcm)
     return zcm->start();
 }
 
+void zcm_blocking_start_pool(zcm_blocking_t* zcm, uint32_t nthreads)
+{
+    return zcm->start(nthreads);
+}
+
 void zcm_blocking_pause(zcm_blocking_t* zcm)
 {
     return zcm->pause();
@@ -869,4 +1105,20 @@ int  zcm_blocking_try_set_queue_size(zcm_blocking_t* zcm, uint32_t sz)
     return zcm->setQueueSize(sz, false);
 }
 
+uint32_t zcm_blocking_get_dispatch_stats(zcm_blocking_t* zcm, zcm_dispatch_stats_t* stats,
+                                         uint32_t n)
+{
+    return zcm->getDispatchStats(stats, n);
+}
+
+int zcm_blocking_get_trans_stats(zcm_blocking_t* zcm, zcm_trans_stats_t* stats)
+{
+    return zcm->getTransStats(stats);
+}
+
+int zcm_blocking_set_loss_handler(zcm_blocking_t* zcm, zcm_loss_handler_t cb, void* usr)
+{
+    return zcm->setLossHandler(cb, usr);
+}
+
 }
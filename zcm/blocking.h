@@ -28,6 +28,7 @@ int  zcm_blocking_try_flush(zcm_blocking_t* zcm);
 
 void zcm_blocking_run(zcm_blocking_t* zcm);
 void zcm_blocking_start(zcm_blocking_t* zcm);
+void zcm_blocking_start_pool(zcm_blocking_t* zcm, uint32_t nthreads);
 int  zcm_blocking_try_stop(zcm_blocking_t* zcm);
 void zcm_blocking_stop(zcm_blocking_t* zcm);
 void zcm_blocking_pause(zcm_blocking_t* zcm);
@@ -35,6 +36,10 @@ void zcm_blocking_resume(zcm_blocking_t* zcm);
 int  zcm_blocking_handle(zcm_blocking_t* zcm);
 void zcm_blocking_set_queue_size(zcm_blocking_t* zcm, uint32_t numMsgs);
 int  zcm_blocking_try_set_queue_size(zcm_blocking_t* zcm, uint32_t numMsgs);
+int zcm_blocking_get_trans_stats(zcm_blocking_t* zcm, zcm_trans_stats_t* stats);
+int zcm_blocking_set_loss_handler(zcm_blocking_t* zcm, zcm_loss_handler_t cb, void* usr);
+uint32_t zcm_blocking_get_dispatch_stats(zcm_blocking_t* zcm, zcm_dispatch_stats_t* stats,
+                                         uint32_t n);
 
 #ifdef __cplusplus
 }
@@ -1,10 +1,741 @@
+// For fopencookie()
+#define _GNU_SOURCE
 #include "zcm/eventlog.h"
 #include "zcm/util/ioutils.h"
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef USING_LZ4
+#include <lz4.h>
+#endif
+#ifdef USING_ZSTD
+#include <zstd.h>
+#endif
 
 #define MAGIC ((int32_t) 0xEDA1DA01L)
 
+// Magic, eventnum, timestamp, channellen and datalen
+#define EVENT_HDR_SIZE (4 + 8 + 8 + 4 + 4)
+// Longest channel name the readers accept
+#define MAX_CHANNELLEN 999
+
+// The index file starts with IDX_MAGIC and IDX_VERSION, followed by one entry per
+// event: timestamp (8 bytes), offset (8 bytes) and channel id (4 bytes), all in
+// network byte order like the log itself
+#define IDX_MAGIC ((int32_t) 0x5A494458L) // hex repr of ascii "ZIDX"
+#define IDX_VERSION 1
+#define IDX_HDR_SIZE 8
+#define IDX_ENTRY_SIZE 20
+
+// Initial size of the read-ahead buffer of zcm_eventlog_read_next_event_view(), it
+// grows if an event doesn't fit
+#define VIEW_BUF_SIZE (1 << 20)
+
+// A block-compressed log starts with BLK_FILE_MAGIC and BLK_VERSION, followed by
+// the blocks. Each block has a header (BLK_MAGIC, codec, uncompressed and compressed
+// length, offset of its first event in the uncompressed stream and the timestamps of
+// its first and last event) and then its data. When the log is closed, the block
+// index follows: one entry per block (offset in the file, offset in the stream,
+// first and last timestamp, both lengths and the codec) and a trailer with the
+// offset of the index, the number of blocks and BLK_TRAILER_MAGIC
+#define BLK_FILE_MAGIC ((int32_t) 0x5A4C4F47L) // hex repr of ascii "ZLOG"
+#define BLK_VERSION 1
+#define BLK_FILE_HDR_SIZE 8
+#define BLK_MAGIC ((int32_t) 0x5A424C4BL) // hex repr of ascii "ZBLK"
+#define BLK_HDR_SIZE 40
+#define BLK_FOOTER_ENTRY_SIZE 44
+#define BLK_TRAILER_MAGIC ((int32_t) 0x5A465452L) // hex repr of ascii "ZFTR"
+#define BLK_TRAILER_SIZE 20
+
+static inline int32_t get32(const uint8_t *p)
+{
+    return (int32_t) (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                      ((uint32_t)p[2] << 8) | (uint32_t)p[3]);
+}
+
+static inline int64_t get64(const uint8_t *p)
+{
+    return (int64_t) (((uint64_t)(uint32_t)get32(p) << 32) | (uint32_t)get32(p + 4));
+}
+
+/**** Block-compressed logs ****/
+
+typedef struct
+{
+    int64_t fileoff;   // where the block header is in the file
+    int64_t rawoff;    // where its first event is in the uncompressed stream
+    int64_t firstts;
+    int64_t lastts;
+    int32_t rawlen;
+    int32_t complen;
+    int32_t codec;
+} block_t;
+
+enum { SLOT_FREE, SLOT_FILLING, SLOT_QUEUED, SLOT_BUSY, SLOT_DONE };
+
+// A block on its way from write_event() to the file
+typedef struct
+{
+    int state;
+    block_t blk;
+    uint8_t *raw;
+    size_t rawsize;
+    uint8_t *comp;     // the compressed block, or raw when it is stored
+    size_t compsize;
+} block_slot_t;
+
+struct _zcm_eventlog_blocks_t
+{
+    FILE *f;           // the file itself, zcm_eventlog_t.f is the uncompressed stream
+                       // when reading
+    block_t *blocks;
+    size_t nblocks;
+    size_t capblocks;
+    int64_t rawsize;   // size of the uncompressed stream
+
+    // Reading
+    int64_t pos;
+    size_t cur;        // block in buf, nblocks if none
+    uint8_t *buf;
+    size_t bufsize;
+    uint8_t *cbuf;
+    size_t cbufsize;
+
+    // Writing
+    int codec;
+    int level;
+    int64_t fileoff;   // where the next block goes
+    block_slot_t *slots;
+    size_t nslots;
+    size_t fill;       // slot write_event() appends to
+    size_t next;       // next slot to go to the file
+    size_t inflight;   // slots from next up to fill
+    pthread_t *threads;
+    size_t nthreads;
+    pthread_mutex_t lk;
+    pthread_cond_t cond;
+    int stopping;
+};
+
+int zcm_eventlog_codec_supported(int codec)
+{
+    switch (codec) {
+        case ZCM_EVENTLOG_CODEC_NONE: return 1;
+#ifdef USING_LZ4
+        case ZCM_EVENTLOG_CODEC_LZ4: return 1;
+#endif
+#ifdef USING_ZSTD
+        case ZCM_EVENTLOG_CODEC_ZSTD: return 1;
+#endif
+        default: return 0;
+    }
+}
+
+static void put32(uint8_t *p, int32_t v)
+{
+    p[0] = (uint32_t) v >> 24;
+    p[1] = (uint32_t) v >> 16;
+    p[2] = (uint32_t) v >> 8;
+    p[3] = (uint32_t) v;
+}
+
+static void put64(uint8_t *p, int64_t v)
+{
+    put32(p, (int32_t) ((uint64_t) v >> 32));
+    put32(p + 4, (int32_t) (v & 0xffffffff));
+}
+
+static int read_at(FILE *f, void *buf, size_t len, int64_t off)
+{
+    int fd = fileno(f);
+    uint8_t *p = (uint8_t*) buf;
+    while (len > 0) {
+        ssize_t ret = pread(fd, p, len, (off_t) off);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return -1;
+        p += ret;
+        off += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void encode_block_header(uint8_t *p, const block_t *b)
+{
+    put32(p, BLK_MAGIC);
+    put32(p + 4, b->codec);
+    put32(p + 8, b->rawlen);
+    put32(p + 12, b->complen);
+    put64(p + 16, b->rawoff);
+    put64(p + 24, b->firstts);
+    put64(p + 32, b->lastts);
+}
+
+static int decode_block_header(const uint8_t *p, int64_t fileoff, block_t *b)
+{
+    if (get32(p) != BLK_MAGIC) return -1;
+    b->fileoff = fileoff;
+    b->codec = get32(p + 4);
+    b->rawlen = get32(p + 8);
+    b->complen = get32(p + 12);
+    b->rawoff = get64(p + 16);
+    b->firstts = get64(p + 24);
+    b->lastts = get64(p + 32);
+    if (b->rawlen <= 0 || b->complen <= 0 || b->rawoff < 0) return -1;
+    return 0;
+}
+
+static int add_block(zcm_eventlog_blocks_t *z, const block_t *b)
+{
+    if (z->nblocks == z->capblocks) {
+        size_t cap = z->capblocks ? 2 * z->capblocks : 64;
+        block_t *blocks = (block_t*) realloc(z->blocks, cap * sizeof(block_t));
+        if (!blocks) return -1;
+        z->blocks = blocks;
+        z->capblocks = cap;
+    }
+    z->blocks[z->nblocks++] = *b;
+    z->rawsize = b->rawoff + b->rawlen;
+    return 0;
+}
+
+// Loads the block index from the end of the file, or if there is none (the writer
+// didn't get to close the log) from the block headers. Returns where the last
+// complete block ends
+static int64_t load_blocks(zcm_eventlog_blocks_t *z)
+{
+    struct stat st;
+    if (fstat(fileno(z->f), &st) != 0) return -1;
+    int64_t size = st.st_size;
+
+    uint8_t tr[BLK_TRAILER_SIZE];
+    if (size >= BLK_FILE_HDR_SIZE + BLK_TRAILER_SIZE &&
+        read_at(z->f, tr, sizeof(tr), size - BLK_TRAILER_SIZE) == 0 &&
+        get32(tr + 16) == BLK_TRAILER_MAGIC) {
+        int64_t footeroff = get64(tr);
+        int64_t nblocks = get64(tr + 8);
+        if (footeroff >= BLK_FILE_HDR_SIZE && nblocks >= 0 &&
+            footeroff + nblocks * BLK_FOOTER_ENTRY_SIZE + BLK_TRAILER_SIZE == size) {
+            size_t len = nblocks * BLK_FOOTER_ENTRY_SIZE;
+            uint8_t *footer = (uint8_t*) malloc(len + 1);
+            int ok = footer && read_at(z->f, footer, len, footeroff) == 0;
+            int64_t i;
+            for (i = 0; ok && i < nblocks; ++i) {
+                const uint8_t *p = footer + i * BLK_FOOTER_ENTRY_SIZE;
+                block_t b;
+                b.fileoff = get64(p);
+                b.rawoff = get64(p + 8);
+                b.firstts = get64(p + 16);
+                b.lastts = get64(p + 24);
+                b.rawlen = get32(p + 32);
+                b.complen = get32(p + 36);
+                b.codec = get32(p + 40);
+                ok = add_block(z, &b) == 0;
+            }
+            free(footer);
+            if (ok) return footeroff;
+            z->nblocks = 0;
+            z->rawsize = 0;
+        }
+    }
+
+    int64_t off = BLK_FILE_HDR_SIZE;
+    uint8_t hdr[BLK_HDR_SIZE];
+    while (off + BLK_HDR_SIZE <= size && read_at(z->f, hdr, sizeof(hdr), off) == 0) {
+        block_t b;
+        if (decode_block_header(hdr, off, &b) != 0) break;
+        if (b.rawoff != z->rawsize || off + BLK_HDR_SIZE + b.complen > size) break;
+        if (add_block(z, &b) != 0) return -1;
+        off += BLK_HDR_SIZE + b.complen;
+    }
+    return off;
+}
+
+static int decompress_block(zcm_eventlog_blocks_t *z, size_t i)
+{
+    const block_t *b = &z->blocks[i];
+    if (z->bufsize < (size_t) b->rawlen) {
+        free(z->buf);
+        z->buf = (uint8_t*) malloc(b->rawlen);
+        z->bufsize = z->buf ? b->rawlen : 0;
+        if (!z->buf) return -1;
+    }
+    z->cur = z->nblocks;
+
+    int64_t dataoff = b->fileoff + BLK_HDR_SIZE;
+    if (b->codec == ZCM_EVENTLOG_CODEC_NONE) {
+        if (b->complen != b->rawlen) return -1;
+        if (read_at(z->f, z->buf, b->rawlen, dataoff) != 0) return -1;
+        z->cur = i;
+        return 0;
+    }
+
+    if (z->cbufsize < (size_t) b->complen) {
+        free(z->cbuf);
+        z->cbuf = (uint8_t*) malloc(b->complen);
+        z->cbufsize = z->cbuf ? b->complen : 0;
+        if (!z->cbuf) return -1;
+    }
+    if (read_at(z->f, z->cbuf, b->complen, dataoff) != 0) return -1;
+
+    switch (b->codec) {
+#ifdef USING_LZ4
+        case ZCM_EVENTLOG_CODEC_LZ4:
+            if (LZ4_decompress_safe((const char*) z->cbuf, (char*) z->buf,
+                                    b->complen, b->rawlen) != b->rawlen)
+                return -1;
+            break;
+#endif
+#ifdef USING_ZSTD
+        case ZCM_EVENTLOG_CODEC_ZSTD:
+            if (ZSTD_decompress(z->buf, b->rawlen, z->cbuf, b->complen) != (size_t) b->rawlen)
+                return -1;
+            break;
+#endif
+        default:
+            fprintf(stderr, "Log block uses an unsupported codec: %d\n", b->codec);
+            return -1;
+    }
+    z->cur = i;
+    return 0;
+}
+
+// The uncompressed stream, for fopencookie()
+static ssize_t blocks_read(void *cookie, char *buf, size_t size)
+{
+    zcm_eventlog_blocks_t *z = (zcm_eventlog_blocks_t*) cookie;
+    size_t done = 0;
+    while (done < size && z->pos < z->rawsize) {
+        if (z->cur == z->nblocks || z->pos < z->blocks[z->cur].rawoff ||
+            z->pos >= z->blocks[z->cur].rawoff + z->blocks[z->cur].rawlen) {
+            // The last block that starts at or before pos
+            size_t lo = 0, hi = z->nblocks;
+            while (hi - lo > 1) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (z->blocks[mid].rawoff <= z->pos) lo = mid;
+                else                                 hi = mid;
+            }
+            if (decompress_block(z, lo) != 0) {
+                errno = EIO;
+                return done > 0 ? (ssize_t) done : -1;
+            }
+        }
+        const block_t *b = &z->blocks[z->cur];
+        size_t off = z->pos - b->rawoff;
+        size_t n = b->rawlen - off;
+        if (n > size - done) n = size - done;
+        memcpy(buf + done, z->buf + off, n);
+        done += n;
+        z->pos += n;
+    }
+    return done;
+}
+
+static int blocks_seek(void *cookie, off64_t *offset, int whence)
+{
+    zcm_eventlog_blocks_t *z = (zcm_eventlog_blocks_t*) cookie;
+    int64_t pos;
+    switch (whence) {
+        case SEEK_SET: pos = *offset; break;
+        case SEEK_CUR: pos = z->pos + *offset; break;
+        case SEEK_END: pos = z->rawsize + *offset; break;
+        default: return -1;
+    }
+    if (pos < 0) return -1;
+    z->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+static void blocks_free(zcm_eventlog_blocks_t *z)
+{
+    size_t i;
+    for (i = 0; i < z->nslots; ++i) {
+        free(z->slots[i].raw);
+        free(z->slots[i].comp);
+    }
+    free(z->slots);
+    free(z->threads);
+    free(z->blocks);
+    free(z->buf);
+    free(z->cbuf);
+    if (z->f) fclose(z->f);
+    free(z);
+}
+
+static int blocks_close(void *cookie)
+{
+    blocks_free((zcm_eventlog_blocks_t*) cookie);
+    return 0;
+}
+
+// Called by zcm_eventlog_create() for logs opened with "r". Returns 0 if l->f is not
+// a block-compressed log, 1 if it is and l->f has been replaced by its uncompressed
+// stream, -1 on failure
+static int blocks_open_reader(zcm_eventlog_t *l)
+{
+    uint8_t hdr[BLK_FILE_HDR_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), l->f) != sizeof(hdr) || get32(hdr) != BLK_FILE_MAGIC) {
+        fseeko(l->f, 0, SEEK_SET);
+        return 0;
+    }
+    if (get32(hdr + 4) != BLK_VERSION) {
+        fprintf(stderr, "Unsupported block-compressed log version: %d\n", get32(hdr + 4));
+        return -1;
+    }
+
+    zcm_eventlog_blocks_t *z =
+        (zcm_eventlog_blocks_t*) calloc(1, sizeof(zcm_eventlog_blocks_t));
+    z->f = l->f;
+    if (load_blocks(z) < 0) {
+        z->f = NULL;
+        blocks_free(z);
+        return -1;
+    }
+    z->cur = z->nblocks;
+
+    cookie_io_functions_t funcs;
+    memset(&funcs, 0, sizeof(funcs));
+    funcs.read = blocks_read;
+    funcs.seek = blocks_seek;
+    funcs.close = blocks_close;
+    FILE *f = fopencookie(z, "rb", funcs);
+    if (!f) {
+        z->f = NULL;
+        blocks_free(z);
+        return -1;
+    }
+    l->f = f;
+    l->blocks = z;
+    return 1;
+}
+
+static void compress_slot(const zcm_eventlog_blocks_t *z, block_slot_t *s)
+{
+    size_t rawlen = s->blk.rawlen;
+    size_t complen = 0;
+
+    switch (z->codec) {
+#ifdef USING_LZ4
+        case ZCM_EVENTLOG_CODEC_LZ4:
+            complen = LZ4_compress_default((const char*) s->raw, (char*) s->comp,
+                                           (int) rawlen, (int) s->compsize);
+            break;
+#endif
+#ifdef USING_ZSTD
+        case ZCM_EVENTLOG_CODEC_ZSTD:
+            // Note: level 0 is zstd's default level
+            complen = ZSTD_compress(s->comp, s->compsize, s->raw, rawlen, z->level);
+            if (ZSTD_isError(complen)) complen = 0;
+            break;
+#endif
+        default:
+            break;
+    }
+
+    // Blocks that don't get any smaller are stored as they are
+    if (complen == 0 || complen >= rawlen) {
+        s->blk.codec = ZCM_EVENTLOG_CODEC_NONE;
+        s->blk.complen = rawlen;
+    } else {
+        s->blk.codec = z->codec;
+        s->blk.complen = complen;
+    }
+}
+
+static size_t compress_bound(int codec, size_t len)
+{
+    switch (codec) {
+#ifdef USING_LZ4
+        case ZCM_EVENTLOG_CODEC_LZ4: return LZ4_compressBound((int) len);
+#endif
+#ifdef USING_ZSTD
+        case ZCM_EVENTLOG_CODEC_ZSTD: return ZSTD_compressBound(len);
+#endif
+        default: return 0;
+    }
+}
+
+// Makes room for len more bytes in the slot
+static int slot_reserve(const zcm_eventlog_blocks_t *z, block_slot_t *s, size_t len)
+{
+    size_t need = s->blk.rawlen + len;
+    if (need <= s->rawsize) return 0;
+
+    size_t size = s->rawsize ? s->rawsize : ZCM_EVENTLOG_BLOCK_SIZE;
+    while (size < need) size *= 2;
+    uint8_t *raw = (uint8_t*) realloc(s->raw, size);
+    if (!raw) return -1;
+    s->raw = raw;
+    s->rawsize = size;
+
+    size_t compsize = compress_bound(z->codec, size);
+    if (compsize > 0) {
+        uint8_t *comp = (uint8_t*) realloc(s->comp, compsize);
+        if (!comp) return -1;
+        s->comp = comp;
+        s->compsize = compsize;
+    }
+    return 0;
+}
+
+static void *compress_thread(void *usr)
+{
+    zcm_eventlog_blocks_t *z = (zcm_eventlog_blocks_t*) usr;
+    pthread_mutex_lock(&z->lk);
+    while (1) {
+        size_t i;
+        for (i = 0; i < z->nslots; ++i)
+            if (z->slots[i].state == SLOT_QUEUED) break;
+        if (i == z->nslots) {
+            if (z->stopping) break;
+            pthread_cond_wait(&z->cond, &z->lk);
+            continue;
+        }
+        block_slot_t *s = &z->slots[i];
+        s->state = SLOT_BUSY;
+        pthread_mutex_unlock(&z->lk);
+
+        compress_slot(z, s);
+
+        pthread_mutex_lock(&z->lk);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&z->cond);
+    }
+    pthread_mutex_unlock(&z->lk);
+    return NULL;
+}
+
+static int write_slot(zcm_eventlog_blocks_t *z, block_slot_t *s)
+{
+    uint8_t hdr[BLK_HDR_SIZE];
+    const uint8_t *data = s->blk.codec == ZCM_EVENTLOG_CODEC_NONE ? s->raw : s->comp;
+    s->blk.fileoff = z->fileoff;
+    encode_block_header(hdr, &s->blk);
+    if (fwrite(hdr, 1, sizeof(hdr), z->f) != sizeof(hdr)) return -1;
+    if (fwrite(data, 1, s->blk.complen, z->f) != (size_t) s->blk.complen) return -1;
+    z->fileoff += BLK_HDR_SIZE + s->blk.complen;
+    return add_block(z, &s->blk);
+}
+
+// Writes out the compressed slots in order, waiting for the ones that are still
+// being compressed until no more than 'keep' are left
+static int write_done_slots(zcm_eventlog_blocks_t *z, size_t keep)
+{
+    int ret = 0;
+    while (z->inflight > 0) {
+        block_slot_t *s = &z->slots[z->next];
+        pthread_mutex_lock(&z->lk);
+        while (z->inflight > keep && s->state != SLOT_DONE)
+            pthread_cond_wait(&z->cond, &z->lk);
+        int done = s->state == SLOT_DONE;
+        pthread_mutex_unlock(&z->lk);
+        if (!done) break;
+
+        if (write_slot(z, s) != 0) ret = -1;
+        s->state = SLOT_FREE;
+        z->next = (z->next + 1) % z->nslots;
+        z->inflight--;
+    }
+    return ret;
+}
+
+// Hands the slot being filled over for compression and starts the next one
+static int submit_slot(zcm_eventlog_blocks_t *z)
+{
+    block_slot_t *s = &z->slots[z->fill];
+    if (s->blk.rawlen == 0) return 0;
+
+    if (z->nthreads == 0) {
+        compress_slot(z, s);
+        int ret = write_slot(z, s);
+        s->blk.rawlen = 0;
+        return ret;
+    }
+
+    pthread_mutex_lock(&z->lk);
+    s->state = SLOT_QUEUED;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lk);
+    z->inflight++;
+
+    // If all slots are in use, the oldest one has to go to the file before the
+    // next block can be started in it
+    z->fill = (z->fill + 1) % z->nslots;
+    int ret = write_done_slots(z, z->nslots - 1);
+    z->slots[z->fill].state = SLOT_FILLING;
+    z->slots[z->fill].blk.rawlen = 0;
+    return ret;
+}
+
+static int blocks_write_event(zcm_eventlog_t *l, const zcm_eventlog_event_t *le)
+{
+    zcm_eventlog_blocks_t *z = l->blocks;
+    size_t len = EVENT_HDR_SIZE + le->channellen + le->datalen;
+
+    // Events never span blocks
+    block_slot_t *s = &z->slots[z->fill];
+    if (s->blk.rawlen > 0 && s->blk.rawlen + len > ZCM_EVENTLOG_BLOCK_SIZE) {
+        if (submit_slot(z) != 0) return -1;
+        s = &z->slots[z->fill];
+    }
+    if (slot_reserve(z, s, len) != 0) return -1;
+
+    if (s->blk.rawlen == 0) {
+        s->blk.rawoff = z->rawsize;
+        s->blk.firstts = le->timestamp;
+    }
+    s->blk.lastts = le->timestamp;
+
+    uint8_t *p = s->raw + s->blk.rawlen;
+    put32(p, MAGIC);
+    put64(p + 4, l->eventcount);
+    put64(p + 12, le->timestamp);
+    put32(p + 20, le->channellen);
+    put32(p + 24, le->datalen);
+    memcpy(p + EVENT_HDR_SIZE, le->channel, le->channellen);
+    memcpy(p + EVENT_HDR_SIZE + le->channellen, le->data, le->datalen);
+    s->blk.rawlen += len;
+    z->rawsize += len;
+
+    l->eventcount++;
+    return 0;
+}
+
+// Writes what is left and the block index. Returns 0 on success -1 on failure
+static int blocks_finish(zcm_eventlog_blocks_t *z)
+{
+    int ret = submit_slot(z);
+    if (z->nthreads > 0) {
+        if (write_done_slots(z, 0) != 0) ret = -1;
+
+        pthread_mutex_lock(&z->lk);
+        z->stopping = 1;
+        pthread_cond_broadcast(&z->cond);
+        pthread_mutex_unlock(&z->lk);
+        size_t i;
+        for (i = 0; i < z->nthreads; ++i) pthread_join(z->threads[i], NULL);
+        pthread_mutex_destroy(&z->lk);
+        pthread_cond_destroy(&z->cond);
+        z->nthreads = 0;
+    }
+
+    size_t i;
+    uint8_t entry[BLK_FOOTER_ENTRY_SIZE];
+    for (i = 0; i < z->nblocks && ret == 0; ++i) {
+        const block_t *b = &z->blocks[i];
+        put64(entry, b->fileoff);
+        put64(entry + 8, b->rawoff);
+        put64(entry + 16, b->firstts);
+        put64(entry + 24, b->lastts);
+        put32(entry + 32, b->rawlen);
+        put32(entry + 36, b->complen);
+        put32(entry + 40, b->codec);
+        if (fwrite(entry, 1, sizeof(entry), z->f) != sizeof(entry)) ret = -1;
+    }
+    uint8_t tr[BLK_TRAILER_SIZE];
+    put64(tr, z->fileoff);
+    put64(tr + 8, z->nblocks);
+    put32(tr + 16, BLK_TRAILER_MAGIC);
+    if (ret == 0 && fwrite(tr, 1, sizeof(tr), z->f) != sizeof(tr)) ret = -1;
+    return ret;
+}
+
+int zcm_eventlog_set_compression(zcm_eventlog_t *l, int codec, int level, int nthreads)
+{
+    if (l->blocks || l->idx || !zcm_eventlog_codec_supported(codec) || nthreads < 0)
+        return -1;
+
+    // Note: l->f was opened for writing. Anything already in it has to be a
+    //       block-compressed log, which is continued after its last complete block
+    fflush(l->f);
+    struct stat st;
+    if (fstat(fileno(l->f), &st) != 0) return -1;
+
+    zcm_eventlog_blocks_t *z =
+        (zcm_eventlog_blocks_t*) calloc(1, sizeof(zcm_eventlog_blocks_t));
+    z->codec = codec;
+    z->level = level;
+
+    if (st.st_size == 0) {
+        uint8_t hdr[BLK_FILE_HDR_SIZE];
+        put32(hdr, BLK_FILE_MAGIC);
+        put32(hdr + 4, BLK_VERSION);
+        if (fwrite(hdr, 1, sizeof(hdr), l->f) != sizeof(hdr)) {
+            free(z);
+            return -1;
+        }
+        z->fileoff = BLK_FILE_HDR_SIZE;
+    } else {
+        uint8_t hdr[BLK_FILE_HDR_SIZE];
+        z->f = l->f;
+        int64_t end = -1;
+        if (read_at(l->f, hdr, sizeof(hdr), 0) == 0 && get32(hdr) == BLK_FILE_MAGIC &&
+            get32(hdr + 4) == BLK_VERSION)
+            end = load_blocks(z);
+        z->f = NULL;
+        // Drop the old block index, it is written again when the log is closed
+        if (end < 0 || ftruncate(fileno(l->f), end) != 0) {
+            free(z->blocks);
+            free(z);
+            return -1;
+        }
+        fseeko(l->f, 0, SEEK_END);
+        z->fileoff = end;
+    }
+
+    z->nthreads = nthreads;
+    z->nslots = nthreads > 0 ? nthreads + 2 : 1;
+    z->slots = (block_slot_t*) calloc(z->nslots, sizeof(block_slot_t));
+    z->slots[0].state = SLOT_FILLING;
+    if (nthreads > 0) {
+        pthread_mutex_init(&z->lk, NULL);
+        pthread_cond_init(&z->cond, NULL);
+        z->threads = (pthread_t*) calloc(nthreads, sizeof(pthread_t));
+        int i;
+        for (i = 0; i < nthreads; ++i)
+            pthread_create(&z->threads[i], NULL, compress_thread, z);
+    }
+
+    z->f = l->f;
+    l->blocks = z;
+    return 0;
+}
+
+// Returns 0 on success -1 on failure
+static int blocks_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
+{
+    zcm_eventlog_blocks_t *z = l->blocks;
+
+    // The first block that has an event at or after the timestamp
+    size_t lo = 0, hi = z->nblocks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (z->blocks[mid].lastts < timestamp) lo = mid + 1;
+        else                                   hi = mid;
+    }
+    if (lo == z->nblocks) return -1;
+
+    fseeko(l->f, z->blocks[lo].rawoff, SEEK_SET);
+    while (1) {
+        off_t off = ftello(l->f);
+        zcm_eventlog_event_t *le = zcm_eventlog_read_next_event(l);
+        if (!le) return -1;
+        int64_t ts = le->timestamp;
+        zcm_eventlog_free_event(le);
+        if (ts >= timestamp) {
+            fseeko(l->f, off, SEEK_SET);
+            return 0;
+        }
+    }
+}
+
 zcm_eventlog_t *zcm_eventlog_create(const char *path, const char *mode)
 {
     assert(!strcmp(mode, "r") || !strcmp(mode, "w") || !strcmp(mode, "a"));
@@ -13,7 +744,9 @@ zcm_eventlog_t *zcm_eventlog_create(const char *path, const char *mode)
     else if(*mode == 'r')
         mode = "rb";
     else if(*mode == 'a')
-        mode = "ab";
+        // Note: read access lets zcm_eventlog_set_compression() continue a
+        //       block-compressed log, writes still always go to the end
+        mode = "a+b";
     else
         return NULL;
 
@@ -26,19 +759,53 @@ zcm_eventlog_t *zcm_eventlog_create(const char *path, const char *mode)
     }
 
     l->eventcount = 0;
+    l->rbufoff = -1;
+
+    if (*mode == 'r' && blocks_open_reader(l) < 0) {
+        fclose(l->f);
+        free(l);
+        return NULL;
+    }
+
+    // Note: the sidecar index is only opened by the first seek, most readers never seek
+    if (*mode == 'r' && !l->blocks) {
+        size_t len = strlen(path);
+        l->path = (char*) malloc(len + 1);
+        memcpy(l->path, path, len + 1);
+    }
 
     return l;
 }
 
 void zcm_eventlog_destroy(zcm_eventlog_t *l)
 {
+    // Note: when reading, l->f owns l->blocks and frees it
+    if (l->blocks && l->blocks->slots) {
+        if (blocks_finish(l->blocks) != 0)
+            fprintf(stderr, "Unable to finish writing the compressed log\n");
+        l->blocks->f = NULL;
+        blocks_free(l->blocks);
+    }
     fflush(l->f);
     fclose(l->f);
+    if (l->idx) fclose(l->idx);
+    if (l->seekreader) zcm_eventlog_reader_destroy(l->seekreader);
+    free(l->path);
+    free(l->rbuf);
     free(l);
 }
 
+// Hands the position back to l->f after zcm_eventlog_read_next_event_view()
+static void release_view(zcm_eventlog_t *l)
+{
+    if (l->rbufoff < 0) return;
+    fseeko(l->f, (off_t) (l->rbufoff + l->rbufstart), SEEK_SET);
+    l->rbufoff = -1;
+}
+
 FILE *zcm_eventlog_get_fileptr(zcm_eventlog_t *l)
 {
+    release_view(l);
     return l->f;
 }
 
@@ -85,8 +852,36 @@ static int64_t get_next_event_time(zcm_eventlog_t *l)
     return timestamp;
 }
 
+// Seeks through the sidecar index of a plain log. Returns 0 on success -1 if there is
+// no usable index or the index and the part of the log it was opened with don't reach
+// the timestamp
+static int index_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
+{
+    if (!l->seekreader) {
+        if (!l->path) return -1;
+        zcm_eventlog_reader_t *r = zcm_eventlog_reader_create(l->path, NULL);
+        if (!r || zcm_eventlog_reader_num_indexed(r) <= 0) {
+            // No index worth using, don't look again on every seek
+            if (r) zcm_eventlog_reader_destroy(r);
+            free(l->path);
+            l->path = NULL;
+            return -1;
+        }
+        l->seekreader = r;
+    }
+
+    if (0 != zcm_eventlog_reader_seek_to_timestamp(l->seekreader, timestamp)) return -1;
+    fseeko(l->f, zcm_eventlog_reader_tell(l->seekreader), SEEK_SET);
+    // Like the bisection, leaves eventcount at the event found
+    return get_next_event_time(l) < 0 ? -1 : 0;
+}
+
 int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t *l, int64_t timestamp)
 {
+    release_view(l);
+    if (l->blocks) return blocks_seek_to_timestamp(l, timestamp);
+    if (0 == index_seek_to_timestamp(l, timestamp)) return 0;
+
     fseeko (l->f, 0, SEEK_END);
     off_t file_len = ftello(l->f);
 
@@ -188,18 +983,21 @@ static zcm_eventlog_event_t *zcm_event_read_helper(zcm_eventlog_t *l, int rewind
 
 zcm_eventlog_event_t *zcm_eventlog_read_next_event(zcm_eventlog_t *l)
 {
+    release_view(l);
     if (sync_stream(l)) return NULL;
     return zcm_event_read_helper(l, 0);
 }
 
 zcm_eventlog_event_t *zcm_eventlog_read_prev_event(zcm_eventlog_t *l)
 {
+    release_view(l);
     if (sync_stream_backwards(l) < 0) return NULL;
     return zcm_event_read_helper(l, 1);
 }
 
 zcm_eventlog_event_t *zcm_eventlog_read_event_at_offset(zcm_eventlog_t *l, off_t offset)
 {
+    release_view(l);
     fseeko(l->f, offset, SEEK_SET);
     if (sync_stream(l)) return NULL;
     return zcm_event_read_helper(l, 0);
@@ -213,8 +1011,140 @@ void zcm_eventlog_free_event(zcm_eventlog_event_t *le)
     free(le);
 }
 
+/**** View reader ****/
+
+// Makes sure there are at least n unread bytes in the read-ahead buffer, moving the
+// unread part to the front and growing the buffer as needed.
+// Returns 0 on success -1 at the end of the log or on failure
+static int view_fill(zcm_eventlog_t *l, size_t n)
+{
+    size_t avail = l->rbufend - l->rbufstart;
+    if (avail >= n) return 0;
+
+    if (l->rbufstart > 0) {
+        memmove(l->rbuf, l->rbuf + l->rbufstart, avail);
+        l->rbufoff += l->rbufstart;
+        l->rbufstart = 0;
+        l->rbufend = avail;
+    }
+    if (n > l->rbufsize) {
+        size_t size = l->rbufsize;
+        while (size < n) size *= 2;
+        uint8_t *buf = (uint8_t*) realloc(l->rbuf, size);
+        if (!buf) return -1;
+        l->rbuf = buf;
+        l->rbufsize = size;
+    }
+
+    // Note: pread() because l->f may have read ahead of us on the same descriptor.
+    //       Streams without one (block-compressed logs) are read through l->f,
+    //       which is where the view reader left it
+    int fd = fileno(l->f);
+    while (l->rbufend < n) {
+        ssize_t ret;
+        if (fd >= 0) {
+            ret = pread(fd, l->rbuf + l->rbufend, l->rbufsize - l->rbufend,
+                        (off_t) (l->rbufoff + l->rbufend));
+            if (ret < 0 && errno == EINTR) continue;
+        } else {
+            ret = fread(l->rbuf + l->rbufend, 1, l->rbufsize - l->rbufend, l->f);
+        }
+        if (ret <= 0) return -1;
+        l->rbufend += ret;
+    }
+    return 0;
+}
+
+int zcm_eventlog_read_next_event_view(zcm_eventlog_t *l, zcm_eventlog_event_view_t *view)
+{
+    if (l->rbufoff < 0) {
+        off_t pos = ftello(l->f);
+        if (pos < 0) return -1;
+        if (!l->rbuf) {
+            l->rbuf = (uint8_t*) malloc(VIEW_BUF_SIZE);
+            if (!l->rbuf) return -1;
+            l->rbufsize = VIEW_BUF_SIZE;
+            // Let the kernel read ahead more aggressively
+            posix_fadvise(fileno(l->f), 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        l->rbufoff = pos;
+        l->rbufstart = 0;
+        l->rbufend = 0;
+    }
+
+    // Find the next magic, just like sync_stream()
+    while (1) {
+        if (view_fill(l, 4) != 0) return -1;
+        size_t avail = l->rbufend - l->rbufstart;
+        const uint8_t *q = (const uint8_t*)
+            memchr(l->rbuf + l->rbufstart, 0xED, avail - 3);
+        if (!q) {
+            l->rbufstart += avail - 3;
+            continue;
+        }
+        l->rbufstart = q - l->rbuf;
+        if (get32(q) == MAGIC) break;
+        l->rbufstart++;
+    }
+
+    if (view_fill(l, EVENT_HDR_SIZE) != 0) return -1;
+    const uint8_t *p = l->rbuf + l->rbufstart;
+    int32_t channellen = get32(p + 20);
+    int32_t datalen = get32(p + 24);
+
+    // Sanity check the channel length and data length
+    if (channellen <= 0 || channellen > MAX_CHANNELLEN) {
+        fprintf(stderr, "Log event has invalid channel length: %d\n", channellen);
+        l->rbufstart += EVENT_HDR_SIZE;
+        return -1;
+    }
+    if (datalen < 0) {
+        fprintf(stderr, "Log event has invalid data length: %d\n", datalen);
+        l->rbufstart += EVENT_HDR_SIZE;
+        return -1;
+    }
+
+    size_t size = EVENT_HDR_SIZE + channellen + datalen;
+    if (view_fill(l, size) != 0) return -1;
+
+    // Check that there's a valid event or the EOF after this event.
+    if (view_fill(l, size + 4) == 0 &&
+        get32(l->rbuf + l->rbufstart + size) != MAGIC) {
+        fprintf(stderr, "Invalid header after log data\n");
+        l->rbufstart += size;
+        return -1;
+    }
+
+    p = l->rbuf + l->rbufstart;
+    view->eventnum = get64(p + 4);
+    view->timestamp = get64(p + 12);
+    view->channellen = channellen;
+    view->datalen = datalen;
+    view->channel = (const char*) (p + EVENT_HDR_SIZE);
+    view->data = p + EVENT_HDR_SIZE + channellen;
+    l->rbufstart += size;
+    return 0;
+}
+
+static int write_index_header(FILE *f)
+{
+    if (0 != fwrite32(f, IDX_MAGIC)) return -1;
+    if (0 != fwrite32(f, IDX_VERSION)) return -1;
+    return 0;
+}
+
+static int write_index_entry(FILE *f, int64_t timestamp, int64_t offset, uint32_t id)
+{
+    if (0 != fwrite64(f, timestamp)) return -1;
+    if (0 != fwrite64(f, offset)) return -1;
+    if (0 != fwrite32(f, (int32_t) id)) return -1;
+    return 0;
+}
+
 int zcm_eventlog_write_event(zcm_eventlog_t *l, const zcm_eventlog_event_t *le)
 {
+    if (l->blocks) return blocks_write_event(l, le);
+
     if (0 != fwrite32(l->f, MAGIC)) return -1;
 
     if (0 != fwrite64(l->f, l->eventcount)) return -1;
@@ -230,5 +1160,405 @@ int zcm_eventlog_write_event(zcm_eventlog_t *l, const zcm_eventlog_event_t *le)
 
     l->eventcount++;
 
+    if (l->idx) {
+        uint32_t id = zcm_eventlog_channel_id(le->channel, le->channellen);
+        if (0 != write_index_entry(l->idx, le->timestamp, l->idxpos, id)) {
+            // A partial index would be wrong, better to have none
+            fclose(l->idx);
+            l->idx = NULL;
+        }
+        l->idxpos += EVENT_HDR_SIZE + le->channellen + le->datalen;
+    }
+
+    return 0;
+}
+
+/**** Sidecar index ****/
+
+// FNV-1a
+uint32_t zcm_eventlog_channel_id(const char *channel, int32_t channellen)
+{
+    uint32_t hash = 2166136261u;
+    int32_t i;
+    for (i = 0; i < channellen; ++i) {
+        hash ^= (uint8_t) channel[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Where the last event in the index ends in the log, 0 if the index has no events.
+// Returns -1 if the index is broken or doesn't match the log
+static off_t index_end(FILE *idx, FILE *log)
+{
+    uint8_t buf[EVENT_HDR_SIZE];
+    if (0 != fseeko(idx, 0, SEEK_END)) return -1;
+    off_t size = ftello(idx);
+    if (size < IDX_HDR_SIZE || (size - IDX_HDR_SIZE) % IDX_ENTRY_SIZE != 0) return -1;
+
+    if (0 != fseeko(idx, 0, SEEK_SET) || 1 != fread(buf, IDX_HDR_SIZE, 1, idx)) return -1;
+    if (get32(buf) != IDX_MAGIC || get32(buf + 4) != IDX_VERSION) return -1;
+    if (size == IDX_HDR_SIZE) return 0;
+
+    if (0 != fseeko(idx, size - IDX_ENTRY_SIZE, SEEK_SET) ||
+        1 != fread(buf, IDX_ENTRY_SIZE, 1, idx))
+        return -1;
+    off_t offset = (off_t) get64(buf + 8);
+
+    if (offset < 0 || 0 != fseeko(log, offset, SEEK_SET) ||
+        1 != fread(buf, EVENT_HDR_SIZE, 1, log))
+        return -1;
+    int32_t channellen = get32(buf + 20);
+    int32_t datalen = get32(buf + 24);
+    if (get32(buf) != MAGIC || channellen < 0 || datalen < 0) return -1;
+    return offset + EVENT_HDR_SIZE + channellen + datalen;
+}
+
+int zcm_eventlog_enable_index(zcm_eventlog_t *l, const char *idxpath)
+{
+    if (l->idx || l->blocks) return -1;
+
+    // An empty log gets a new index, a log that is appended to has to have one
+    // already that covers everything up to here
+    fseeko(l->f, 0, SEEK_END);
+    off_t pos = ftello(l->f);
+    if (pos < 0) return -1;
+
+    l->idx = fopen(idxpath, pos == 0 ? "wb" : "a+b");
+    if (!l->idx) return -1;
+    int ret = -1;
+    if (pos == 0) ret = write_index_header(l->idx);
+    else if (index_end(l->idx, l->f) == pos) ret = 0;
+    // Note: writes go to the end of both files, but have to follow a seek after reading
+    fseeko(l->f, 0, SEEK_END);
+    fseeko(l->idx, 0, SEEK_END);
+    if (ret != 0) {
+        fclose(l->idx);
+        l->idx = NULL;
+        return -1;
+    }
+    l->idxpos = pos;
     return 0;
 }
+
+int zcm_eventlog_build_index(const char *logpath, const char *idxpath)
+{
+    zcm_eventlog_reader_t *r = zcm_eventlog_reader_create(logpath, "");
+    if (!r) return -1;
+
+    size_t len = strlen(idxpath);
+    char *tmppath = (char*) malloc(len + 5);
+    memcpy(tmppath, idxpath, len);
+    memcpy(tmppath + len, ".tmp", 5);
+
+    int ret = -1;
+    FILE *f = fopen(tmppath, "wb");
+    if (f && 0 == write_index_header(f)) {
+        const zcm_eventlog_event_t *le;
+        while (1) {
+            off_t offset = zcm_eventlog_reader_tell(r);
+            le = zcm_eventlog_reader_read_next(r);
+            if (!le) {
+                ret = 0;
+                break;
+            }
+            // read_next() may have skipped garbage, the event ends where we are now
+            offset = zcm_eventlog_reader_tell(r) -
+                     (EVENT_HDR_SIZE + le->channellen + le->datalen);
+            uint32_t id = zcm_eventlog_channel_id(le->channel, le->channellen);
+            if (0 != write_index_entry(f, le->timestamp, offset, id)) break;
+        }
+    }
+    if (f && 0 != fclose(f)) ret = -1;
+    if (ret == 0 && 0 != rename(tmppath, idxpath)) ret = -1;
+    if (ret != 0) unlink(tmppath);
+
+    free(tmppath);
+    zcm_eventlog_reader_destroy(r);
+    return ret;
+}
+
+/**** Memory-mapped reader ****/
+
+struct _zcm_eventlog_reader_t
+{
+    const uint8_t *map;
+    size_t size;
+
+    const uint8_t *idxmap;  // NULL without an index
+    size_t idxsize;
+    int64_t nindexed;
+    size_t indexend;        // where the last indexed event ends
+
+    size_t pos;
+    zcm_eventlog_event_t event;
+    char channel[MAX_CHANNELLEN + 1];
+};
+
+static inline int64_t index_timestamp(const zcm_eventlog_reader_t *r, int64_t i)
+{
+    return get64(r->idxmap + IDX_HDR_SIZE + i * IDX_ENTRY_SIZE);
+}
+
+static inline size_t index_offset(const zcm_eventlog_reader_t *r, int64_t i)
+{
+    return (size_t) get64(r->idxmap + IDX_HDR_SIZE + i * IDX_ENTRY_SIZE + 8);
+}
+
+// Parses the event whose magic is at 'off' into 'le' (without its channel). Returns
+// the offset right after the event, or 0 if there is no valid event at 'off'
+static size_t parse_event(const zcm_eventlog_reader_t *r, size_t off, zcm_eventlog_event_t *le)
+{
+    if (off + EVENT_HDR_SIZE > r->size) return 0;
+    const uint8_t *p = r->map + off;
+    if (get32(p) != MAGIC) return 0;
+
+    int32_t channellen = get32(p + 20);
+    int32_t datalen = get32(p + 24);
+    if (channellen <= 0 || channellen > MAX_CHANNELLEN || datalen < 0) return 0;
+
+    size_t end = off + EVENT_HDR_SIZE + channellen + datalen;
+    if (end > r->size) return 0;
+    // Just like the stream reader: a valid event or the end of the log must follow
+    if (end + 4 <= r->size && get32(r->map + end) != MAGIC) return 0;
+
+    le->eventnum = get64(p + 4);
+    le->timestamp = get64(p + 12);
+    le->channellen = channellen;
+    le->datalen = datalen;
+    return end;
+}
+
+// Finds the first valid event at or after 'off'. Returns its end (and its start in
+// 'start'), or 0 if there is none
+static size_t find_event(const zcm_eventlog_reader_t *r, size_t off,
+                         zcm_eventlog_event_t *le, size_t *start)
+{
+    while (off + EVENT_HDR_SIZE <= r->size) {
+        const uint8_t *q = (const uint8_t*) memchr(r->map + off, 0xED, r->size - off - 3);
+        if (!q) return 0;
+        off = q - r->map;
+        size_t end = parse_event(r, off, le);
+        if (end) {
+            *start = off;
+            return end;
+        }
+        off++;
+    }
+    return 0;
+}
+
+static const zcm_eventlog_event_t *finish_event(zcm_eventlog_reader_t *r, size_t start)
+{
+    zcm_eventlog_event_t *le = &r->event;
+    const uint8_t *p = r->map + start + EVENT_HDR_SIZE;
+    memcpy(r->channel, p, le->channellen);
+    r->channel[le->channellen] = '\0';
+    le->channel = r->channel;
+    le->data = (uint8_t*) (p + le->channellen);
+    return le;
+}
+
+static void load_index(zcm_eventlog_reader_t *r, const char *idxpath)
+{
+    int fd = open(idxpath, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= IDX_HDR_SIZE)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+
+    const uint8_t *p = (const uint8_t*) map;
+    if (get32(p) != IDX_MAGIC || get32(p + 4) != IDX_VERSION) {
+        munmap(map, st.st_size);
+        return;
+    }
+    r->idxmap = p;
+    r->idxsize = st.st_size;
+    r->nindexed = (st.st_size - IDX_HDR_SIZE) / IDX_ENTRY_SIZE;
+
+    // The index may run ahead of what has been written to the log so far
+    while (r->nindexed > 0) {
+        zcm_eventlog_event_t le;
+        size_t end = parse_event(r, index_offset(r, r->nindexed - 1), &le);
+        if (end) {
+            // An index that doesn't describe this log is no index at all
+            if (le.timestamp != index_timestamp(r, r->nindexed - 1)) {
+                munmap(map, st.st_size);
+                r->idxmap = NULL;
+                r->idxsize = 0;
+                r->nindexed = -1;
+                return;
+            }
+            r->indexend = end;
+            break;
+        }
+        r->nindexed--;
+    }
+}
+
+zcm_eventlog_reader_t *zcm_eventlog_reader_create(const char *path, const char *idxpath)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    zcm_eventlog_reader_t *r =
+        (zcm_eventlog_reader_t*) calloc(1, sizeof(zcm_eventlog_reader_t));
+    r->nindexed = -1;
+    r->size = st.st_size;
+    if (r->size > 0) {
+        void *map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            free(r);
+            return NULL;
+        }
+        r->map = (const uint8_t*) map;
+    }
+    close(fd);
+
+    if (r->size >= 4 && get32(r->map) == BLK_FILE_MAGIC) {
+        fprintf(stderr, "Block-compressed logs can't be memory-mapped\n");
+        zcm_eventlog_reader_destroy(r);
+        return NULL;
+    }
+
+    // Note: an empty idxpath means no index at all, see zcm_eventlog_build_index()
+    if (idxpath && *idxpath == '\0') return r;
+
+    char *defaultpath = NULL;
+    if (!idxpath) {
+        size_t len = strlen(path);
+        size_t sufflen = strlen(ZCM_EVENTLOG_INDEX_SUFFIX);
+        defaultpath = (char*) malloc(len + sufflen + 1);
+        memcpy(defaultpath, path, len);
+        memcpy(defaultpath + len, ZCM_EVENTLOG_INDEX_SUFFIX, sufflen + 1);
+        idxpath = defaultpath;
+    }
+
+    load_index(r, idxpath);
+
+    free(defaultpath);
+    return r;
+}
+
+void zcm_eventlog_reader_destroy(zcm_eventlog_reader_t *r)
+{
+    if (r->map) munmap((void*) r->map, r->size);
+    if (r->idxmap) munmap((void*) r->idxmap, r->idxsize);
+    free(r);
+}
+
+int64_t zcm_eventlog_reader_num_indexed(zcm_eventlog_reader_t *r)
+{
+    return r->nindexed;
+}
+
+off_t zcm_eventlog_reader_tell(zcm_eventlog_reader_t *r)
+{
+    return (off_t) r->pos;
+}
+
+const zcm_eventlog_event_t *zcm_eventlog_reader_read_next(zcm_eventlog_reader_t *r)
+{
+    size_t start;
+    size_t end = find_event(r, r->pos, &r->event, &start);
+    if (!end) return NULL;
+    r->pos = end;
+    return finish_event(r, start);
+}
+
+const zcm_eventlog_event_t *zcm_eventlog_reader_read_at_offset(zcm_eventlog_reader_t *r,
+                                                               off_t offset)
+{
+    if (offset < 0) return NULL;
+    r->pos = (size_t) offset;
+    return zcm_eventlog_reader_read_next(r);
+}
+
+const zcm_eventlog_event_t *zcm_eventlog_reader_read_prev(zcm_eventlog_reader_t *r)
+{
+    size_t start;
+    if (r->nindexed > 0 && r->pos <= r->indexend) {
+        // The last indexed event that starts before the current position
+        int64_t lo = 0, hi = r->nindexed;
+        while (lo < hi) {
+            int64_t mid = lo + (hi - lo) / 2;
+            if (index_offset(r, mid) < r->pos) lo = mid + 1;
+            else                               hi = mid;
+        }
+        if (lo == 0) return NULL;
+        start = index_offset(r, lo - 1);
+        if (!parse_event(r, start, &r->event)) return NULL;
+    } else {
+        // Scan backwards for the last valid event that ends by the current position
+        size_t off = r->pos;
+        while (1) {
+            if (off == 0) return NULL;
+            off--;
+            if (r->map[off] != 0xED) continue;
+            size_t end = parse_event(r, off, &r->event);
+            if (end && end <= r->pos) break;
+        }
+        start = off;
+    }
+    r->pos = start;
+    return finish_event(r, start);
+}
+
+int zcm_eventlog_reader_seek_to_timestamp(zcm_eventlog_reader_t *r, int64_t timestamp)
+{
+    zcm_eventlog_event_t le;
+    size_t start, end;
+    size_t from = 0;
+
+    if (r->nindexed > 0) {
+        if (index_timestamp(r, r->nindexed - 1) >= timestamp) {
+            // The first indexed event at or after the timestamp
+            int64_t lo = 0, hi = r->nindexed;
+            while (lo < hi) {
+                int64_t mid = lo + (hi - lo) / 2;
+                if (index_timestamp(r, mid) < timestamp) lo = mid + 1;
+                else                                      hi = mid;
+            }
+            r->pos = index_offset(r, lo);
+            return 0;
+        }
+        // Only the part of the log after the index is left
+        from = r->indexend;
+    } else {
+        // Bisect the log by offset. Everything before 'lo' is known to be earlier
+        size_t lo = 0, hi = r->size;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            end = find_event(r, mid, &le, &start);
+            if (!end || start >= hi) {
+                hi = mid;
+            } else if (le.timestamp < timestamp) {
+                lo = end;
+            } else {
+                hi = mid;
+            }
+        }
+        from = lo;
+    }
+
+    while ((end = find_event(r, from, &le, &start))) {
+        if (le.timestamp >= timestamp) {
+            r->pos = start;
+            return 0;
+        }
+        from = end;
+    }
+    r->pos = r->size;
+    return -1;
+}
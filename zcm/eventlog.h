@@ -24,11 +24,36 @@ struct _zcm_eventlog_event_t
     uint8_t* data;
 };
 
+/* An event as it is stored in the log, see zcm_eventlog_read_next_event_view().
+ * Unlike in zcm_eventlog_event_t, the channel is not NUL terminated */
+typedef struct _zcm_eventlog_event_view_t zcm_eventlog_event_view_t;
+struct _zcm_eventlog_event_view_t
+{
+    int64_t        eventnum;
+    int64_t        timestamp;
+    int32_t        channellen;
+    int32_t        datalen;
+    const char*    channel;
+    const uint8_t* data;
+};
+
+typedef struct _zcm_eventlog_blocks_t zcm_eventlog_blocks_t;
+
 typedef struct _zcm_eventlog_t zcm_eventlog_t;
 struct _zcm_eventlog_t
 {
     FILE* f;
     int64_t eventcount;
+    FILE* idx;           /* sidecar index, see zcm_eventlog_enable_index() */
+    int64_t idxpos;      /* offset of the next event written */
+    uint8_t* rbuf;       /* read-ahead buffer of the view reader */
+    size_t rbufsize;
+    size_t rbufstart;    /* next unread byte in rbuf */
+    size_t rbufend;      /* end of the valid bytes in rbuf */
+    int64_t rbufoff;     /* offset in the log of rbuf[0], -1 while f is in charge */
+    zcm_eventlog_blocks_t* blocks; /* block-compressed logs only */
+    char* path;          /* plain logs opened for reading, to find the sidecar index */
+    struct _zcm_eventlog_reader_t* seekreader; /* see zcm_eventlog_seek_to_timestamp() */
 };
 
 /**** Methods for creation/deletion ****/
@@ -38,6 +63,9 @@ void zcm_eventlog_destroy(zcm_eventlog_t* eventlog);
 
 /**** Methods for general operations ****/
 FILE* zcm_eventlog_get_fileptr(zcm_eventlog_t* eventlog);
+// Positions the log at the first event at or after ts. Plain logs are searched through
+// their sidecar index if there is a valid one next to them (FILE.idx), otherwise by
+// bisecting the file. Returns 0 on success -1 on failure
 int zcm_eventlog_seek_to_timestamp(zcm_eventlog_t* eventlog, int64_t ts);
 
 
@@ -49,6 +77,93 @@ zcm_eventlog_event_t* zcm_eventlog_read_event_at_offset(zcm_eventlog_t* eventlog
 void zcm_eventlog_free_event(zcm_eventlog_event_t* event);
 int zcm_eventlog_write_event(zcm_eventlog_t* eventlog, const zcm_eventlog_event_t* event);
 
+// Reads the next event without allocating or copying anything: the view points into
+// a read-ahead buffer owned by the eventlog and stays valid until the next call on
+// it. Meant for scanning whole logs front to back. It can be mixed with the other
+// methods, but the position of the FILE* is only up to date again after calling one
+// of them (zcm_eventlog_get_fileptr() included).
+// Returns 0 on success -1 at the end of the log or on failure
+int zcm_eventlog_read_next_event_view(zcm_eventlog_t* eventlog, zcm_eventlog_event_view_t* view);
+
+
+/**** Methods for the sidecar index ****/
+/* An index is a separate file (by convention the log's path plus ".idx") with one
+ * entry per event: its timestamp, its offset in the log and its channel id, which is
+ * a 32 bit hash of the channel name (see zcm_eventlog_channel_id()). Different
+ * channels may share an id, so an id match has to be confirmed with the event. */
+#define ZCM_EVENTLOG_INDEX_SUFFIX ".idx"
+
+// Have every event written from now on also added to the index at idxpath. If the
+// log isn't empty, the index has to exist and end with the last event of the log
+// (see zcm_eventlog_build_index()). Returns 0 on success -1 on failure
+int zcm_eventlog_enable_index(zcm_eventlog_t* eventlog, const char* idxpath);
+// (Re)builds the index of the log at logpath with a single pass over the log. The
+// index is written to a temporary file first, so that readers never see part of it.
+// Returns 0 on success -1 on failure
+int zcm_eventlog_build_index(const char* logpath, const char* idxpath);
+uint32_t zcm_eventlog_channel_id(const char* channel, int32_t channellen);
+
+
+/**** Methods for block-compressed logs ****/
+/* A block-compressed log holds the same stream of events as a plain log, cut into
+ * independently compressed blocks of about ZCM_EVENTLOG_BLOCK_SIZE bytes, with an
+ * index of the blocks at the end of the file. zcm_eventlog_create() recognizes these
+ * logs by their header and reads them just like plain ones: offsets (e.g. for
+ * zcm_eventlog_read_event_at_offset() or ftello() on the FILE*) are offsets into the
+ * uncompressed stream, which is what the log would look like without compression.
+ * They cannot be appended to by older versions of zcm, nor read by the
+ * memory-mapped reader or indexed with zcm_eventlog_build_index(). */
+#define ZCM_EVENTLOG_BLOCK_SIZE (1 << 20)
+
+enum zcm_eventlog_codec_t
+{
+    ZCM_EVENTLOG_CODEC_NONE = 0,  /* blocks are stored as they are */
+    ZCM_EVENTLOG_CODEC_LZ4  = 1,  /* fast, requires building with --use-lz4 */
+    ZCM_EVENTLOG_CODEC_ZSTD = 2   /* smaller, requires building with --use-zstd */
+};
+
+// Returns 1 if this build of zcm can read and write blocks compressed with codec
+int zcm_eventlog_codec_supported(int codec);
+// Have all events written from now on go into compressed blocks. Has to be called
+// before the first event is written to a log opened with "w", or to one opened with
+// "a" that is empty or already block-compressed. level is passed to the codec, 0
+// picks its default. With nthreads > 0, blocks are compressed by that many threads
+// of their own while the next block is being filled, otherwise
+// zcm_eventlog_write_event() compresses them when they are full.
+// Returns 0 on success -1 on failure
+int zcm_eventlog_set_compression(zcm_eventlog_t* eventlog, int codec, int level, int nthreads);
+
+
+/**** Methods for the memory-mapped reader ****/
+/* Reads a log through mmap(), with O(log n) seeks and reverse iteration through the
+ * sidecar index. The log may still be growing: events past the end of the index or
+ * the end of the log at the time of zcm_eventlog_reader_create() are not seen, and
+ * events the index doesn't cover are found by scanning instead. */
+typedef struct _zcm_eventlog_reader_t zcm_eventlog_reader_t;
+
+// If idxpath is NULL, the index is expected next to the log. Without an index the
+// reader scans, zcm_eventlog_build_index() can create one beforehand.
+// An empty idxpath ("") reads the log without an index
+zcm_eventlog_reader_t* zcm_eventlog_reader_create(const char* path, const char* idxpath);
+void zcm_eventlog_reader_destroy(zcm_eventlog_reader_t* reader);
+
+// Number of events the index covers, or -1 without an index
+int64_t zcm_eventlog_reader_num_indexed(zcm_eventlog_reader_t* reader);
+// Position the reader so that the next event read is the first one at or after ts.
+// Returns 0 on success -1 on failure
+int zcm_eventlog_reader_seek_to_timestamp(zcm_eventlog_reader_t* reader, int64_t ts);
+// Offset in the log of the event the next read_next() returns
+off_t zcm_eventlog_reader_tell(zcm_eventlog_reader_t* reader);
+
+// NOTE: The returned event belongs to the reader and stays valid until the next
+//       call on it. Its data points into the mapped log and must not be written to
+const zcm_eventlog_event_t* zcm_eventlog_reader_read_next(zcm_eventlog_reader_t* reader);
+// Returns the event before the current position and moves the position to its
+// start, so that a following read_next() returns it again
+const zcm_eventlog_event_t* zcm_eventlog_reader_read_prev(zcm_eventlog_reader_t* reader);
+const zcm_eventlog_event_t* zcm_eventlog_reader_read_at_offset(zcm_eventlog_reader_t* reader,
+                                                               off_t offset);
+
 
 #ifdef __cplusplus
 }
@@ -215,10 +215,21 @@ int zcm_nonblocking_handle_nonblock(zcm_nonblocking_t* zcm)
     if ((ret = zcm_trans_recvmsg(zcm->zt, &msg, 0)) != ZCM_EOK) return ret;
 
     dispatch_message(zcm, &msg);
+    zcm_trans_recvmsg_release(zcm->zt, &msg);
 
     return ZCM_EOK;
 }
 
+int zcm_nonblocking_get_trans_stats(zcm_nonblocking_t* zcm, zcm_trans_stats_t* stats)
+{
+    return zcm_trans_get_stats(zcm->zt, stats);
+}
+
+int zcm_nonblocking_set_loss_handler(zcm_nonblocking_t* zcm, zcm_loss_handler_t cb, void* usr)
+{
+    return zcm_trans_set_loss_handler(zcm->zt, cb, usr);
+}
+
 void zcm_nonblocking_flush(zcm_nonblocking_t* zcm)
 {
     /* Call twice because we need to make sure publish and subscribe are both handled */
@@ -226,6 +237,8 @@ void zcm_nonblocking_flush(zcm_nonblocking_t* zcm)
     zcm_trans_update(zcm->zt);
 
     zcm_msg_t msg;
-    while (zcm_trans_recvmsg(zcm->zt, &msg, 0) == ZCM_EOK)
+    while (zcm_trans_recvmsg(zcm->zt, &msg, 0) == ZCM_EOK) {
         dispatch_message(zcm, &msg);
+        zcm_trans_recvmsg_release(zcm->zt, &msg);
+    }
 }
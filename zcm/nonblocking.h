@@ -23,6 +23,9 @@ int zcm_nonblocking_handle_nonblock(zcm_nonblocking_t* zcm);
 
 void zcm_nonblocking_flush(zcm_nonblocking_t* zcm);
 
+int zcm_nonblocking_get_trans_stats(zcm_nonblocking_t* zcm, zcm_trans_stats_t* stats);
+int zcm_nonblocking_set_loss_handler(zcm_nonblocking_t* zcm, zcm_loss_handler_t cb, void* usr);
+
 #ifdef __cplusplus
 }
 #endif
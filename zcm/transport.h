@@ -106,6 +106,63 @@
  *      --------------------------------------------------------------------
  *         Close the transport and cleanup any resources used.
  *
+ *      void recvmsg_release(zcm_trans_t* zt, zcm_msg_t* msg)
+ *      --------------------------------------------------------------------
+ *         This method is optional and may be set to NULL. A transport that
+ *         provides it is said to "lease" its receive buffers: every message
+ *         returned by a successful recvmsg() stays valid (channel and buf) until
+ *         the caller hands it back through this method, even across subsequent
+ *         calls to recvmsg(). This allows the caller to queue and dispatch the
+ *         message without copying it. Every leased message must be released
+ *         exactly once and before destroy() is called.
+ *         NOTE: This method will be called from a different thread than recvmsg()
+ *         and must work concurrently with it.
+ *
+ *      int sendmsg_batch(zcm_trans_t* zt, const zcm_msg_t* msgs, size_t* n)
+ *      --------------------------------------------------------------------
+ *         This method is optional and may be set to NULL, in which case the
+ *         caller falls back to calling sendmsg() once per message. The caller
+ *         passes '*n' messages which should be sent in order, just as if sendmsg()
+ *         had been called on each of them, but with as few system calls as the
+ *         transport can manage. On return, '*n' must hold the number of messages
+ *         that were consumed. If every message was sent, ZCM_EOK is returned.
+ *         Otherwise the last consumed message is the one that failed and its
+ *         error code is returned; the caller drops it and may retry the rest.
+ *         NOTE: This method is called from the same thread as sendmsg().
+ *
+ *      int recvmsg_batch(zcm_trans_t* zt, zcm_msg_t* msgs, size_t* n, int timeout)
+ *      --------------------------------------------------------------------
+ *         This method is optional and may be set to NULL, in which case the
+ *         caller falls back to calling recvmsg() for a single message. The caller
+ *         passes room for '*n' messages. This method waits for the first message
+ *         just like recvmsg() does and then adds every other message that can be
+ *         received *without blocking*, up to '*n'. On return, '*n' must hold the
+ *         number of messages received. ZCM_EOK is returned if there is at least
+ *         one, ZCM_EAGAIN otherwise. All of the returned messages must stay valid
+ *         until the next call to recvmsg() or recvmsg_batch(), and if the transport
+ *         leases its buffers, every one of them is released individually through
+ *         recvmsg_release().
+ *         NOTE: This method should work concurrently and correctly with
+ *         recvmsg_enable() and is called from the same thread as recvmsg().
+ *
+ *      int get_stats(zcm_trans_t* zt, zcm_trans_stats_t* stats)
+ *      --------------------------------------------------------------------
+ *         This method is optional and may be set to NULL if the transport
+ *         doesn't keep statistics. It fills in the counters of 'stats' that
+ *         apply to this transport, the caller has zeroed all of them beforehand,
+ *         and returns ZCM_EOK.
+ *         NOTE: For blocking transports, this method may be called from any
+ *         thread and must work concurrently with every other method.
+ *
+ *      int set_loss_handler(zcm_trans_t* zt, zcm_loss_handler_t cb, void* usr)
+ *      --------------------------------------------------------------------
+ *         This method is optional and may be set to NULL if the transport
+ *         doesn't track sequence numbers. From now on the transport calls
+ *         'cb' (unless it is NULL) with 'usr' for every gap, reorder or
+ *         duplicate it notices in the messages of a sender. Returns ZCM_EOK.
+ *         NOTE: For blocking transports, this method may be called from any
+ *         thread and 'cb' is called from the thread that runs recvmsg().
+ *
  *******************************************************************************
  * Non-Blocking Transport API:
  *
@@ -223,6 +280,11 @@ struct zcm_trans_methods_t
     int     (*recvmsg)(zcm_trans_t* zt, zcm_msg_t* msg, int timeout);
     int     (*update)(zcm_trans_t* zt);
     void    (*destroy)(zcm_trans_t* zt);
+    void    (*recvmsg_release)(zcm_trans_t* zt, zcm_msg_t* msg); /* optional, may be NULL */
+    int     (*sendmsg_batch)(zcm_trans_t* zt, const zcm_msg_t* msgs, size_t* n); /* optional */
+    int     (*recvmsg_batch)(zcm_trans_t* zt, zcm_msg_t* msgs, size_t* n, int timeout); /* optional */
+    int     (*get_stats)(zcm_trans_t* zt, zcm_trans_stats_t* stats); /* optional */
+    int     (*set_loss_handler)(zcm_trans_t* zt, zcm_loss_handler_t cb, void* usr); /* optional */
 };
 
 /* Helper functions to make the VTbl dispatch cleaner */
@@ -244,6 +306,48 @@ static INLINE int zcm_trans_update(zcm_trans_t* zt)
 static INLINE void zcm_trans_destroy(zcm_trans_t* zt)
 { return zt->vtbl->destroy(zt); }
 
+static INLINE int zcm_trans_get_stats(zcm_trans_t* zt, zcm_trans_stats_t* stats)
+{ return zt->vtbl->get_stats ? zt->vtbl->get_stats(zt, stats) : ZCM_EINVALID; }
+
+static INLINE int zcm_trans_set_loss_handler(zcm_trans_t* zt, zcm_loss_handler_t cb, void* usr)
+{ return zt->vtbl->set_loss_handler ? zt->vtbl->set_loss_handler(zt, cb, usr) : ZCM_EINVALID; }
+
+static INLINE bool zcm_trans_leases_recvmsg(zcm_trans_t* zt)
+{ return zt->vtbl->recvmsg_release != NULL; }
+
+static INLINE void zcm_trans_recvmsg_release(zcm_trans_t* zt, zcm_msg_t* msg)
+{ if (zt->vtbl->recvmsg_release) zt->vtbl->recvmsg_release(zt, msg); }
+
+/* The batch helpers fall back to the single message methods if the transport doesn't
+   provide batched ones. Only meaningful for blocking transports */
+static INLINE int zcm_trans_sendmsg_batch(zcm_trans_t* zt, const zcm_msg_t* msgs, size_t* n)
+{
+    size_t i;
+    int rc = ZCM_EOK;
+
+    if (zt->vtbl->sendmsg_batch) return zt->vtbl->sendmsg_batch(zt, msgs, n);
+
+    for (i = 0; i < *n; ++i) {
+        rc = zt->vtbl->sendmsg(zt, msgs[i]);
+        if (rc != ZCM_EOK) { ++i; break; }
+    }
+    *n = i;
+    return rc;
+}
+
+static INLINE int zcm_trans_recvmsg_batch(zcm_trans_t* zt, zcm_msg_t* msgs, size_t* n,
+                                          int timeout)
+{
+    int rc;
+
+    if (zt->vtbl->recvmsg_batch) return zt->vtbl->recvmsg_batch(zt, msgs, n, timeout);
+
+    if (*n == 0) return ZCM_EINVALID;
+    rc = zt->vtbl->recvmsg(zt, msgs, timeout);
+    *n = (rc == ZCM_EOK) ? 1 : 0;
+    return rc;
+}
+
 #ifdef __cplusplus
 }
 #endif
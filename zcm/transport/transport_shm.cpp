@@ -0,0 +1,1073 @@
+#include "zcm/transport.h"
+#include "zcm/transport_registrar.h"
+#include "zcm/transport_register.hpp"
+#include "zcm/util/debug.h"
+#include "zcm/util/lockfile.h"
+
+#include "util/TimeUtil.hpp"
+
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <climits>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+// Define this the class name you want
+#define ZCM_TRANS_CLASSNAME TransportShm
+#define SHM_PREFIX "zcm-shm-"
+#define SHM_DIR "/dev/shm/"
+#define SHM_MAGIC 0x5a534d31 // hex repr of ascii "ZSM1"
+#define SHM_VERSION 2
+#define DEFAULT_NAME "zcm"
+#define DEFAULT_RING_SIZE (16 << 20)
+#define MIN_RING_SIZE (64 << 10)
+#define MAX_RING_SIZE (1ULL << 32)
+#define MAX_READERS 64
+#define MAX_FREE_LEASES 64
+#define PIN_TIMEOUT_US 100000
+#define CACHE_LINE 64
+
+using u8  = uint8_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "the shm transport needs address-free atomics");
+
+// Layout of the shared memory:
+//
+// Every ZCM instance on the same <name> maps a small "bus" segment, which holds the
+// futex that blocked subscribers sleep on (rung by every publish) and a generation
+// counter that is bumped whenever a channel segment is created.
+//
+// Every channel has its own segment: a header followed by a byte ring that holds
+// variable length records. The single publisher of a channel (enforced by a lockfile
+// like the IPC transport does) appends records and advances 'head'; records never
+// wrap around the end of the ring, a padding record fills the gap instead. Before the
+// publisher overwrites the oldest records it advances 'tail' past them.
+//
+// Subscribers keep a private read position and hand out pointers right into the ring
+// (see recvmsg_release in transport.h). To keep those valid, every subscriber owns a
+// reader slot with a 'pin': the position of its oldest leased record (or the record
+// it is reading right now). Before overwriting records the publisher 'claim's them and
+// checks the pins, and only moves the tail past them if none is pinned. Otherwise it
+// takes the claim back and drops the new message. So that a slow subscriber can't hold
+// up the publisher for long, subscribers that lag more than half a ring behind copy
+// messages out instead of pinning them (checking the tail afterwards, like a
+// seqlock), and subscribers that fall more than a ring behind simply lose the oldest
+// messages. A subscriber that keeps the publisher from publishing for PIN_TIMEOUT_US
+// anyway (e.g. a stopped process) has its pin 'revoked': the publisher ignores it and
+// overwrites the messages that subscriber holds, and the subscriber copies messages
+// until it has released all of them.
+struct ShmBus
+{
+    atomic<u32> bell;        // bumped on every publish
+    atomic<u32> waiters;     // number of subscribers sleeping on 'bell'
+    atomic<u32> channelsGen; // bumped on every new channel segment
+};
+
+struct ShmReader
+{
+    atomic<u32> pid;         // 0 if the slot is free
+    atomic<u32> revoked;     // set by the publisher, cleared by the subscriber
+    atomic<u64> pin;         // NO_PIN when nothing is leased or being read
+    char pad[CACHE_LINE - 16];
+};
+
+struct ShmChannel
+{
+    atomic<u32> magic;       // written last when the segment is initialized
+    u32 version;
+    u64 capacity;            // size of the ring in bytes, a power of two
+    char pad0[CACHE_LINE - 16];
+
+    // Written by the publisher
+    atomic<u64> head;        // position of the next record
+    atomic<u64> tail;        // position of the oldest intact record
+    u64 seqno;               // sequence number of the next message
+    atomic<u64> start;       // head when the current publisher took over
+    atomic<u64> claim;       // what the tail moves to if no pin is in the way
+    char pad1[CACHE_LINE - 40];
+
+    atomic<u32> numReaders;  // highest reader slot in use + 1
+    char pad2[CACHE_LINE - 4];
+
+    ShmReader readers[MAX_READERS];
+
+    u8 *ring() { return (u8*)(this + 1); }
+};
+
+struct ShmRecord
+{
+    u64 pos;                 // position of this record, to detect torn reads
+    u64 seqno;
+    u32 size;                // of the whole record including this header
+    u32 len;                 // of the payload, PAD_LEN for padding records
+
+    static constexpr u32 PAD_LEN = 0xffffffff;
+
+    u8 *data() { return (u8*)(this + 1); }
+};
+
+static const u64 NO_PIN = UINT64_MAX;
+
+static u64 alignRecord(u64 n) { return (n + 7) & ~(u64)7; }
+
+static int futexWait(atomic<u32> *addr, u32 val, int timeoutMs)
+{
+    struct timespec ts, *pts = nullptr;
+    if (timeoutMs >= 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+        pts = &ts;
+    }
+    // Note: not FUTEX_PRIVATE_FLAG, the futex is shared between processes
+    return syscall(SYS_futex, (u32*)addr, FUTEX_WAIT, val, pts, nullptr, 0);
+}
+
+static void futexWakeAll(atomic<u32> *addr)
+{
+    syscall(SYS_futex, (u32*)addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static bool processAlive(u32 pid)
+{
+    return !(kill((pid_t)pid, 0) < 0 && errno == ESRCH);
+}
+
+// Channel and transport names end up in file names, so everything but
+// [A-Za-z0-9_-] is escaped as %XX. This keeps '.' free as the separator
+static string escapeName(const string& s)
+{
+    static const char *hex = "0123456789abcdef";
+    string ret;
+    for (unsigned char c : s) {
+        if (isalnum(c) || c == '_' || c == '-') {
+            ret += c;
+        } else {
+            ret += '%';
+            ret += hex[c >> 4];
+            ret += hex[c & 0xf];
+        }
+    }
+    return ret;
+}
+
+static bool unescapeName(const string& s, string& ret)
+{
+    ret.clear();
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '%') {
+            ret += s[i];
+            continue;
+        }
+        if (i + 2 >= s.size()) return false;
+        char hex[3] = { s[i+1], s[i+2], '\0' };
+        char *end;
+        long c = strtol(hex, &end, 16);
+        if (*end != '\0') return false;
+        ret += (char)c;
+        i += 2;
+    }
+    return true;
+}
+
+// A message handed out by recvmsg(), either in place or copied (without a reader
+// slot or when lagging behind). The channel must be the first member so that the channel pointer in a
+// released zcm_msg_t can be mapped back to its Lease
+struct Channel;
+struct Lease
+{
+    char channel[ZCM_CHANNEL_MAXLEN + 1];
+    Channel *ch;
+    u64 pos;
+    bool released;
+    bool inPlace;
+    u8 *copy;
+    size_t copySize;
+
+    static Lease *fromChannel(const char *channel)
+    { return (Lease*) channel; }
+};
+
+// A mapping of one channel segment, either for publishing or for subscribing
+struct Channel
+{
+    string name;
+    ShmChannel *hdr = nullptr;
+    size_t mapSize = 0;
+    u64 mask = 0;
+
+    // Publisher state
+    u64 head = 0;
+    u64 tail = 0;
+    // Since when, and at what pin, every reader slot has kept us from publishing
+    struct { u64 pin; u64 utime; } blocked[MAX_READERS] = {};
+
+    // Subscriber state, only touched by the receive thread
+    ShmReader *slot = nullptr; // null if all slots were taken (messages get copied)
+    u64 readPos = 0;
+    u64 nextSeqno = 0;
+    bool haveSeqno = false;
+    bool subExplicit = false;
+    bool active = false;
+
+    // Leased messages, oldest first. Released from another thread
+    mutex leaseMut;
+    deque<Lease*> leases;
+
+    ShmRecord *recordAt(u64 pos) { return (ShmRecord*)(hdr->ring() + (pos & mask)); }
+
+    // Requires leaseMut. Pins the oldest leased record, or 'pos' if there is none
+    void pin(u64 pos)
+    {
+        if (!slot) return;
+        slot->pin.store(leases.empty() ? pos : leases.front()->pos, memory_order_seq_cst);
+    }
+};
+
+struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+{
+    string name;
+    size_t ringSize;
+    size_t mtu;
+    u32 pid;
+
+    ShmBus *bus = nullptr;
+
+    unordered_map<string, Channel*> pubchans;
+    unordered_map<string, Channel*> subchans;
+    // Channels subscribed to explicitly whose segments don't exist yet
+    vector<string> pendingSubs;
+    // Number of subscriptions on each explicitly subscribed channel
+    unordered_map<string, u32> subRefs;
+    bool recvAllChannels = false;
+    u32 seenChannelsGen = 0;
+    bool scanned = false;
+    size_t nextPoll = 0;
+
+    // Mutex used to protect 'subchans', 'pendingSubs' and 'subRefs' while allowing
+    // recvmsgEnable() and recvmsg() to be called concurrently
+    mutex mut;
+
+    // Leases that have been released and can be reused by recvmsg().
+    // Protected by 'leaseMut' because leases are released from another thread
+    mutex leaseMut;
+    vector<Lease*> freeLeases;
+
+    atomic<u64> msgsSent {0}, bytesSent {0};
+    atomic<u64> msgsRecv {0}, bytesRecv {0};
+    atomic<u64> msgsLost {0};
+    atomic<u64> msgsDropped {0};
+
+    ZCM_TRANS_CLASSNAME(const string& name_, size_t ringSize_)
+    {
+        trans_type = ZCM_BLOCKING;
+        vtbl = &methods;
+
+        name = name_;
+        ringSize = ringSize_;
+        // Leave room for a padding record and at least one more message
+        mtu = ringSize / 2 - sizeof(ShmRecord);
+        pid = (u32)getpid();
+
+        ZCM_DEBUG("shm name: %s, ring size: %zu", name.c_str(), ringSize);
+    }
+
+    ~ZCM_TRANS_CLASSNAME()
+    {
+        for (auto& elt : pubchans) {
+            lockfile_unlock(lockfileName(elt.first).c_str());
+            unmapChannel(elt.second);
+        }
+        for (auto& elt : subchans) {
+            Channel *ch = elt.second;
+            assert(ch->leases.empty() && "all messages must be released before destroy()");
+            if (ch->slot) {
+                ch->slot->pin.store(NO_PIN, memory_order_relaxed);
+                ch->slot->pid.store(0, memory_order_release);
+            }
+            unmapChannel(ch);
+        }
+        if (bus) munmap(bus, sizeof(ShmBus));
+        for (auto *l : freeLeases) {
+            free(l->copy);
+            delete l;
+        }
+    }
+
+    bool init()
+    {
+        string seg = "/" SHM_PREFIX + escapeName(name);
+        int fd = shm_open(seg.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            ZCM_DEBUG("failed to open %s: %s", seg.c_str(), strerror(errno));
+            return false;
+        }
+        // All zeros is a valid bus, so it doesn't matter who gets here first
+        struct stat st;
+        if (fstat(fd, &st) < 0 ||
+            ((size_t)st.st_size < sizeof(ShmBus) && ftruncate(fd, sizeof(ShmBus)) < 0)) {
+            ZCM_DEBUG("failed to size %s: %s", seg.c_str(), strerror(errno));
+            close(fd);
+            return false;
+        }
+        void *mem = mmap(nullptr, sizeof(ShmBus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            ZCM_DEBUG("failed to map %s: %s", seg.c_str(), strerror(errno));
+            return false;
+        }
+        bus = (ShmBus*) mem;
+        return true;
+    }
+
+    string segmentName(const string& channel)
+    {
+        return SHM_PREFIX + escapeName(name) + "." + escapeName(channel);
+    }
+
+    string lockfileName(const string& channel)
+    {
+        return SHM_DIR + segmentName(channel);
+    }
+
+    void unmapChannel(Channel *ch)
+    {
+        if (ch->hdr) munmap(ch->hdr, ch->mapSize);
+        delete ch;
+    }
+
+    void ringBell()
+    {
+        bus->bell.fetch_add(1, memory_order_seq_cst);
+        if (bus->waiters.load(memory_order_seq_cst) != 0)
+            futexWakeAll(&bus->bell);
+    }
+
+    // Maps the segment of 'channel'. A publisher creates (or takes over) the segment,
+    // a subscriber returns null if it doesn't exist or isn't initialized yet
+    Channel *mapChannel(const string& channel, bool publisher)
+    {
+        string seg = "/" + segmentName(channel);
+        int fd = shm_open(seg.c_str(), publisher ? O_RDWR | O_CREAT : O_RDWR, 0666);
+        if (fd < 0) {
+            if (errno != ENOENT)
+                ZCM_DEBUG("failed to open %s: %s", seg.c_str(), strerror(errno));
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return nullptr;
+        }
+        size_t size = st.st_size;
+
+        // Only the publisher (holding the lockfile) ever initializes a segment, so a
+        // segment without a header is either brand new or left over by a publisher that
+        // died while creating it. Once initialized, a segment keeps its ring size
+        bool initialize = false;
+        if (size < sizeof(ShmChannel)) {
+            if (!publisher) {
+                close(fd);
+                return nullptr;
+            }
+            size = sizeof(ShmChannel) + ringSize;
+            if (ftruncate(fd, size) < 0) {
+                ZCM_DEBUG("failed to size %s: %s", seg.c_str(), strerror(errno));
+                close(fd);
+                return nullptr;
+            }
+            initialize = true;
+        }
+
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            ZCM_DEBUG("failed to map %s: %s", seg.c_str(), strerror(errno));
+            return nullptr;
+        }
+
+        ShmChannel *hdr = (ShmChannel*) mem;
+        if (!initialize && hdr->magic.load(memory_order_acquire) != SHM_MAGIC) {
+            if (!publisher) {
+                munmap(mem, size);
+                return nullptr;
+            }
+            initialize = true;
+        }
+        // A segment left behind by another version of this transport would
+        // otherwise lock the channel out until someone removed it by hand.
+        // The publisher holds the channel lock, so it may take it over.
+        if (!initialize && publisher && hdr->version != SHM_VERSION &&
+            size > sizeof(ShmChannel) &&
+            ((size - sizeof(ShmChannel)) & (size - sizeof(ShmChannel) - 1)) == 0) {
+            ZCM_DEBUG("%s was written by version %u, reinitializing",
+                      seg.c_str(), (unsigned) hdr->version);
+            hdr->magic.store(0, memory_order_release);
+            initialize = true;
+        }
+
+        if (initialize) {
+            hdr->version = SHM_VERSION;
+            hdr->capacity = size - sizeof(ShmChannel);
+            hdr->head.store(0, memory_order_relaxed);
+            hdr->tail.store(0, memory_order_relaxed);
+            hdr->seqno = 0;
+            hdr->start.store(0, memory_order_relaxed);
+            hdr->claim.store(0, memory_order_relaxed);
+            hdr->numReaders.store(0, memory_order_relaxed);
+            for (auto& r : hdr->readers) {
+                r.pid.store(0, memory_order_relaxed);
+                r.revoked.store(0, memory_order_relaxed);
+                r.pin.store(NO_PIN, memory_order_relaxed);
+            }
+            hdr->magic.store(SHM_MAGIC, memory_order_release);
+        } else if (hdr->version != SHM_VERSION ||
+                   hdr->capacity + sizeof(ShmChannel) != size ||
+                   (hdr->capacity & (hdr->capacity - 1)) != 0) {
+            ZCM_DEBUG("%s has an incompatible layout", seg.c_str());
+            munmap(mem, size);
+            return nullptr;
+        }
+
+        Channel *ch = new Channel();
+        ch->name = channel;
+        ch->hdr = hdr;
+        ch->mapSize = size;
+        ch->mask = hdr->capacity - 1;
+        ch->head = hdr->head.load(memory_order_relaxed);
+        ch->tail = hdr->tail.load(memory_order_relaxed);
+        return ch;
+    }
+
+    // Claims a reader slot so that messages can be read in place. Slots of dead
+    // processes are taken over
+    void claimReaderSlot(Channel *ch)
+    {
+        ShmChannel *hdr = ch->hdr;
+        for (u32 i = 0; i < MAX_READERS; ++i) {
+            ShmReader& r = hdr->readers[i];
+            u32 owner = r.pid.load(memory_order_relaxed);
+            if (owner != 0 && processAlive(owner)) continue;
+            if (!r.pid.compare_exchange_strong(owner, pid)) continue;
+
+            r.pin.store(NO_PIN, memory_order_seq_cst);
+            r.revoked.store(0, memory_order_seq_cst);
+            u32 n = hdr->numReaders.load(memory_order_relaxed);
+            while (n < i + 1 && !hdr->numReaders.compare_exchange_weak(n, i + 1));
+            ch->slot = &r;
+            return;
+        }
+        ZCM_DEBUG("no free reader slot on channel %s, messages will be copied",
+                  ch->name.c_str());
+    }
+
+    Channel *pubchanFindOrCreate(const string& channel)
+    {
+        auto it = pubchans.find(channel);
+        if (it != pubchans.end())
+            return it->second;
+        // Before we create a pubchan, we need to acquire the lock file for this
+        if (!lockfile_trylock(lockfileName(channel).c_str())) {
+            fprintf(stderr, "Failed to acquire publish lock on %s! "
+                            "Are you attempting multiple publishers?\n",
+                            channel.c_str());
+            return nullptr;
+        }
+        Channel *ch = mapChannel(channel, true);
+        if (ch == nullptr) {
+            lockfile_unlock(lockfileName(channel).c_str());
+            return nullptr;
+        }
+        ch->hdr->start.store(ch->head, memory_order_relaxed);
+        // The last publisher may have died in the middle of a claim
+        ch->hdr->claim.store(ch->tail, memory_order_seq_cst);
+        pubchans.emplace(channel, ch);
+
+        bus->channelsGen.fetch_add(1, memory_order_seq_cst);
+        ringBell();
+        return ch;
+    }
+
+    // Requires 'mut'. Returns null if the channel has no segment yet. A subscriber
+    // normally starts with the next message, but if the publisher only came up after
+    // we subscribed ('fromStart') it starts with the publisher's first message
+    Channel *subchanFindOrCreate(const string& channel, bool subExplicit, bool fromStart)
+    {
+        auto it = subchans.find(channel);
+        if (it != subchans.end()) {
+            it->second->subExplicit |= subExplicit;
+            return it->second;
+        }
+        Channel *ch = mapChannel(channel, false);
+        if (ch == nullptr)
+            return nullptr;
+        claimReaderSlot(ch);
+        ch->readPos = fromStart ? ch->hdr->start.load(memory_order_acquire)
+                                : ch->hdr->head.load(memory_order_acquire);
+        ch->subExplicit = subExplicit;
+        ch->active = true;
+        subchans.emplace(channel, ch);
+        return ch;
+    }
+
+    // Requires 'mut'
+    void scanForNewChannels()
+    {
+        u32 gen = bus->channelsGen.load(memory_order_acquire);
+        if (scanned && gen == seenChannelsGen)
+            return;
+        // Channels that show up after the first scan were created while we listened
+        bool fromStart = scanned;
+        scanned = true;
+        seenChannelsGen = gen;
+
+        for (auto it = pendingSubs.begin(); it != pendingSubs.end(); ) {
+            if (subchanFindOrCreate(*it, true, true)) it = pendingSubs.erase(it);
+            else ++it;
+        }
+
+        if (!recvAllChannels)
+            return;
+
+        string prefix = SHM_PREFIX + escapeName(name) + ".";
+        DIR *d;
+        dirent *ent;
+
+        if (!(d=opendir(SHM_DIR)))
+            return;
+
+        while ((ent=readdir(d)) != nullptr) {
+            if (strncmp(ent->d_name, prefix.c_str(), prefix.size()) != 0)
+                continue;
+            string channel;
+            if (!unescapeName(ent->d_name + prefix.size(), channel))
+                continue;
+            subchanFindOrCreate(channel, false, fromStart);
+        }
+
+        closedir(d);
+    }
+
+    Lease *acquireLease()
+    {
+        {
+            unique_lock<mutex> lk(leaseMut);
+            if (!freeLeases.empty()) {
+                Lease *l = freeLeases.back();
+                freeLeases.pop_back();
+                return l;
+            }
+        }
+        Lease *l = new Lease();
+        l->copy = nullptr;
+        l->copySize = 0;
+        return l;
+    }
+
+    void freeLease(Lease *l)
+    {
+        unique_lock<mutex> lk(leaseMut);
+        if (freeLeases.size() < MAX_FREE_LEASES) {
+            freeLeases.push_back(l);
+        } else {
+            lk.unlock();
+            free(l->copy);
+            delete l;
+        }
+    }
+
+    void releaseLease(Lease *l)
+    {
+        Channel *ch = l->ch;
+        if (l->inPlace) {
+            unique_lock<mutex> lk(ch->leaseMut);
+            l->released = true;
+            // Messages may be released out of order, the pin can only move past
+            // the ones at the front
+            while (!ch->leases.empty() && ch->leases.front()->released) {
+                freeLease(ch->leases.front());
+                ch->leases.pop_front();
+            }
+            ch->slot->pin.store(ch->leases.empty() ? NO_PIN : ch->leases.front()->pos,
+                                memory_order_release);
+        } else {
+            freeLease(l);
+        }
+    }
+
+    /********************** METHODS **********************/
+    size_t getMtu()
+    {
+        return mtu;
+    }
+
+    int sendmsg(zcm_msg_t msg)
+    {
+        string channel = msg.channel;
+        if (channel.size() > ZCM_CHANNEL_MAXLEN)
+            return ZCM_EINVALID;
+        if (msg.len > mtu)
+            return ZCM_EINVALID;
+
+        Channel *ch = pubchanFindOrCreate(channel);
+        if (ch == nullptr)
+            return ZCM_ECONNECT;
+        ShmChannel *hdr = ch->hdr;
+        u64 cap = hdr->capacity;
+
+        u64 need = alignRecord(sizeof(ShmRecord) + msg.len);
+        // The segment may be older and smaller than our ring size
+        if (need > cap / 2)
+            return ZCM_EINVALID;
+
+        u64 pos = ch->head;
+        u64 off = pos & ch->mask;
+        u64 pad = (off + need > cap) ? cap - off : 0;
+        u64 end = pos + pad + need;
+
+        // Move the tail past every record we are about to overwrite, unless one of
+        // them is pinned
+        if (end > cap) {
+            u64 limit = end - cap;
+            u64 tail = ch->tail;
+            while (tail < limit)
+                tail += ch->recordAt(tail)->size;
+            if (tail != ch->tail) {
+                hdr->claim.store(tail, memory_order_seq_cst);
+                if (pinned(ch, limit)) {
+                    hdr->claim.store(ch->tail, memory_order_seq_cst);
+                    msgsDropped.fetch_add(1, memory_order_relaxed);
+                    ZCM_DEBUG("subscriber still holds messages on %s, dropping the msg",
+                              channel.c_str());
+                    return ZCM_EAGAIN;
+                }
+                ch->tail = tail;
+                hdr->tail.store(tail, memory_order_seq_cst);
+            }
+        }
+
+        if (pad) {
+            ShmRecord *r = ch->recordAt(pos);
+            r->pos = pos;
+            r->seqno = 0;
+            r->size = pad;
+            r->len = ShmRecord::PAD_LEN;
+            pos += pad;
+        }
+
+        ShmRecord *r = ch->recordAt(pos);
+        r->pos = pos;
+        r->seqno = hdr->seqno++;
+        r->size = need;
+        r->len = msg.len;
+        memcpy(r->data(), msg.buf, msg.len);
+
+        ch->head = end;
+        hdr->head.store(end, memory_order_release);
+        ringBell();
+
+        msgsSent.fetch_add(1, memory_order_relaxed);
+        bytesSent.fetch_add(msg.len, memory_order_relaxed);
+        return ZCM_EOK;
+    }
+
+    // Returns true if a subscriber holds a record before 'limit' that the claim covers.
+    // Pairs with the pin/claim check in readOne(): either the reader sees the claim and
+    // copies the record instead, or we see its pin and leave the record alone
+    bool pinned(Channel *ch, u64 limit)
+    {
+        ShmChannel *hdr = ch->hdr;
+        bool ret = false;
+        u64 now = TimeUtil::utime();
+        u32 n = hdr->numReaders.load(memory_order_acquire);
+        for (u32 i = 0; i < n; ++i) {
+            ShmReader& r = hdr->readers[i];
+            u64 pin = r.pin.load(memory_order_seq_cst);
+            // Note: records before the tail are gone already, a pin can't save them
+            if (pin >= limit || pin < ch->tail || r.revoked.load(memory_order_seq_cst)) {
+                ch->blocked[i].utime = 0;
+                continue;
+            }
+            u32 owner = r.pid.load(memory_order_relaxed);
+            if (owner != 0 && !processAlive(owner)) {
+                r.pin.store(NO_PIN, memory_order_relaxed);
+                r.pid.store(0, memory_order_release);
+                ch->blocked[i].utime = 0;
+                continue;
+            }
+            // The timeout only runs while the subscriber makes no progress
+            if (ch->blocked[i].utime == 0 || ch->blocked[i].pin != pin) {
+                ch->blocked[i].pin = pin;
+                ch->blocked[i].utime = now;
+            }
+            if (now - ch->blocked[i].utime < PIN_TIMEOUT_US) {
+                ret = true;
+                continue;
+            }
+            ZCM_DEBUG("subscriber %u held messages on %s for too long, revoking its pin",
+                      owner, ch->name.c_str());
+            r.revoked.store(1, memory_order_seq_cst);
+            ch->blocked[i].utime = 0;
+        }
+        return ret;
+    }
+
+    int recvmsgEnable(const char *channel, bool enable)
+    {
+        // Mutex used to protect 'subchans' while allowing
+        // recvmsgEnable() and recvmsg() to be called
+        // concurrently
+        unique_lock<mutex> lk(mut);
+
+        if (channel == NULL) {
+            recvAllChannels = enable;
+            if (enable) scanned = false;
+            return ZCM_EOK;
+        }
+
+        // Note: the core enables a channel once per subscription, only the first
+        //       subscription and the last unsubscription matter here
+        string ch = channel;
+        if (enable) {
+            if (subRefs[ch]++ > 0)
+                return ZCM_EOK;
+            if (subchanFindOrCreate(ch, true, false) == nullptr &&
+                find(pendingSubs.begin(), pendingSubs.end(), ch) == pendingSubs.end())
+                pendingSubs.push_back(ch);
+        } else {
+            auto rit = subRefs.find(ch);
+            if (rit == subRefs.end() || --rit->second > 0)
+                return ZCM_EOK;
+            subRefs.erase(rit);
+            auto it = subchans.find(ch);
+            if (it != subchans.end())
+                it->second->subExplicit = false;
+            auto pit = find(pendingSubs.begin(), pendingSubs.end(), ch);
+            if (pit != pendingSubs.end())
+                pendingSubs.erase(pit);
+        }
+        return ZCM_EOK;
+    }
+
+    // Reads the next message of 'ch' into 'msg'. Returns ZCM_EAGAIN if there is none
+    int readOne(Channel *ch, zcm_msg_t *msg)
+    {
+        ShmChannel *hdr = ch->hdr;
+        u64 head = hdr->head.load(memory_order_acquire);
+        if (ch->readPos == head)
+            return ZCM_EAGAIN;
+
+        unique_lock<mutex> lk(ch->leaseMut);
+
+        // The publisher revoked our pin, the messages we still hold may be overwritten.
+        // Once they are all released we can pin again
+        bool revoked = ch->slot && ch->slot->revoked.load(memory_order_seq_cst);
+        if (revoked && ch->leases.empty()) {
+            ch->slot->pin.store(NO_PIN, memory_order_seq_cst);
+            ch->slot->revoked.store(0, memory_order_seq_cst);
+            revoked = false;
+        }
+
+        while (ch->readPos < head) {
+            // Read in place unless we lag far behind the publisher. Pinning the ring
+            // then would soon stop the publisher, so we copy and may lose messages instead
+            u64 oldest = ch->leases.empty() ? ch->readPos : ch->leases.front()->pos;
+            bool inPlace = ch->slot && !revoked && head - oldest <= hdr->capacity / 2;
+            if (inPlace)
+                ch->pin(ch->readPos);
+            else if (ch->slot && ch->leases.empty())
+                ch->slot->pin.store(NO_PIN, memory_order_release);
+
+            u64 tail = hdr->tail.load(memory_order_seq_cst);
+            if (ch->readPos < tail) {
+                // We fell more than a ring behind, the sequence numbers will tell how
+                // many messages were lost
+                ch->readPos = tail;
+                continue;
+            }
+            // The publisher is about to overwrite the record if no pin stops it. Reading
+            // it in place would race with that, a copy is checked against the tail
+            if (inPlace && ch->readPos < hdr->claim.load(memory_order_seq_cst)) {
+                inPlace = false;
+                if (ch->leases.empty())
+                    ch->slot->pin.store(NO_PIN, memory_order_release);
+            }
+
+            ShmRecord *r = ch->recordAt(ch->readPos);
+            u64 pos = r->pos;
+            u64 size = r->size;
+            u64 len = r->len;
+            u64 seqno = r->seqno;
+            u64 off = ch->readPos & ch->mask;
+            bool sane = pos == ch->readPos && size >= sizeof(ShmRecord) &&
+                        size <= hdr->capacity - off &&
+                        (len == ShmRecord::PAD_LEN || len <= size - sizeof(ShmRecord));
+            if (!sane) {
+                // Copying readers may see a record that is being overwritten, in which
+                // case the tail has moved past it. Anything else is corruption
+                atomic_thread_fence(memory_order_acquire);
+                if (ch->readPos < hdr->tail.load(memory_order_relaxed))
+                    continue;
+                ZCM_DEBUG("corrupt record on channel %s, skipping ahead", ch->name.c_str());
+                ch->readPos = head;
+                continue;
+            }
+            if (len == ShmRecord::PAD_LEN) {
+                ch->readPos += size;
+                continue;
+            }
+
+            Lease *l = acquireLease();
+            l->ch = ch;
+            l->pos = ch->readPos;
+            l->released = false;
+            l->inPlace = inPlace;
+            if (inPlace) {
+                // The pin keeps the publisher off the record until it is released
+                ch->leases.push_back(l);
+                msg->buf = r->data();
+            } else {
+                if (l->copySize < len) {
+                    free(l->copy);
+                    l->copySize = len;
+                    l->copy = (u8*) malloc(len);
+                    assert(l->copy);
+                }
+                memcpy(l->copy, r->data(), len);
+                // Seqlock style: the copy is only good if the tail didn't pass it
+                atomic_thread_fence(memory_order_acquire);
+                if (ch->readPos < hdr->tail.load(memory_order_relaxed)) {
+                    freeLease(l);
+                    continue;
+                }
+                msg->buf = l->copy;
+            }
+            ch->readPos += size;
+
+            strncpy(l->channel, ch->name.c_str(), ZCM_CHANNEL_MAXLEN);
+            l->channel[ZCM_CHANNEL_MAXLEN] = '\0';
+            msg->channel = l->channel;
+            msg->len = len;
+            msg->utime = TimeUtil::utime();
+
+            if (ch->haveSeqno && seqno > ch->nextSeqno)
+                msgsLost.fetch_add(seqno - ch->nextSeqno, memory_order_relaxed);
+            ch->haveSeqno = true;
+            ch->nextSeqno = seqno + 1;
+
+            msgsRecv.fetch_add(1, memory_order_relaxed);
+            bytesRecv.fetch_add(len, memory_order_relaxed);
+            return ZCM_EOK;
+        }
+
+        if (ch->slot && ch->leases.empty())
+            ch->slot->pin.store(NO_PIN, memory_order_release);
+        return ZCM_EAGAIN;
+    }
+
+    int recvmsg(zcm_msg_t *msg, int timeout)
+    {
+        size_t n = 1;
+        return recvmsgBatch(msg, &n, timeout);
+    }
+
+    int recvmsgBatch(zcm_msg_t *msgs, size_t *n, int timeout)
+    {
+        size_t max = *n;
+        *n = 0;
+        if (max == 0) return ZCM_EINVALID;
+
+        u64 deadline = timeout >= 0 ? TimeUtil::utime() + (u64)timeout * 1000 : 0;
+        vector<Channel*> chans;
+        while (true) {
+            // Must be read before looking at the rings, see the wait below
+            u32 bell = bus->bell.load(memory_order_seq_cst);
+
+            chans.clear();
+            {
+                unique_lock<mutex> lk(mut);
+                scanForNewChannels();
+                for (auto& elt : subchans) {
+                    Channel *ch = elt.second;
+                    bool active = ch->subExplicit || recvAllChannels;
+                    // Skip whatever was published while we weren't listening
+                    if (active && !ch->active)
+                        ch->readPos = ch->hdr->head.load(memory_order_acquire);
+                    ch->active = active;
+                    if (active) chans.push_back(ch);
+                }
+            }
+
+            // Take one message from each channel per round, starting at a different
+            // channel every time, so that a high frequency channel cannot shadow the others
+            bool progress = true;
+            while (progress && *n < max) {
+                progress = false;
+                for (size_t i = 0; i < chans.size() && *n < max; ++i) {
+                    Channel *ch = chans[(nextPoll + i) % chans.size()];
+                    if (readOne(ch, &msgs[*n]) == ZCM_EOK) {
+                        ++*n;
+                        progress = true;
+                    }
+                }
+            }
+            ++nextPoll;
+            if (*n > 0) return ZCM_EOK;
+
+            int waitMs = -1;
+            if (timeout >= 0) {
+                u64 now = TimeUtil::utime();
+                if (now >= deadline) return ZCM_EAGAIN;
+                waitMs = (int)((deadline - now + 999) / 1000);
+            }
+
+            // Pairs with ringBell(): either the publisher sees us waiting and wakes
+            // us, or the bell has already changed and the futex doesn't block
+            bus->waiters.fetch_add(1, memory_order_seq_cst);
+            futexWait(&bus->bell, bell, waitMs);
+            bus->waiters.fetch_sub(1, memory_order_seq_cst);
+        }
+    }
+
+    int getStats(zcm_trans_stats_t *stats)
+    {
+        stats->msgs_sent      = msgsSent.load(memory_order_relaxed);
+        stats->bytes_sent     = bytesSent.load(memory_order_relaxed);
+        stats->msgs_recv      = msgsRecv.load(memory_order_relaxed);
+        stats->bytes_recv     = bytesRecv.load(memory_order_relaxed);
+        stats->msgs_lost      = msgsLost.load(memory_order_relaxed);
+        stats->msgs_dropped   = msgsDropped.load(memory_order_relaxed);
+        return ZCM_EOK;
+    }
+
+    /********************** STATICS **********************/
+    static zcm_trans_methods_t methods;
+    static ZCM_TRANS_CLASSNAME *cast(zcm_trans_t *zt)
+    {
+        assert(zt->vtbl == &methods);
+        return (ZCM_TRANS_CLASSNAME*)zt;
+    }
+
+    static size_t _getMtu(zcm_trans_t *zt)
+    { return cast(zt)->getMtu(); }
+
+    static int _sendmsg(zcm_trans_t *zt, zcm_msg_t msg)
+    { return cast(zt)->sendmsg(msg); }
+
+    static int _recvmsgEnable(zcm_trans_t *zt, const char *channel, bool enable)
+    { return cast(zt)->recvmsgEnable(channel, enable); }
+
+    static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, int timeout)
+    { return cast(zt)->recvmsg(msg, timeout); }
+
+    static int _recvmsgBatch(zcm_trans_t *zt, zcm_msg_t *msgs, size_t *n, int timeout)
+    { return cast(zt)->recvmsgBatch(msgs, n, timeout); }
+
+    static void _destroy(zcm_trans_t *zt)
+    { delete cast(zt); }
+
+    static void _recvmsgRelease(zcm_trans_t *zt, zcm_msg_t *msg)
+    { cast(zt)->releaseLease(Lease::fromChannel(msg->channel)); }
+
+    static int _getStats(zcm_trans_t *zt, zcm_trans_stats_t *stats)
+    { return cast(zt)->getStats(stats); }
+
+    static const TransportRegister reg;
+};
+
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
+    &ZCM_TRANS_CLASSNAME::_getMtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsgEnable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_recvmsgRelease,
+    NULL, // sendmsg_batch
+    &ZCM_TRANS_CLASSNAME::_recvmsgBatch,
+    &ZCM_TRANS_CLASSNAME::_getStats,
+    NULL, // set_loss_handler
+};
+
+static const char *optFind(zcm_url_opts_t *opts, const string& key)
+{
+    for (size_t i = 0; i < opts->numopts; i++)
+        if (key == opts->name[i])
+            return opts->value[i];
+    return NULL;
+}
+
+// Parses sizes like "4194304", "512k" or "16M". Returns 0 if invalid
+static u64 parseSize(const char *str)
+{
+    char *end;
+    u64 size = strtoull(str, &end, 10);
+    switch (*end) {
+        case '\0': return size;
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+        default: return 0;
+    }
+    return end[1] == '\0' ? size : 0;
+}
+
+static zcm_trans_t *createShm(zcm_url_t *url)
+{
+    string name = zcm_url_address(url);
+    if (name.empty()) name = DEFAULT_NAME;
+
+    u64 ringSize = DEFAULT_RING_SIZE;
+    auto *opts = zcm_url_opts(url);
+    auto *size = optFind(opts, "size");
+    if (size) {
+        ringSize = parseSize(size);
+        if (ringSize < MIN_RING_SIZE || ringSize > MAX_RING_SIZE) {
+            ZCM_DEBUG("ERROR: size must be between %d and %llu bytes",
+                      MIN_RING_SIZE, (unsigned long long)MAX_RING_SIZE);
+            return nullptr;
+        }
+        // Round up to a power of two
+        u64 pow2 = MIN_RING_SIZE;
+        while (pow2 < ringSize) pow2 <<= 1;
+        ringSize = pow2;
+    }
+
+    auto *trans = new ZCM_TRANS_CLASSNAME(name, ringSize);
+    if (!trans->init()) {
+        delete trans;
+        return nullptr;
+    } else {
+        return trans;
+    }
+}
+
+#ifdef USING_TRANS_SHM
+// Register this transport with ZCM
+const TransportRegister ZCM_TRANS_CLASSNAME::reg(
+    "shm", "Transfer data via Shared Memory rings (e.g. 'shm', 'shm://name?size=16M')", createShm);
+#endif
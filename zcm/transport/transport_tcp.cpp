@@ -0,0 +1,923 @@
+#include "zcm/transport.h"
+#include "zcm/transport_registrar.h"
+#include "zcm/transport_register.hpp"
+#include "zcm/util/debug.h"
+
+#include "util/TimeUtil.hpp"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+// Define this the class name you want
+#define ZCM_TRANS_CLASSNAME TransportTcp
+#define MTU (1<<28)
+#define TCP_MAGIC 0x5a544331 // hex repr of ascii "ZTC1"
+#define TCP_VERSION 1
+#define RECONNECT_INTERVAL_US 1000000
+#define READ_CHUNK (64 << 10)
+#define DEFAULT_MAX_QUEUED (64 << 20)
+#define MAX_EVENTS 64
+
+using u8  = uint8_t;
+using u16 = uint16_t;
+using u32 = uint32_t;
+using u64 = uint64_t;
+
+// Wire format: every frame starts with this header (in network byte order), followed
+// by 'chanlen' bytes of channel name (including its terminating '\0') and 'len' bytes
+// of payload. The first frame each side sends is a HELLO carrying TCP_MAGIC and
+// TCP_VERSION as its payload
+enum TcpFrameType : u8
+{
+    FRAME_HELLO     = 1,
+    FRAME_MSG       = 2,
+    FRAME_SUB       = 3,
+    FRAME_UNSUB     = 4,
+    FRAME_SUB_ALL   = 5,
+    FRAME_UNSUB_ALL = 6,
+};
+
+struct TcpFrameHdr
+{
+    u32 len;
+    u8  type;
+    u8  chanlen;
+    u16 unused;
+};
+static_assert(sizeof(TcpFrameHdr) == 8, "TcpFrameHdr must not be padded");
+
+// A set of subscribed channels. Only exact channel names travel over the wire, regex
+// subscriptions in the core show up as 'all'
+struct TcpSubs
+{
+    bool all = false;
+    unordered_set<string> channels;
+
+    bool wants(const char *channel) const
+    { return all || channels.count(channel) != 0; }
+};
+
+enum TcpMode { CONNECT, LISTEN, BROKER, };
+
+struct TcpConn
+{
+    int fd = -1;
+    bool connecting = false;
+    bool helloed = false;   // received the peer's HELLO
+    bool dead = false;
+    string peer;
+
+    // Receive side, only touched by the receive thread. Frames before 'parsed' were
+    // handed out by the last recvmsg() and are dropped at the start of the next one.
+    // 'in' is only ever grown while none of its frames are handed out
+    vector<u8> in;
+    size_t inLen = 0;
+    size_t parsed = 0;
+    size_t needed = 0;      // size of the incomplete frame at 'parsed', 0 if unknown
+
+    // Send side, protected by 'mut' because both the send thread and the receive
+    // thread (subscriptions, forwarding, EPOLLOUT) write to the connection
+    mutex mut;
+    vector<u8> out;
+    size_t outStart = 0;
+    bool waitingForOut = false;
+    TcpSubs remote;            // what the peer wants from us
+    TcpSubs advertised;        // what we told the peer we want (broker mode)
+};
+
+struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
+{
+    TcpMode mode;
+    string host;
+    string port;
+    bool nodelay;
+    size_t maxQueued;
+
+    int epollFd = -1;
+    int listenFd = -1;
+    u64 nextConnectUtime = 0;
+
+    // Protects 'conns' and 'local' against the threads calling sendmsg() and
+    // recvmsg_enable(). Only the receive thread adds or removes connections, so it
+    // may read 'conns' without the lock
+    // Note: lock order is 'mut' before any TcpConn::mut
+    mutex mut;
+    vector<unique_ptr<TcpConn>> conns;
+    TcpSubs local;
+    // Number of subscriptions on each channel in 'local'
+    unordered_map<string, size_t> localRefs;
+    size_t nextHarvest = 0;
+
+    // Note: messages and bytes are counted once for every peer they are sent to or
+    //       dropped for
+    atomic<u64> msgsSent {0}, bytesSent {0}, msgsDropped {0};
+    atomic<u64> msgsRecv {0}, bytesRecv {0};
+
+    ZCM_TRANS_CLASSNAME(TcpMode mode, const string& host, const string& port,
+                        bool nodelay, size_t maxQueued) :
+        mode(mode), host(host), port(port), nodelay(nodelay), maxQueued(maxQueued)
+    {
+        trans_type = ZCM_BLOCKING;
+        vtbl = &methods;
+    }
+
+    ~ZCM_TRANS_CLASSNAME()
+    {
+        for (auto& c : conns)
+            if (c->fd >= 0) close(c->fd);
+        if (listenFd >= 0) close(listenFd);
+        if (epollFd >= 0) close(epollFd);
+    }
+
+    bool init()
+    {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFd < 0) {
+            ZCM_DEBUG("failed to create epoll fd: %s", strerror(errno));
+            return false;
+        }
+        if (mode == CONNECT) {
+            startConnect();
+            return true;
+        }
+
+        addrinfo *res = resolve(true);
+        if (!res) return false;
+        for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            ai->ai_protocol);
+            if (fd < 0) continue;
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+                listenFd = fd;
+                break;
+            }
+            close(fd);
+        }
+        freeaddrinfo(res);
+        if (listenFd < 0) {
+            ZCM_DEBUG("failed to listen on %s:%s: %s", host.c_str(), port.c_str(), strerror(errno));
+            return false;
+        }
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr; // the listening socket
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+        return true;
+    }
+
+    addrinfo *resolve(bool passive)
+    {
+        addrinfo hints, *res = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (passive) hints.ai_flags = AI_PASSIVE;
+        const char *h = (host.empty() || host == "*") ? nullptr : host.c_str();
+        int rc = getaddrinfo(h, port.c_str(), &hints, &res);
+        if (rc != 0) {
+            ZCM_DEBUG("failed to resolve %s:%s: %s", host.c_str(), port.c_str(), gai_strerror(rc));
+            return nullptr;
+        }
+        return res;
+    }
+
+    void setupSocket(int fd)
+    {
+        int flag = nodelay ? 1 : 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+
+    // Receive thread only
+    void addConn(int fd, bool connecting, const string& peer)
+    {
+        TcpConn *c = new TcpConn();
+        c->fd = fd;
+        c->connecting = connecting;
+        c->peer = peer;
+
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = connecting ? EPOLLOUT : EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+
+        unique_lock<mutex> lk(mut);
+        conns.emplace_back(c);
+        if (!connecting) greet(c);
+    }
+
+    // Requires 'mut'. Sends our HELLO and subscriptions over a new connection
+    void greet(TcpConn *c)
+    {
+        ZCM_DEBUG("connected to %s", c->peer.c_str());
+        u8 hello[8];
+        u32 magic = htonl(TCP_MAGIC), version = htonl(TCP_VERSION);
+        memcpy(hello, &magic, 4);
+        memcpy(hello + 4, &version, 4);
+        unique_lock<mutex> lk(c->mut);
+        sendControl(c, FRAME_HELLO, nullptr, hello, sizeof(hello));
+        advertise(c);
+    }
+
+    void startConnect()
+    {
+        nextConnectUtime = TimeUtil::utime() + RECONNECT_INTERVAL_US;
+        addrinfo *res = resolve(false);
+        if (!res) return;
+        for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            ai->ai_protocol);
+            if (fd < 0) continue;
+            setupSocket(fd);
+            int rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+            if (rc == 0 || errno == EINPROGRESS) {
+                addConn(fd, rc != 0, host + ":" + port);
+                break;
+            }
+            close(fd);
+        }
+        freeaddrinfo(res);
+    }
+
+    void acceptAll()
+    {
+        while (true) {
+            sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            int fd = accept4(listenFd, (sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    ZCM_DEBUG("accept failed: %s", strerror(errno));
+                return;
+            }
+            setupSocket(fd);
+            char name[NI_MAXHOST + NI_MAXSERV + 1] = "?";
+            char serv[NI_MAXSERV];
+            if (getnameinfo((sockaddr*)&addr, len, name, NI_MAXHOST, serv, sizeof(serv),
+                            NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+                strcat(name, ":");
+                strcat(name, serv);
+            }
+            addConn(fd, false, name);
+        }
+    }
+
+    // Receive thread only. The connection is taken out of epoll right away and freed
+    // once no message handed out by recvmsg() points into its buffer anymore
+    void markDead(TcpConn *c)
+    {
+        if (c->dead) return;
+        ZCM_DEBUG("lost connection to %s", c->peer.c_str());
+        c->dead = true;
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c->fd, nullptr);
+    }
+
+    // Receive thread only
+    void reapDead()
+    {
+        bool reaped = false;
+        unique_lock<mutex> lk(mut);
+        for (size_t i = 0; i < conns.size(); ) {
+            TcpConn *c = conns[i].get();
+            if (!c->dead) { ++i; continue; }
+            {
+                unique_lock<mutex> clk(c->mut);
+                close(c->fd);
+                c->fd = -1;
+            }
+            conns[i] = std::move(conns.back());
+            conns.pop_back();
+            reaped = true;
+        }
+        // What the remaining peers get from us may have shrunk
+        if (reaped && mode == BROKER)
+            for (auto& c : conns) {
+                unique_lock<mutex> clk(c->mut);
+                advertise(c.get());
+            }
+    }
+
+    // Requires TcpConn::mut. Writes as much as possible and queues the rest. Returns false
+    // if the frames had to be dropped because the peer doesn't keep up
+    bool writeFrames(TcpConn *c, iovec *iov, size_t niov, size_t total)
+    {
+        if (c->fd < 0 || c->connecting) return false;
+
+        size_t written = 0;
+        size_t first = 0, offset = 0; // where the unwritten part starts
+        if (c->outStart == c->out.size()) {
+            // Nothing queued: write directly, IOV_MAX entries at a time. This is a
+            // writev() that doesn't raise SIGPIPE when the peer went away
+            while (first < niov) {
+                iovec head = iov[first];
+                iov[first].iov_base = (u8*)head.iov_base + offset;
+                iov[first].iov_len -= offset;
+                msghdr mh;
+                memset(&mh, 0, sizeof(mh));
+                mh.msg_iov = iov + first;
+                mh.msg_iovlen = min(niov - first, (size_t)IOV_MAX);
+                ssize_t rc = ::sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+                iov[first] = head;
+                if (rc < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        // The receive thread notices the broken connection
+                        return false;
+                    }
+                    break;
+                }
+                written += rc;
+                // Skip the iovecs that went out completely
+                size_t n = offset + rc;
+                while (first < niov && n >= iov[first].iov_len) {
+                    n -= iov[first].iov_len;
+                    ++first;
+                }
+                offset = n;
+                if (offset > 0) break; // the socket buffer is full
+            }
+            if (written == total) return true;
+        }
+
+        size_t queued = c->out.size() - c->outStart;
+        if (queued + (total - written) > maxQueued) {
+            if (written != 0) {
+                // A partial frame is on the wire, the rest must follow or the stream breaks
+                ZCM_DEBUG("send queue to %s overflowed, dropping connection", c->peer.c_str());
+                shutdown(c->fd, SHUT_RDWR);
+            }
+            return false;
+        }
+
+        if (c->outStart > c->out.size() / 2) {
+            c->out.erase(c->out.begin(), c->out.begin() + c->outStart);
+            c->outStart = 0;
+        }
+        for (size_t i = first; i < niov; ++i) {
+            u8 *base = (u8*)iov[i].iov_base;
+            c->out.insert(c->out.end(), base + offset, base + iov[i].iov_len);
+            offset = 0;
+        }
+
+        if (!c->waitingForOut) {
+            c->waitingForOut = true;
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT;
+            ev.data.ptr = c;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+        return true;
+    }
+
+    // Receive thread only
+    void flushOut(TcpConn *c)
+    {
+        unique_lock<mutex> lk(c->mut);
+        while (c->outStart < c->out.size()) {
+            ssize_t rc = send(c->fd, c->out.data() + c->outStart, c->out.size() - c->outStart,
+                              MSG_NOSIGNAL);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) markDead(c);
+                return;
+            }
+            c->outStart += rc;
+        }
+        c->out.clear();
+        c->outStart = 0;
+        c->waitingForOut = false;
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+    static void fillHdr(TcpFrameHdr& hdr, TcpFrameType type, size_t chanlen, size_t len)
+    {
+        hdr.len = htonl((u32)len);
+        hdr.type = type;
+        hdr.chanlen = (u8)chanlen;
+        hdr.unused = 0;
+    }
+
+    // Requires TcpConn::mut
+    void sendControl(TcpConn *c, TcpFrameType type, const char *channel, const u8 *data, size_t len)
+    {
+        TcpFrameHdr hdr;
+        size_t chanlen = channel ? strlen(channel) + 1 : 0;
+        fillHdr(hdr, type, chanlen, len);
+        iovec iov[3] = {
+            { &hdr, sizeof(hdr) },
+            { (void*)channel, chanlen },
+            { (void*)data, len },
+        };
+        writeFrames(c, iov, 3, sizeof(hdr) + chanlen + len);
+    }
+
+    // Requires 'mut' and TcpConn::mut. Tells the peer about changes in what we want from it:
+    // our own subscriptions and, for a broker, those of every other peer
+    void advertise(TcpConn *c)
+    {
+        if (c->connecting) return;
+        TcpSubs want;
+        if (mode == BROKER) {
+            want = local;
+            for (auto& o : conns) {
+                if (o.get() == c || o->dead) continue;
+                // Note: 'remote' is only written with 'mut' held, which we have
+                want.all |= o->remote.all;
+                want.channels.insert(o->remote.channels.begin(), o->remote.channels.end());
+            }
+        }
+        const TcpSubs& w = (mode == BROKER) ? want : local;
+
+        TcpSubs& adv = c->advertised;
+        if (w.all != adv.all)
+            sendControl(c, w.all ? FRAME_SUB_ALL : FRAME_UNSUB_ALL, nullptr, nullptr, 0);
+        for (auto& ch : w.channels)
+            if (!adv.channels.count(ch))
+                sendControl(c, FRAME_SUB, ch.c_str(), nullptr, 0);
+        for (auto& ch : adv.channels)
+            if (!w.channels.count(ch))
+                sendControl(c, FRAME_UNSUB, ch.c_str(), nullptr, 0);
+        adv = w;
+    }
+
+    // Requires 'mut'. Queues a message for every connection (except 'from') that wants it
+    void route(const char *channel, const u8 *data, size_t len, TcpConn *from)
+    {
+        TcpFrameHdr hdr;
+        size_t chanlen = strlen(channel) + 1;
+        fillHdr(hdr, FRAME_MSG, chanlen, len);
+        for (auto& c : conns) {
+            if (c.get() == from || c->dead) continue;
+            unique_lock<mutex> lk(c->mut);
+            if (!c->remote.wants(channel)) continue;
+            iovec iov[3] = {
+                { &hdr, sizeof(hdr) },
+                { (void*)channel, chanlen },
+                { (void*)data, len },
+            };
+            writeFrames(c.get(), iov, 3, sizeof(hdr) + chanlen + len);
+        }
+    }
+
+    // Receive thread only, and only while no message of this recvmsg() is handed out.
+    // Reads whatever the socket has
+    void readIn(TcpConn *c)
+    {
+        if (c->needed > 0) {
+            if (c->in.size() < c->parsed + c->needed)
+                c->in.resize(c->parsed + c->needed);
+            c->needed = 0;
+        }
+        while (true) {
+            if (c->in.size() - c->inLen < READ_CHUNK)
+                c->in.resize(c->inLen + READ_CHUNK);
+            ssize_t rc = read(c->fd, c->in.data() + c->inLen, c->in.size() - c->inLen);
+            if (rc > 0) {
+                c->inLen += rc;
+                continue;
+            }
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) markDead(c);
+            return;
+        }
+    }
+
+    // Receive thread only. Handles the frames in the connection's buffer until it finds a
+    // message for us. Returns false if there is no complete one
+    bool nextMsg(TcpConn *c, zcm_msg_t *msg)
+    {
+        while (c->inLen - c->parsed >= sizeof(TcpFrameHdr)) {
+            TcpFrameHdr hdr;
+            memcpy(&hdr, c->in.data() + c->parsed, sizeof(hdr));
+            size_t len = ntohl(hdr.len);
+            size_t chanlen = hdr.chanlen;
+            size_t total = sizeof(hdr) + chanlen + len;
+            if (len > MTU || chanlen > ZCM_CHANNEL_MAXLEN + 1) {
+                ZCM_DEBUG("bad frame from %s, closing the connection", c->peer.c_str());
+                markDead(c);
+                return false;
+            }
+            if (c->inLen - c->parsed < total) {
+                // Note: the buffer can't grow here, messages handed out earlier in this
+                //       recvmsg() point into it. The next recvmsg() makes room for it
+                c->needed = total;
+                return false;
+            }
+            u8 *frame = c->in.data() + c->parsed;
+            const char *channel = (const char*)(frame + sizeof(hdr));
+            u8 *data = frame + sizeof(hdr) + chanlen;
+            c->parsed += total;
+
+            if (chanlen > 0 && channel[chanlen - 1] != '\0') {
+                ZCM_DEBUG("bad channel from %s, closing the connection", c->peer.c_str());
+                markDead(c);
+                return false;
+            }
+
+            if (!c->helloed) {
+                u32 magic = 0, version = 0;
+                if (hdr.type == FRAME_HELLO && len >= 8) {
+                    memcpy(&magic, data, 4);
+                    memcpy(&version, data + 4, 4);
+                }
+                if (ntohl(magic) != TCP_MAGIC || ntohl(version) != TCP_VERSION) {
+                    ZCM_DEBUG("%s doesn't speak our protocol, closing the connection",
+                              c->peer.c_str());
+                    markDead(c);
+                    return false;
+                }
+                c->helloed = true;
+                continue;
+            }
+
+            switch (hdr.type) {
+                case FRAME_MSG: {
+                    if (chanlen == 0) break;
+                    if (mode == BROKER) {
+                        unique_lock<mutex> lk(mut);
+                        route(channel, data, len, c);
+                    }
+                    msg->utime = TimeUtil::utime();
+                    msg->channel = channel;
+                    msg->len = len;
+                    msg->buf = data;
+                    msgsRecv.fetch_add(1, memory_order_relaxed);
+                    bytesRecv.fetch_add(len, memory_order_relaxed);
+                    return true;
+                }
+                case FRAME_SUB:
+                case FRAME_UNSUB:
+                case FRAME_SUB_ALL:
+                case FRAME_UNSUB_ALL: {
+                    unique_lock<mutex> lk(mut);
+                    {
+                        unique_lock<mutex> clk(c->mut);
+                        TcpSubs& r = c->remote;
+                        if (hdr.type == FRAME_SUB_ALL) r.all = true;
+                        else if (hdr.type == FRAME_UNSUB_ALL) r.all = false;
+                        else if (chanlen == 0) break;
+                        else if (hdr.type == FRAME_SUB) r.channels.insert(channel);
+                        else r.channels.erase(channel);
+                    }
+                    if (mode == BROKER) {
+                        for (auto& o : conns) {
+                            if (o.get() == c || o->dead) continue;
+                            unique_lock<mutex> clk(o->mut);
+                            advertise(o.get());
+                        }
+                    }
+                    break;
+                }
+                default:
+                    // Unknown frames are skipped, for forward compatibility
+                    break;
+            }
+        }
+        return false;
+    }
+
+    /********************** METHODS **********************/
+    size_t getMtu()
+    {
+        return MTU;
+    }
+
+    int sendmsg(zcm_msg_t msg)
+    {
+        size_t n = 1;
+        return sendmsgBatch(&msg, &n);
+    }
+
+    int sendmsgBatch(const zcm_msg_t *msgs, size_t *n)
+    {
+        // Everything up to the first invalid message goes out, that one is consumed
+        // with an error
+        size_t num = 0;
+        while (num < *n && strlen(msgs[num].channel) <= ZCM_CHANNEL_MAXLEN &&
+               msgs[num].len <= MTU)
+            ++num;
+        int ret = ZCM_EOK;
+        if (num < *n) {
+            *n = num + 1;
+            ret = ZCM_EINVALID;
+        }
+
+        vector<TcpFrameHdr> hdrs(num);
+        vector<size_t> chanlens(num);
+        for (size_t i = 0; i < num; ++i) {
+            chanlens[i] = strlen(msgs[i].channel) + 1;
+            fillHdr(hdrs[i], FRAME_MSG, chanlens[i], msgs[i].len);
+        }
+
+        // Every connection gets all of the messages it wants in as few writev()s as possible
+        vector<iovec> iov;
+        unique_lock<mutex> lk(mut);
+        for (auto& c : conns) {
+            if (c->dead) continue;
+            unique_lock<mutex> clk(c->mut);
+            iov.clear();
+            size_t total = 0, wanted = 0, bytes = 0;
+            for (size_t i = 0; i < num; ++i) {
+                if (!c->remote.wants(msgs[i].channel)) continue;
+                iov.push_back({ &hdrs[i], sizeof(TcpFrameHdr) });
+                iov.push_back({ (void*)msgs[i].channel, chanlens[i] });
+                iov.push_back({ (void*)msgs[i].buf, msgs[i].len });
+                total += sizeof(TcpFrameHdr) + chanlens[i] + msgs[i].len;
+                ++wanted;
+                bytes += msgs[i].len;
+            }
+            if (wanted == 0) continue;
+            if (writeFrames(c.get(), iov.data(), iov.size(), total)) {
+                msgsSent.fetch_add(wanted, memory_order_relaxed);
+                bytesSent.fetch_add(bytes, memory_order_relaxed);
+            } else {
+                ZCM_DEBUG("dropped messages for %s", c->peer.c_str());
+                msgsDropped.fetch_add(wanted, memory_order_relaxed);
+            }
+        }
+        lk.unlock();
+
+        return ret;
+    }
+
+    int recvmsgEnable(const char *channel, bool enable)
+    {
+        unique_lock<mutex> lk(mut);
+        if (channel == NULL) {
+            local.all = enable;
+        } else {
+            if (strlen(channel) > ZCM_CHANNEL_MAXLEN)
+                return ZCM_EINVALID;
+            // Note: the core enables a channel once per subscription, the peers only
+            //       hear about the first subscription and the last unsubscription
+            if (enable) {
+                if (localRefs[channel]++ > 0) return ZCM_EOK;
+                local.channels.insert(channel);
+            } else {
+                auto it = localRefs.find(channel);
+                if (it == localRefs.end()) return ZCM_EOK;
+                if (--it->second > 0) return ZCM_EOK;
+                localRefs.erase(it);
+                local.channels.erase(channel);
+            }
+        }
+        for (auto& c : conns) {
+            if (c->dead) continue;
+            unique_lock<mutex> clk(c->mut);
+            advertise(c.get());
+        }
+        return ZCM_EOK;
+    }
+
+    // Takes one message from each connection per round so that a busy peer cannot
+    // shadow the others
+    void harvest(zcm_msg_t *msgs, size_t *n, size_t max)
+    {
+        bool progress = true;
+        while (progress && *n < max) {
+            progress = false;
+            size_t num = conns.size();
+            for (size_t i = 0; i < num && *n < max; ++i) {
+                TcpConn *c = conns[(nextHarvest + i) % num].get();
+                if (c->connecting || c->dead) continue;
+                if (nextMsg(c, &msgs[*n])) {
+                    ++*n;
+                    progress = true;
+                }
+            }
+        }
+        ++nextHarvest;
+    }
+
+    int recvmsg(zcm_msg_t *msg, int timeout)
+    {
+        size_t n = 1;
+        return recvmsgBatch(msg, &n, timeout);
+    }
+
+    int recvmsgBatch(zcm_msg_t *msgs, size_t *n, int timeout)
+    {
+        size_t max = *n;
+        *n = 0;
+        if (max == 0) return ZCM_EINVALID;
+
+        // The messages of the last call are gone now
+        for (auto& c : conns) {
+            if (c->parsed > 0) {
+                memmove(c->in.data(), c->in.data() + c->parsed, c->inLen - c->parsed);
+                c->inLen -= c->parsed;
+                c->parsed = 0;
+            }
+            // Make sure an incomplete frame will fit once it has arrived
+            if (c->in.size() < c->needed) c->in.resize(c->needed);
+            c->needed = 0;
+        }
+
+        u64 deadline = timeout >= 0 ? TimeUtil::utime() + (u64)timeout * 1000 : 0;
+        epoll_event events[MAX_EVENTS];
+        while (true) {
+            harvest(msgs, n, max);
+            if (*n > 0) return ZCM_EOK;
+            reapDead();
+
+            u64 now = TimeUtil::utime();
+            if (mode == CONNECT && conns.empty() && now >= nextConnectUtime)
+                startConnect();
+
+            int waitMs = -1;
+            if (timeout >= 0) {
+                if (now >= deadline) return ZCM_EAGAIN;
+                waitMs = (int)((deadline - now + 999) / 1000);
+            }
+            if (mode == CONNECT && conns.empty()) {
+                int untilConnect = nextConnectUtime > now ?
+                                   (int)((nextConnectUtime - now + 999) / 1000) : 0;
+                if (waitMs < 0 || untilConnect < waitMs) waitMs = untilConnect;
+            }
+
+            int nev = epoll_wait(epollFd, events, MAX_EVENTS, waitMs);
+            if (nev < 0) {
+                if (errno != EINTR) ZCM_DEBUG("epoll_wait failed: %s", strerror(errno));
+                continue;
+            }
+            for (int i = 0; i < nev; ++i) {
+                TcpConn *c = (TcpConn*) events[i].data.ptr;
+                if (c == nullptr) {
+                    acceptAll();
+                    continue;
+                }
+                if (c->dead) continue;
+                u32 ev = events[i].events;
+                if (c->connecting) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if (err != 0 || (ev & (EPOLLERR | EPOLLHUP))) {
+                        ZCM_DEBUG("failed to connect to %s: %s", c->peer.c_str(), strerror(err));
+                        markDead(c);
+                        continue;
+                    }
+                    c->connecting = false;
+                    epoll_event mod;
+                    memset(&mod, 0, sizeof(mod));
+                    mod.events = EPOLLIN;
+                    mod.data.ptr = c;
+                    epoll_ctl(epollFd, EPOLL_CTL_MOD, c->fd, &mod);
+                    unique_lock<mutex> lk(mut);
+                    greet(c);
+                    continue;
+                }
+                if (ev & EPOLLOUT) flushOut(c);
+                if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) readIn(c);
+            }
+        }
+    }
+
+    int getStats(zcm_trans_stats_t *stats)
+    {
+        stats->msgs_sent  = msgsSent.load(memory_order_relaxed);
+        stats->bytes_sent = bytesSent.load(memory_order_relaxed);
+        stats->msgs_recv  = msgsRecv.load(memory_order_relaxed);
+        stats->bytes_recv = bytesRecv.load(memory_order_relaxed);
+        stats->msgs_dropped = msgsDropped.load(memory_order_relaxed);
+        return ZCM_EOK;
+    }
+
+    /********************** STATICS **********************/
+    static zcm_trans_methods_t methods;
+    static ZCM_TRANS_CLASSNAME *cast(zcm_trans_t *zt)
+    {
+        assert(zt->vtbl == &methods);
+        return (ZCM_TRANS_CLASSNAME*)zt;
+    }
+
+    static size_t _getMtu(zcm_trans_t *zt)
+    { return cast(zt)->getMtu(); }
+
+    static int _sendmsg(zcm_trans_t *zt, zcm_msg_t msg)
+    { return cast(zt)->sendmsg(msg); }
+
+    static int _recvmsgEnable(zcm_trans_t *zt, const char *channel, bool enable)
+    { return cast(zt)->recvmsgEnable(channel, enable); }
+
+    static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, int timeout)
+    { return cast(zt)->recvmsg(msg, timeout); }
+
+    static int _sendmsgBatch(zcm_trans_t *zt, const zcm_msg_t *msgs, size_t *n)
+    { return cast(zt)->sendmsgBatch(msgs, n); }
+
+    static int _recvmsgBatch(zcm_trans_t *zt, zcm_msg_t *msgs, size_t *n, int timeout)
+    { return cast(zt)->recvmsgBatch(msgs, n, timeout); }
+
+    static void _destroy(zcm_trans_t *zt)
+    { delete cast(zt); }
+
+    static int _getStats(zcm_trans_t *zt, zcm_trans_stats_t *stats)
+    { return cast(zt)->getStats(stats); }
+
+    static const TransportRegister reg;
+};
+
+zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
+    &ZCM_TRANS_CLASSNAME::_getMtu,
+    &ZCM_TRANS_CLASSNAME::_sendmsg,
+    &ZCM_TRANS_CLASSNAME::_recvmsgEnable,
+    &ZCM_TRANS_CLASSNAME::_recvmsg,
+    NULL, // update
+    &ZCM_TRANS_CLASSNAME::_destroy,
+    NULL, // recvmsg_release
+    &ZCM_TRANS_CLASSNAME::_sendmsgBatch,
+    &ZCM_TRANS_CLASSNAME::_recvmsgBatch,
+    &ZCM_TRANS_CLASSNAME::_getStats,
+    NULL, // set_loss_handler
+};
+
+static const char *optFind(zcm_url_opts_t *opts, const string& key)
+{
+    for (size_t i = 0; i < opts->numopts; i++)
+        if (key == opts->name[i])
+            return opts->value[i];
+    return NULL;
+}
+
+static zcm_trans_t *createTcp(zcm_url_t *url)
+{
+    string addr = zcm_url_address(url);
+    size_t colon = addr.rfind(':');
+    if (colon == string::npos) {
+        ZCM_DEBUG("ERROR: Url format is <host>:<port>");
+        return nullptr;
+    }
+    string host = addr.substr(0, colon);
+    string port = addr.substr(colon + 1);
+    // Allow [::1]:port for IPv6 literals
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    auto *opts = zcm_url_opts(url);
+    TcpMode mode = CONNECT;
+    auto *modeStr = optFind(opts, "mode");
+    if (modeStr) {
+        string m = modeStr;
+        if      (m == "connect") mode = CONNECT;
+        else if (m == "listen")  mode = LISTEN;
+        else if (m == "broker")  mode = BROKER;
+        else {
+            ZCM_DEBUG("ERROR: mode must be one of connect, listen or broker");
+            return nullptr;
+        }
+    }
+    auto *nodelay = optFind(opts, "nodelay");
+    auto *maxQueued = optFind(opts, "max_queued");
+
+    auto *trans = new ZCM_TRANS_CLASSNAME(mode, host, port,
+                                          nodelay ? atoi(nodelay) != 0 : true,
+                                          maxQueued ? strtoull(maxQueued, NULL, 10)
+                                                    : DEFAULT_MAX_QUEUED);
+    if (!trans->init()) {
+        delete trans;
+        return nullptr;
+    } else {
+        return trans;
+    }
+}
+
+#ifdef USING_TRANS_TCP
+// Register this transport with ZCM
+const TransportRegister ZCM_TRANS_CLASSNAME::reg(
+    "tcp", "Transfer data via TCP unicast (e.g. 'tcp://host:7700', 'tcp://*:7700?mode=broker')",
+    createTcp);
+#endif
@@ -11,8 +11,10 @@
 
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/inotify.h>
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <cassert>
 
@@ -29,12 +31,52 @@ using namespace std;
 // Define this the class name you want
 #define ZCM_TRANS_CLASSNAME TransportZmqLocal
 #define MTU (1<<28)
-#define START_BUF_SIZE (1 << 20)
-#define ZMQ_IO_THREADS 1
+#define MAX_FREE_RECV_MSGS 64
+#define DEFAULT_IO_THREADS 1
 #define IPC_NAME_PREFIX "zcm-channel-zmq-ipc-"
 
 enum Type { IPC, INPROC, };
 
+// Socket options that can be given in the url, either for every channel (e.g. 'hwm=1000')
+// or for a single one (e.g. 'hwm.POSE=10'). Unset values (-1) keep the zmq defaults
+struct SockOpts
+{
+    int sndhwm = -1;
+    int rcvhwm = -1;
+    int sndbuf = -1;
+    int rcvbuf = -1;
+    // Only keep the latest message, for channels where only the freshest state matters
+    bool conflate = false;
+
+    // Returns false if 'key' isn't a socket option
+    bool set(const string& key, const char *val)
+    {
+        int v = val ? atoi(val) : 1;
+        if      (key == "hwm")      sndhwm = rcvhwm = v;
+        else if (key == "sndhwm")   sndhwm = v;
+        else if (key == "rcvhwm")   rcvhwm = v;
+        else if (key == "sndbuf")   sndbuf = v;
+        else if (key == "rcvbuf")   rcvbuf = v;
+        else if (key == "conflate") conflate = v != 0;
+        else return false;
+        return true;
+    }
+};
+
+// A received message that is leased out through recvmsg() and handed back through
+// recvmsgRelease(). The payload stays in the zmq_msg_t that zmq received it into, so
+// nothing is copied. The channel must be the first member so that the channel pointer
+// in a released zcm_msg_t can be mapped back to its RecvMsg
+// Note: zmq keeps small messages inside the zmq_msg_t itself, so a RecvMsg must not move
+struct RecvMsg
+{
+    char channel[ZCM_CHANNEL_MAXLEN + 1];
+    zmq_msg_t zmsg;
+
+    static RecvMsg *fromChannel(const char *channel)
+    { return (RecvMsg*) channel; }
+};
+
 struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 {
     void *ctx;
@@ -42,14 +84,33 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
     string subnet;
 
+    int ioThreads = DEFAULT_IO_THREADS;
+    SockOpts defaultOpts;
+    unordered_map<string, SockOpts> channelOpts;
+
     unordered_map<string, void*> pubsocks;
     // socket pair contains the socket + whether it was subscribed to explicitly or not
     unordered_map<string, pair<void*, bool>> subsocks;
     bool recvAllChannels = false;
 
-    string recvmsgChannel;
-    size_t recvmsgBufferSize = START_BUF_SIZE; // Start at 1MB but allow it to grow to MTU
-    uint8_t* recvmsgBuffer;
+    // The poll set over 'subsocks', only rebuilt when 'pollSetDirty' says so. When
+    // receiving all IPC channels, the last item is the inotify watch on the IPC directory
+    vector<zmq_pollitem_t> pitems;
+    vector<string> pchannels;
+    bool pollSetDirty = true;
+    size_t nextPoll = 0;
+
+    // Watches the IPC directory for new publishers (-1 if unavailable)
+    int inotifyFd = -1;
+    // Whether the channels that existed before 'recvAllChannels' was set were picked up
+    bool scannedChannels = false;
+    // Number of pubsocks the last inprocScanForNewChannels() saw
+    size_t inprocScannedPubsocks = 0;
+
+    // Messages that have been released and can be reused by recvmsg().
+    // Protected by 'recvMsgMut' because messages are released from another thread
+    vector<RecvMsg*> freeRecvMsgs;
+    mutex recvMsgMut;
 
     // Mutex used to protect 'subsocks' while allowing
     // recvmsgEnable() and recvmsg() to be called
@@ -67,11 +128,22 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 
         ZCM_DEBUG("IPC Address: %s\n", subnet.c_str());
 
-        recvmsgBuffer = new uint8_t[recvmsgBufferSize];
+        parseOpts(zcm_url_opts(url));
 
-        ctx = zmq_init(ZMQ_IO_THREADS);
+        ctx = zmq_init(ioThreads);
         assert(ctx != nullptr);
         type = type_;
+
+        if (type == IPC) {
+            inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotifyFd >= 0 &&
+                inotify_add_watch(inotifyFd, string("/tmp/" + subnet).c_str(),
+                                  IN_CREATE | IN_MOVED_TO) < 0) {
+                ZCM_DEBUG("failed to watch the ipc directory: %s", strerror(errno));
+                close(inotifyFd);
+                inotifyFd = -1;
+            }
+        }
     }
 
     ~ZCM_TRANS_CLASSNAME()
@@ -115,7 +187,112 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("failed to terminate context: %s", zmq_strerror(errno));
         }
 
-        delete[] recvmsgBuffer;
+        for (auto *rm : freeRecvMsgs)
+            delete rm;
+
+        if (inotifyFd >= 0)
+            close(inotifyFd);
+    }
+
+    RecvMsg *acquireRecvMsg()
+    {
+        {
+            unique_lock<mutex> lk(recvMsgMut);
+            if (!freeRecvMsgs.empty()) {
+                RecvMsg *rm = freeRecvMsgs.back();
+                freeRecvMsgs.pop_back();
+                return rm;
+            }
+        }
+        return new RecvMsg();
+    }
+
+    // Note: the zmq_msg_t must already be closed
+    void freeRecvMsg(RecvMsg *rm)
+    {
+        unique_lock<mutex> lk(recvMsgMut);
+        if (freeRecvMsgs.size() < MAX_FREE_RECV_MSGS) {
+            freeRecvMsgs.push_back(rm);
+        } else {
+            lk.unlock();
+            delete rm;
+        }
+    }
+
+    void releaseRecvMsg(RecvMsg *rm)
+    {
+        // Hands the payload back to zmq
+        zmq_msg_close(&rm->zmsg);
+        freeRecvMsg(rm);
+    }
+
+    // Url options: 'io_threads=<n>', the SockOpts for every channel,
+    // 'conflate_channels=<ch>,<ch>' to conflate a list of channels and
+    // '<sockopt>.<channel>=<val>' for a single channel
+    void parseOpts(zcm_url_opts_t *opts)
+    {
+        vector<pair<string, const char*>> perChannel;
+        for (size_t i = 0; i < opts->numopts; ++i) {
+            string key = opts->name[i];
+            const char *val = opts->value[i];
+            size_t dot = key.find('.');
+            if (key == "io_threads") {
+                ioThreads = val ? atoi(val) : DEFAULT_IO_THREADS;
+            } else if (key == "conflate_channels") {
+                string list = val ? val : "";
+                size_t start = 0, comma;
+                do {
+                    comma = list.find(',', start);
+                    string ch = list.substr(start, comma - start);
+                    if (!ch.empty()) perChannel.emplace_back("conflate." + ch, "1");
+                    start = comma + 1;
+                } while (comma != string::npos);
+            } else if (dot != string::npos) {
+                perChannel.emplace_back(key, val);
+            } else if (key == "conflate" && val && strcmp(val, "0") && strcmp(val, "1")) {
+                ZCM_DEBUG("ignoring conflate=%s, it takes 0 or 1 (see conflate_channels)", val);
+            } else if (!defaultOpts.set(key, val)) {
+                ZCM_DEBUG("ignoring unknown url option '%s'", key.c_str());
+            }
+        }
+
+        // Per channel options apply on top of the ones for every channel
+        for (auto& kv : perChannel) {
+            size_t dot = kv.first.find('.');
+            string ch = kv.first.substr(dot + 1);
+            auto it = channelOpts.find(ch);
+            if (it == channelOpts.end())
+                it = channelOpts.emplace(ch, defaultOpts).first;
+            if (!it->second.set(kv.first.substr(0, dot), kv.second))
+                ZCM_DEBUG("ignoring unknown url option '%s'", kv.first.c_str());
+        }
+    }
+
+    const SockOpts& sockOptsFor(const string& channel)
+    {
+        auto it = channelOpts.find(channel);
+        return it != channelOpts.end() ? it->second : defaultOpts;
+    }
+
+    // Must be called before binding or connecting the socket
+    bool applySockOpts(void *sock, const string& channel, bool pub)
+    {
+        const SockOpts& o = sockOptsFor(channel);
+        auto setopt = [&](int opt, int val, const char *name) {
+            if (val < 0) return true;
+            if (zmq_setsockopt(sock, opt, &val, sizeof(val)) == 0) return true;
+            ZCM_DEBUG("failed to set %s on %s: %s", name, channel.c_str(), zmq_strerror(errno));
+            return false;
+        };
+        if (pub) {
+            return setopt(ZMQ_SNDHWM, o.sndhwm, "ZMQ_SNDHWM") &&
+                   setopt(ZMQ_SNDBUF, o.sndbuf, "ZMQ_SNDBUF") &&
+                   setopt(ZMQ_CONFLATE, o.conflate ? 1 : -1, "ZMQ_CONFLATE");
+        } else {
+            return setopt(ZMQ_RCVHWM, o.rcvhwm, "ZMQ_RCVHWM") &&
+                   setopt(ZMQ_RCVBUF, o.rcvbuf, "ZMQ_RCVBUF") &&
+                   setopt(ZMQ_CONFLATE, o.conflate ? 1 : -1, "ZMQ_CONFLATE");
+        }
     }
 
     string getAddress(const string& channel)
@@ -163,6 +340,10 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("failed to create pubsock: %s", zmq_strerror(errno));
             return nullptr;
         }
+        if (!applySockOpts(sock, channel, true)) {
+            zmq_close(sock);
+            return nullptr;
+        }
         string address = getAddress(channel);
         int rc = zmq_bind(sock, address.c_str());
         if (rc == -1) {
@@ -186,6 +367,10 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("failed to create subsock: %s", zmq_strerror(errno));
             return nullptr;
         }
+        if (!applySockOpts(sock, channel, false)) {
+            zmq_close(sock);
+            return nullptr;
+        }
         string address = getAddress(channel);
         int rc;
         rc = zmq_connect(sock, address.c_str());
@@ -199,6 +384,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             return nullptr;
         }
         subsocks.emplace(channel, make_pair(sock, subExplicit));
+        pollSetDirty = true;
         return sock;
     }
 
@@ -227,11 +413,45 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         closedir(d);
     }
 
+    // Subscribes to the channels whose sockets showed up in the IPC directory since the
+    // last call, as reported by the inotify watch
+    void ipcReadNewChannels()
+    {
+        const char *prefix = IPC_NAME_PREFIX;
+        size_t prefixLen = strlen(IPC_NAME_PREFIX);
+
+        char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len;
+        while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + len; ) {
+                auto *ev = (struct inotify_event*) p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    // Lost track, fall back to a full scan
+                    ipcScanForNewChannels();
+                    continue;
+                }
+                if (ev->len == 0 || strncmp(ev->name, prefix, prefixLen) != 0)
+                    continue;
+                string channel(ev->name + prefixLen);
+                void *sock = subsockFindOrCreate(channel, false);
+                if (sock == nullptr) {
+                    ZCM_DEBUG("failed to open subsock in ipcReadNewChannels(%s)",
+                              channel.c_str());
+                }
+            }
+        }
+    }
+
     // Note: This only works for channels within this instance! Creating another
     //       ZCM instance using 'inproc' will cause this scan to miss some channels!
     //       Need to implement a better technique. Should use a globally shared datastruct.
     void inprocScanForNewChannels()
     {
+        // Channels are only ever added to 'pubsocks'
+        if (pubsocks.size() == inprocScannedPubsocks)
+            return;
+        inprocScannedPubsocks = pubsocks.size();
         for (auto& elt : pubsocks) {
             auto& channel = elt.first;
             void *sock = subsockFindOrCreate(channel, false);
@@ -276,8 +496,12 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         // TODO: make this prettier
         if (channel == NULL) {
             if (enable) {
+                if (!recvAllChannels) scannedChannels = false;
                 recvAllChannels = enable;
+                pollSetDirty = true;
             } else {
+                recvAllChannels = enable;
+                pollSetDirty = true;
                 for (auto it = subsocks.begin(); it != subsocks.end(); ) {
                     if (!it->second.second) { // This channel is only subscribed to implicitly
                         string address = getAddress(it->first);
@@ -293,6 +517,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                             return ZCM_ECONNECT;
                         }
                         it = subsocks.erase(it);
+                        pollSetDirty = true;
                     } else {
                         ++it;
                     }
@@ -324,6 +549,7 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
                                 return ZCM_ECONNECT;
                             }
                             subsocks.erase(it);
+                            pollSetDirty = true;
                         }
                     }
                 }
@@ -332,36 +558,97 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
         }
     }
 
+    // Receives one message from 'sock' and leases it out without copying. Returns
+    // ZCM_EAGAIN if there was nothing to receive without blocking
+    int recvOne(void *sock, const string& channel, zcm_msg_t *msg)
+    {
+        // Receiving into a zmq_msg_t lets zmq size the message for us, so that
+        // large messages are never truncated.
+        // Note: the message is leased to the caller until it is handed
+        //       back through recvmsgRelease()
+        RecvMsg *rm = acquireRecvMsg();
+        zmq_msg_init(&rm->zmsg);
+        int rc = zmq_msg_recv(&rm->zmsg, sock, ZMQ_DONTWAIT);
+        msg->utime = TimeUtil::utime();
+        if (rc == -1) {
+            int err = errno;
+            releaseRecvMsg(rm);
+            if (err == EAGAIN) return ZCM_EAGAIN;
+            fprintf(stderr, "zmq_msg_recv failed with: %s", zmq_strerror(err));
+            // TODO: implement error handling, don't just assert
+            assert(0 && "unexpected codepath");
+            return ZCM_EAGAIN;
+        }
+        size_t size = zmq_msg_size(&rm->zmsg);
+        assert(size <= MTU && "Received message that is bigger than a legally-published message could be");
+
+        strncpy(rm->channel, channel.c_str(), ZCM_CHANNEL_MAXLEN);
+        rm->channel[ZCM_CHANNEL_MAXLEN] = '\0';
+        msg->channel = rm->channel;
+        msg->len = size;
+        msg->buf = (uint8_t*) zmq_msg_data(&rm->zmsg);
+        return ZCM_EOK;
+    }
+
+    // Requires 'mut'. Picks up new channels when receiving all of them and brings
+    // the poll set up to date
+    void updatePollSet()
+    {
+        if (recvAllChannels) {
+            switch (type) {
+                case IPC:
+                    if (!scannedChannels || inotifyFd < 0) {
+                        ipcScanForNewChannels();
+                        scannedChannels = true;
+                    }
+                    break;
+                case INPROC:
+                    inprocScanForNewChannels();
+                    break;
+            }
+        }
+
+        if (!pollSetDirty)
+            return;
+        pollSetDirty = false;
+
+        pitems.clear();
+        pchannels.clear();
+        for (auto& elt : subsocks) {
+            zmq_pollitem_t p;
+            memset(&p, 0, sizeof(p));
+            p.socket = elt.second.first;
+            p.events = ZMQ_POLLIN;
+            pitems.push_back(p);
+            pchannels.push_back(elt.first);
+        }
+        if (recvAllChannels && inotifyFd >= 0) {
+            zmq_pollitem_t p;
+            memset(&p, 0, sizeof(p));
+            p.fd = inotifyFd;
+            p.events = ZMQ_POLLIN;
+            pitems.push_back(p);
+        }
+    }
+
     int recvmsg(zcm_msg_t *msg, int timeout)
     {
-        // Build up a list of poll items
-        vector<zmq_pollitem_t> pitems;
-        vector<string> pchannels;
+        size_t n = 1;
+        return recvmsgBatch(msg, &n, timeout);
+    }
+
+    int recvmsgBatch(zcm_msg_t *msgs, size_t *n, int timeout)
+    {
+        size_t max = *n;
+        *n = 0;
+        if (max == 0) return ZCM_EINVALID;
+
         {
             // Mutex used to protect 'subsocks' while allowing
             // recvmsgEnable() and recvmsg() to be called
             // concurrently
             unique_lock<mutex> lk(mut);
-
-            if (recvAllChannels) {
-                switch (type) {
-                    case IPC: ipcScanForNewChannels();
-                    case INPROC: inprocScanForNewChannels();
-                }
-            }
-
-            pitems.resize(subsocks.size());
-            int i = 0;
-            for (auto& elt : subsocks) {
-                auto& channel = elt.first;
-                auto& sock = elt.second.first;
-                auto *p = &pitems[i];
-                memset(p, 0, sizeof(*p));
-                p->socket = sock;
-                p->events = ZMQ_POLLIN;
-                pchannels.emplace_back(channel);
-                ++i;
-            }
+            updatePollSet();
         }
 
         timeout = (timeout >= 0) ? timeout : -1;
@@ -373,52 +660,35 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
             ZCM_DEBUG("zmq_poll failed with: %s", zmq_strerror(errno));
             return ZCM_EAGAIN;
         }
-        if (rc >= 0) {
-            for (size_t i = 0; i < pitems.size(); ++i) {
-                auto& p = pitems[i];
-                if (p.revents != 0) {
-                    // NOTE: zmq_recv can return an integer > the len parameter passed in
-                    //       (in this case recvmsgBufferSize); however, all bytes past
-                    //       len are truncated and not placed in the buffer. This means
-                    //       that you will always lose the first message you get that is
-                    //       larger than recvmsgBufferSize
-                    int rc = zmq_recv(p.socket, recvmsgBuffer, recvmsgBufferSize, 0);
-                    msg->utime = TimeUtil::utime();
-                    if (rc == -1) {
-                        fprintf(stderr, "zmq_recv failed with: %s", zmq_strerror(errno));
-                        // TODO: implement error handling, don't just assert
-                        assert(0 && "unexpected codepath");
-                    }
-                    assert(0 < rc);
-                    assert(rc < MTU && "Received message that is bigger than a legally-published message could be");
-                    if (rc > (int)recvmsgBufferSize) {
-                        ZCM_DEBUG("Reallocating recv buffer to handle larger messages. Size is now %d", rc);
-                        recvmsgBufferSize = rc * 2;
-                        delete[] recvmsgBuffer;
-                        recvmsgBuffer = new uint8_t[recvmsgBufferSize];
-                        return ZCM_EAGAIN;
-                    }
-                    recvmsgChannel = pchannels[i];
-                    msg->channel = recvmsgChannel.c_str();
-                    msg->len = rc;
-                    msg->buf = recvmsgBuffer;
-
-                    // Note: This is probably fine and there probably isn't an elegant
-                    //       way to improve this, but we could technically have more than
-                    //       one socket with a message ready, but because our API is set
-                    //       up to only handle one message at a time, we don't read all
-                    //       the messages that are ready, only the first. You could
-                    //       imagine a case where one channel was at a very high freq
-                    //       and getting interpreted first could shadow a low freq message
-                    //       on a resource constrained system, though perhaps that's just
-                    //       and indicator that you need to optimize your code or do less.
-
-                    return ZCM_EOK;
+
+        size_t nsocks = pchannels.size();
+        if (nsocks < pitems.size() && pitems[nsocks].revents != 0) {
+            // A new publisher showed up, the poll set changes on the next call
+            unique_lock<mutex> lk(mut);
+            if (recvAllChannels) ipcReadNewChannels();
+        }
+
+        // Drain every ready socket, taking one message from each per round (and starting
+        // at a different socket every call) so that a high frequency channel cannot
+        // shadow the others
+        bool progress = rc > 0;
+        while (progress && *n < max) {
+            progress = false;
+            for (size_t i = 0; i < nsocks && *n < max; ++i) {
+                size_t idx = (nextPoll + i) % nsocks;
+                auto& p = pitems[idx];
+                if (p.revents == 0) continue;
+                if (recvOne(p.socket, pchannels[idx], &msgs[*n]) == ZCM_EOK) {
+                    ++*n;
+                    progress = true;
+                } else {
+                    p.revents = 0;
                 }
             }
         }
+        ++nextPoll;
 
-        return ZCM_EAGAIN;
+        return (*n > 0) ? ZCM_EOK : ZCM_EAGAIN;
     }
 
     /********************** STATICS **********************/
@@ -441,9 +711,15 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, int timeout)
     { return cast(zt)->recvmsg(msg, timeout); }
 
+    static int _recvmsgBatch(zcm_trans_t *zt, zcm_msg_t *msgs, size_t *n, int timeout)
+    { return cast(zt)->recvmsgBatch(msgs, n, timeout); }
+
     static void _destroy(zcm_trans_t *zt)
     { delete cast(zt); }
 
+    static void _recvmsgRelease(zcm_trans_t *zt, zcm_msg_t *msg)
+    { cast(zt)->releaseRecvMsg(RecvMsg::fromChannel(msg->channel)); }
+
     static const TransportRegister regIpc;
     static const TransportRegister regInproc;
 };
@@ -455,6 +731,9 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_recvmsg,
     NULL, // update
     &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_recvmsgRelease,
+    NULL, // sendmsg_batch
+    &ZCM_TRANS_CLASSNAME::_recvmsgBatch,
 };
 
 static zcm_trans_t *createIpc(zcm_url_t *url)
@@ -1,17 +1,5 @@
 #include "buffers.hpp"
 
-static bool sockaddrEqual(struct sockaddr_in *a, struct sockaddr_in *b)
-{
-    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
-           a->sin_port        == b->sin_port &&
-           a->sin_family      == b->sin_family;
-}
-
-bool FragBuf::matchesSockaddr(struct sockaddr_in *addr)
-{
-    return sockaddrEqual(&from, addr);
-}
-
 MessagePool::MessagePool(size_t maxSize, size_t maxBuffers)
     : maxSize(maxSize), maxBuffers(maxBuffers)
 {
@@ -19,6 +7,8 @@ MessagePool::MessagePool(size_t maxSize, size_t maxBuffers)
 
 MessagePool::~MessagePool()
 {
+    while (!fragbufs.empty())
+        removeFragBuf(fragbufs.back());
 }
 
 Buffer MessagePool::allocBuffer(size_t sz)
@@ -82,69 +72,94 @@ void MessagePool::freeMessage(Message *b)
 }
 
 
-FragBuf *MessagePool::addFragBuf(u32 data_size)
+FragBuf *MessagePool::addFragBuf(const struct sockaddr_in& from, u32 msg_seqno,
+                                 u32 data_size, i64 utime)
 {
+    // make room by removing the least recently updated fragment buffers
+    while (lruHead && (totalSize + data_size > maxSize || fragbufs.size() >= maxBuffers)) {
+        ZCM_DEBUG("evicting incomplete message %u (missing %d fragments)",
+                  lruHead->msg_seqno, lruHead->fragments_remaining);
+        removeFragBuf(lruHead);
+        evictions.add(1);
+    }
+
     FragBuf *fbuf = new (mempool.alloc<FragBuf>()) FragBuf{};
     fbuf->buf = this->allocBuffer(data_size);
+    fbuf->from = from;
+    fbuf->msg_seqno = msg_seqno;
+    fbuf->last_packet_utime = utime;
 
-    while (totalSize > maxSize || fragbufs.size() > maxBuffers) {
-        // find and remove the least recently updated fragment buffer
-        int idx = -1;
-        FragBuf *eldest = nullptr;
-        for (size_t i = 0; i < fragbufs.size(); i++) {
-            FragBuf *f = fragbufs[i];
-            if (idx == -1 || f->last_packet_utime < eldest->last_packet_utime) {
-                idx = (int)i;
-                eldest = f;
-            }
-        }
-        if (eldest) {
-            _removeFragBuf((size_t)idx);
-            // XXX Need to free the removed FragBuf*
-        }
-    }
-
+    fbuf->index = fragbufs.size();
     fragbufs.push_back(fbuf);
+    fragIndex[FragKey(from, msg_seqno)] = fbuf;
+    _lruAppend(fbuf);
     totalSize += data_size;
 
     return fbuf;
 }
 
-FragBuf *MessagePool::lookupFragBuf(struct sockaddr_in *key)
+FragBuf *MessagePool::lookupFragBuf(const struct sockaddr_in& from, u32 msg_seqno)
 {
-    for (auto& elt : fragbufs)
-        if (elt->matchesSockaddr(key))
-            return elt;
-    return nullptr;
+    auto it = fragIndex.find(FragKey(from, msg_seqno));
+    return it == fragIndex.end() ? nullptr : it->second;
 }
 
-void MessagePool::_removeFragBuf(size_t index)
+void MessagePool::touchFragBuf(FragBuf *fbuf, i64 utime)
 {
-    assert(index < fragbufs.size());
+    fbuf->last_packet_utime = utime;
+    if (fbuf != lruTail) {
+        _lruUnlink(fbuf);
+        _lruAppend(fbuf);
+    }
+}
+
+void MessagePool::removeFragBuf(FragBuf *fbuf)
+{
+    assert(fbuf->index < fragbufs.size() && fragbufs[fbuf->index] == fbuf);
 
     // Update the total_size of the fragment buffers
-    FragBuf *fbuf = fragbufs[index];
     totalSize -= fbuf->buf.size;
 
-    // delete old element, move last element to this slot, and shrink by 1
-    size_t lastIdx = fragbufs.size()-1;
-    fragbufs[index] = fragbufs[lastIdx];
+    // move last element to this slot, and shrink by 1
+    FragBuf *last = fragbufs.back();
+    fragbufs[fbuf->index] = last;
+    last->index = fbuf->index;
     fragbufs.pop_back();
 
+    fragIndex.erase(FragKey(fbuf->from, fbuf->msg_seqno));
+    _lruUnlink(fbuf);
+
     this->freeBuffer(fbuf->buf);
+    fbuf->~FragBuf();
     mempool.free(fbuf);
 }
 
-void MessagePool::removeFragBuf(FragBuf *fbuf)
+size_t MessagePool::expireFragBufs(i64 utime)
 {
-    // NOTE: this is kinda slow...
-    // Search for the fragbuf index
-    for (size_t idx = 0; idx < fragbufs.size(); idx++)
-        if (fragbufs[idx] == fbuf)
-            return this->_removeFragBuf(idx);
+    size_t n = 0;
+    while (lruHead && lruHead->last_packet_utime < utime) {
+        removeFragBuf(lruHead);
+        ++n;
+    }
+    return n;
+}
 
-    // Did not find
-    assert(0 && "Tried to remove invalid fragbuf");
+void MessagePool::_lruUnlink(FragBuf *fbuf)
+{
+    if (fbuf->lruPrev) fbuf->lruPrev->lruNext = fbuf->lruNext;
+    else               lruHead = fbuf->lruNext;
+    if (fbuf->lruNext) fbuf->lruNext->lruPrev = fbuf->lruPrev;
+    else               lruTail = fbuf->lruPrev;
+    fbuf->lruPrev = fbuf->lruNext = nullptr;
+}
+
+void MessagePool::_lruAppend(FragBuf *fbuf)
+{
+    fbuf->lruPrev = lruTail;
+    fbuf->lruNext = nullptr;
+    if (lruTail) lruTail->lruNext = fbuf;
+    else         lruHead = fbuf;
+    lruTail = fbuf;
 }
 
 void MessagePool::transferBufffer(Message *to, FragBuf *from)
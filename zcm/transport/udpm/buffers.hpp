@@ -1,7 +1,7 @@
 #pragma once
 
 #include "udpm.hpp"
-#include "mempool.hpp"
+#include "zcm/util/mempool.hpp"
 
 /************************* Packet Headers *******************/
 
@@ -64,6 +64,38 @@ struct MsgHeaderLong
 // ASCII-encoded channel name, followed by the payload data
 // if fragment_no > 0, then header is immediately followed by the payload data
 
+// Sent to the multicast group by a receiver (with reliable=1) that is missing
+// fragments of a message. Peers that don't know this magic simply drop it
+struct MsgHeaderNack
+{
+    // Layout
+  private:
+    u32 magic;
+    u32 msg_seqno;    // of the incomplete message
+    u32 sender_addr;  // the sender of that message
+    u16 sender_port;
+    u16 nfragments;   // number of u16 fragment numbers that follow the header
+
+    // Converted data
+  public:
+    u32  getMagic()              { return ntohl(magic); }
+    void setMagic(u32 v)         { magic = htonl(v); }
+    u32  getMsgSeqno()           { return ntohl(msg_seqno); }
+    void setMsgSeqno(u32 v)      { msg_seqno = htonl(v); }
+    // Note: the address and port are kept in network byte order
+    u32  getSenderAddr()         { return sender_addr; }
+    void setSenderAddr(u32 v)    { sender_addr = v; }
+    u16  getSenderPort()         { return sender_port; }
+    void setSenderPort(u16 v)    { sender_port = v; }
+    u16  getNumFragments()       { return ntohs(nfragments); }
+    void setNumFragments(u16 v)  { nfragments = htons(v); }
+
+    // Computed data
+  public:
+    u16  getFragmentNo(size_t i) { u16 v; memcpy(&v, getListPtr() + 2*i, 2); return ntohs(v); }
+    char *getListPtr()           { return (char*)(this+1); }
+};
+
 /******************** message buffer **********************/
 struct Buffer
 {
@@ -96,7 +128,9 @@ struct Message
 {
     i64               utime;       // timestamp of first datagram receipt
 
-    const char       *channel;     // points into 'buf'
+    // Note: the channel is copied out of 'buf' so that a leased message can be
+    //       recovered from the channel pointer handed out in its zcm_msg_t
+    char              channel[ZCM_CHANNEL_MAXLEN+1];
     size_t            channellen;  // length of channel
 
     char             *data;        // points into 'buf'
@@ -106,6 +140,16 @@ struct Message
     Buffer buf;
 
     Message() { memset(this, 0, sizeof(*this)); }
+
+    void setChannel(const char *ch, size_t len)
+    {
+        memcpy(channel, ch, len);
+        channel[len] = '\0';
+        channellen = len;
+    }
+
+    static Message *fromChannel(const char *ch)
+    { return (Message*)(ch - offsetof(Message, channel)); }
 };
 
 struct Packet
@@ -122,24 +166,60 @@ struct Packet
     Packet() { memset(this, 0, sizeof(*this)); }
     MsgHeaderShort *asHeaderShort() { return (MsgHeaderShort*)buf.data; }
     MsgHeaderLong  *asHeaderLong()  { return (MsgHeaderLong* )buf.data; }
+    MsgHeaderNack  *asHeaderNack()  { return (MsgHeaderNack* )buf.data; }
 };
 
 /******************** fragment buffer **********************/
+// Identifies one message of one sender
+struct FragKey
+{
+    u32 addr; // network byte order
+    u16 port; // network byte order
+    u32 msg_seqno;
+
+    FragKey(const struct sockaddr_in& from, u32 msg_seqno)
+        : addr(from.sin_addr.s_addr), port(from.sin_port), msg_seqno(msg_seqno) {}
+
+    bool operator==(const FragKey& o) const
+    { return addr == o.addr && port == o.port && msg_seqno == o.msg_seqno; }
+};
+
+struct FragKeyHash
+{
+    size_t operator()(const FragKey& k) const
+    {
+        u64 v = ((u64)k.addr << 32 | k.msg_seqno) ^ ((u64)k.port * 0x9e3779b97f4a7c15ull);
+        return std::hash<u64>()(v ^ (v >> 29));
+    }
+};
+
 struct FragBuf
 {
-    i64     last_packet_utime;
+    i64     last_packet_utime; // only updated through MessagePool::touchFragBuf()
     u32     msg_seqno;
+    u16     fragments_in_msg;
     u16     fragments_remaining;
 
-    // The channel starts at the beginning of the buffer. The data
-    // follows immediately after the channel and its NULL
+    // The channel arrives with fragment 0, which is not necessarily the first
+    // fragment to arrive. The buffer only holds the data, at offset 0
+    char    channel[ZCM_CHANNEL_MAXLEN+1];
     size_t  channellen;
     struct sockaddr_in from;
 
+    // One bit per fragment that has arrived, so duplicates are ignored
+    vector<u8> received;
+
+    // NACKs sent for this message so far (only with reliable=1)
+    i64     last_nack_utime;
+    u8      nacks_sent;
+
     // Fields set by the allocator object
     Buffer buf;
+    size_t index;               // position in MessagePool::fragbufs
+    FragBuf *lruPrev, *lruNext; // MessagePool's list, least recently updated first
 
-    bool matchesSockaddr(struct sockaddr_in *addr);
+    bool hasFragment(u16 no) { return received[no / 8] & (1 << (no % 8)); }
+    void setFragment(u16 no) { received[no / 8] |= (1 << (no % 8)); }
 };
 
 /************** A pool to handle every alloc/dealloc operation on Message objects ******/
@@ -161,22 +241,35 @@ struct MessagePool
     Message *allocMessageEmpty();
     void freeMessage(Message *b);
 
-    // FragBuf
-    FragBuf *addFragBuf(u32 data_size);
-    FragBuf *lookupFragBuf(struct sockaddr_in *key);
+    // FragBuf: the messages being reassembled, any number of them per sender. When
+    // they exceed the byte or count budget, addFragBuf() evicts the least recently
+    // updated ones. All of these are O(1), apart from evictions
+    FragBuf *addFragBuf(const struct sockaddr_in& from, u32 msg_seqno, u32 data_size, i64 utime);
+    FragBuf *lookupFragBuf(const struct sockaddr_in& from, u32 msg_seqno);
+    void touchFragBuf(FragBuf *fbuf, i64 utime);
     void removeFragBuf(FragBuf *fbuf);
+    // Removes the fragment buffers that were last updated before 'utime', returns how many
+    size_t expireFragBufs(i64 utime);
+    const vector<FragBuf*>& getFragBufs() { return fragbufs; }
+    // Fragment buffers removed by addFragBuf() to make room, may be read from any thread
+    u64 getFragBufEvictions() const { return evictions.get(); }
 
     void transferBufffer(Message *to, FragBuf *from);
     void moveBuffer(Buffer& to, Buffer& from);
 
   private:
     void _freeMessageBuffer(Message *b);
-    void _removeFragBuf(size_t index);
+    void _lruUnlink(FragBuf *fbuf);
+    void _lruAppend(FragBuf *fbuf);
 
   private:
-    MemPool mempool;
+    MemPool& mempool = MemPool::global();
     vector<FragBuf*> fragbufs;
+    unordered_map<FragKey, FragBuf*, FragKeyHash> fragIndex;
+    FragBuf *lruHead = nullptr;
+    FragBuf *lruTail = nullptr;
     size_t maxSize;
     size_t maxBuffers;
     size_t totalSize = 0;
+    StatCounter evictions;
 };
@@ -1,11 +1,12 @@
 #include "udpm.hpp"
 #include "buffers.hpp"
 #include "udpmsocket.hpp"
-#include "mempool.hpp"
+#include "zcm/util/mempool.hpp"
 
 #include "zcm/transport.h"
 #include "zcm/transport_registrar.h"
 #include "zcm/transport_register.hpp"
+#include "util/TimeUtil.hpp"
 
 #define MTU (1<<28)
 
@@ -26,6 +27,20 @@ static i32 utimeInSeconds()
  *                  don't use > 1.  that's just rude.
  * @recv_buf_size:  requested size of the kernel receive buffer, set with
  *                  SO_RCVBUF.  0 indicates to use the default settings.
+ * @gso_size:       if non-zero, fragmented messages are cut into datagrams of
+ *                  this many bytes by the kernel (UDP GSO) where supported.
+ *                  Should fit the path MTU, e.g. 1472 on plain Ethernet. Larger
+ *                  values than a regular fragment datagram are clamped to that.
+ * @pace_mbps:      if non-zero, fragmented messages are sent out no faster
+ *                  than this many megabits per second so that bursts don't
+ *                  overflow the receivers' SO_RCVBUF.
+ * @reliable:       if true, receivers NACK the missing fragments of incomplete
+ *                  messages and senders retransmit them from a bounded window.
+ * @num_groups:     if non-zero, every channel is sent to one of this many groups
+ *                  following @mc_addr (picked by a hash of the channel name) and
+ *                  receivers only join the groups of the channels they subscribe to.
+ * @filter:         if true, the kernel drops the unfragmented messages on channels
+ *                  nobody subscribed to with a socket filter (Linux only).
  *
  */
 struct Params
@@ -35,6 +50,11 @@ struct Params
     u16            port;
     u8             ttl;
     size_t         recv_buf_size;
+    u16            gso_size = 0;
+    u32            pace_mbps = 0;
+    bool           reliable = false;
+    u16            num_groups = 0;
+    bool           filter = false;
 
     Params(const string& ip, u16 port, size_t recv_buf_size, u8 ttl)
     {
@@ -62,32 +82,176 @@ struct UDPM
 
     MessagePool pool {MAX_FRAG_BUF_TOTAL_SIZE, MAX_NUM_FRAG_BUFS};
 
-    /* other variables */
-    u32          udp_rx = 0;            // packets received and processed
-    u32          udp_discarded_bad = 0; // packets discarded because they were bad
-                                    // somehow
-    double       udp_low_watermark = 1.0; // least buffer available
-    i32          udp_last_report_secs = 0;
+    /* statistics, see getStats(). Each counter is only written by one thread: the
+       send thread for the *Sent ones, the recv thread for all the others */
+    StatCounter  msgsSent, packetsSent, bytesSent, fragmentsSent;
+    StatCounter  msgsRecv, fragmentsRecv, packetsBad, msgsIncomplete;
+    StatCounter  nacksSent, retransmits;
+    StatCounter  seqGaps, seqLate, seqReordered, seqDuplicate;
+
+    // state of the last loss report, see checkForMessageLoss()
+    i32               udp_last_report_secs = 0;
+    zcm_trans_stats_t udp_last_report = {};
 
     u32          msg_seqno = 0; // rolling counter of how many messages transmitted
 
+    // Segment size used for UDP GSO, 0 if disabled or unsupported
+    u16          gso_size = 0;
+    // Earliest time the next paced packet may go out
+    i64          pace_next_utime = 0;
+
     /***** Methods ******/
-    UDPM(const string& ip, u16 port, size_t recv_buf_size, u8 ttl);
+    UDPM(const string& ip, u16 port, size_t recv_buf_size, u8 ttl,
+         u16 gso_size, u32 pace_mbps, bool reliable, u16 num_groups, bool filter);
     bool init();
     ~UDPM();
 
     int handle();
 
     int sendmsg(zcm_msg_t msg);
+    int sendmsgBatch(const zcm_msg_t *msgs, size_t *n);
+    int recvmsgEnable(const char *channel, bool enable);
     int recvmsg(zcm_msg_t *msg, int timeout);
+    int recvmsgBatch(zcm_msg_t *msgs, size_t *n, int timeout);
+    void recvmsgRelease(zcm_msg_t *msg);
+
+    int getStats(zcm_trans_stats_t *stats);
+    int setLossHandler(zcm_loss_handler_t cb, void *usr);
 
   private:
+    // Most short messages gathered into a single sendPackets() call
+    static constexpr size_t MAX_SEND_BATCH = 64;
+
+    // Packets preallocated for recvfd.recvPackets(). Every refill receives into the
+    // whole ring at once and readMessage() then works through recvRing[recvNext] to
+    // recvRing[recvFilled-1]. A short message takes over the buffer of its packet,
+    // which is given a new one before the slot is reused
+    static constexpr size_t RECV_RING_SIZE = 32;
+    Packet *recvRing[RECV_RING_SIZE] = {};
+    size_t recvNext = 0;
+    size_t recvFilled = 0;
+
+    // Scratch space for sendFragmented(), reused across messages
+    vector<MsgHeaderLong> fragHdrs;
+    vector<struct iovec> fragIovs;
+    vector<OutPacket> fragPkts;
+
+    int sendFragmented(const zcm_msg_t& msg, size_t channel_size, bool useGso);
+
+    // The subscriptions, only tracked for channel groups and the socket filter.
+    // 'subLock' protects them because recvmsgEnable() may be called from any thread.
+    // The core enables a channel once per subscription, so they are counted
+    mutex subLock;
+    unordered_map<string, u32> subChannels;
+    bool subAll = false;
+    bool filterActive = false; // the kernel drops some channels (filter=1)
+
+    // Channel groups (groups=N). A channel is sent to groupAddrs[channelGroup()], the
+    // base address only carries NACKs and the messages of senders without groups.
+    // Receivers stay in the base group and join the group of every channel they
+    // subscribe to, or every group at once (the "all" group) for regex subscriptions
+    vector<UDPMAddress> groupAddrs;
+    vector<u32> groupRefs;     // subscribed channels per group
+    vector<bool> groupJoined;
+
+    size_t channelGroup(const char *channel) const;
+    const UDPMAddress& destFor(const char *channel) const;
+    void updateMemberships();
+    void updateFilter();
+    void updateSeesAll();
+    void paceBefore(size_t bytes);
+
+    // Reliability (reliable=1). Senders keep their recent fragmented messages in
+    // 'window' (the send thread adds to it, the recv thread retransmits from it when
+    // a NACK for us comes in). Receivers NACK incomplete messages that have not seen
+    // a new fragment for NACK_DELAY_US, at most MAX_NACKS times per message
+    static constexpr size_t RETRANSMIT_WINDOW_BYTES = 64 << 20;
+    static constexpr size_t RETRANSMIT_WINDOW_MSGS = 256;
+    static constexpr i64    NACK_DELAY_US = 10000;
+    static constexpr int    NACK_CHECK_MS = 5;
+    static constexpr u8     MAX_NACKS = 5;
+    static constexpr size_t MAX_NACK_LIST = 512;
+
+    struct SentMessage
+    {
+        u32 seqno;
+        string channel;
+        vector<char> data;
+        size_t fragment_size;
+        u16 nfragments;
+        vector<i64> retransmitted; // last retransmit time per fragment
+    };
+    mutex windowLock;
+    deque<SentMessage> window;
+    size_t windowBytes = 0;
+
+    // Messages recently completed by recvFragment(). Duplicated or retransmitted
+    // fragments that arrive after their message is complete must not start it all
+    // over again
+    struct CompletedMessage { u32 addr; u16 port; u32 seqno; };
+    static constexpr size_t NUM_COMPLETED = 64;
+    CompletedMessage completed[NUM_COMPLETED] = {};
+    size_t completedNext = 0;
+    bool recentlyCompleted(const struct sockaddr_in& from, u32 seqno);
+
+    u16 localPort = 0;        // port of sendfd in network byte order, NACKs are addressed to it
+    u32 localAddr = 0;        // and the address receivers see our packets come from
+    i64 lastNackScan = 0;
+    bool nacksPending = false; // some incomplete message may still need a NACK
+
+    void rememberSent(const zcm_msg_t& msg, u32 seqno, size_t fragment_size, u16 nfragments);
+    void retransmit(SentMessage& sm, u16 frag_no);
+    void handleNack(Packet *pkt, u32 sz);
+    bool sendNacks();
+
+    // Sequence numbers of every sender we receive from, used to tell lost, reordered
+    // and duplicated messages apart. 'highest' is the largest seqno received so far
+    // and bit i of 'seen' is set if seqno highest-1-i has been received as well.
+    // Senders that go quiet for SENDER_TIMEOUT_US are forgotten.
+    // A sender numbers all of its messages in one sequence, so gaps only mean loss
+    // while we receive every one of them ('seesAll'). With channel groups we only get
+    // the groups we joined, and with the socket filter only the short messages of
+    // the channels we subscribed to, so gaps are not counted then. Whenever that
+    // changes, 'resetSenders' has the recv thread start over on every sender
+    static constexpr size_t SEQNO_WINDOW = 64;
+    static constexpr i32    SEQNO_RESYNC = 1 << 16;
+    static constexpr size_t MAX_SENDERS = 1024;
+    static constexpr i64    SENDER_TIMEOUT_US = 10 * 1000000;
+    struct SenderSeqno
+    {
+        u32 first;   // first seqno received, anything before it was never missed
+        u32 highest;
+        u64 seen;
+        i64 last_utime;
+    };
+    unordered_map<u64, SenderSeqno> senders;
+    atomic<bool> seesAll {true};
+    atomic<bool> resetSenders {false};
+
+    mutex lossHandlerLock;
+    zcm_loss_handler_t lossHandler = nullptr;
+    void *lossHandlerUsr = nullptr;
+
+    void trackSeqno(const struct sockaddr_in& from, u32 seqno, i64 utime);
+    void reportLoss(const struct sockaddr_in& from, zcm_loss_type type,
+                    u32 seqno, u32 count, i64 utime);
+
+    // Messages that have not received a fragment for this long are given up on
+    static constexpr i64 FRAG_BUF_TIMEOUT_US = 1000000;
+    void expireFragBufs();
+
     // These returns non-null when a full message has been received
     Message *recvShort(Packet *pkt, u32 sz);
     Message *recvFragment(Packet *pkt, u32 sz);
     Message *readMessage(int timeout);
 
-    Message *m = nullptr;
+    // Messages are leased out by recvmsg() and handed back by recvmsgRelease() on
+    // another thread. The pool is not thread-safe, so released messages are parked
+    // here until the recv thread can return them to the pool
+    mutex releasedLock;
+    vector<Message*> released;
+    vector<Message*> releasedSwap;
+    void freeReleasedMessages();
 
     bool selftest();
     void checkForMessageLoss();
@@ -100,16 +264,16 @@ Message *UDPM::recvShort(Packet *pkt, u32 sz)
     size_t clen = hdr->getChannelLen();
     if (clen > ZCM_CHANNEL_MAXLEN) {
         ZCM_DEBUG("bad channel name length");
-        udp_discarded_bad++;
+        packetsBad.add(1);
         return NULL;
     }
 
-    udp_rx++;
+    msgsRecv.add(1);
+    trackSeqno(*(struct sockaddr_in*)&pkt->from, hdr->getMsgSeqno(), pkt->utime);
 
     Message *msg = pool.allocMessageEmpty();
     msg->utime = pkt->utime;
-    msg->channel = hdr->getChannelPtr();
-    msg->channellen = clen;
+    msg->setChannel(hdr->getChannelPtr(), clen);
     msg->data = hdr->getDataPtr();
     msg->datalen = hdr->getDataLen(sz);
     pool.moveBuffer(msg->buf, pkt->buf);
@@ -119,10 +283,12 @@ Message *UDPM::recvShort(Packet *pkt, u32 sz)
 
 Message *UDPM::recvFragment(Packet *pkt, u32 sz)
 {
+    if (sz < sizeof(MsgHeaderLong)) {
+        packetsBad.add(1);
+        return NULL;
+    }
     MsgHeaderLong *hdr = pkt->asHeaderLong();
-
-    // any existing fragment buffer for this message source?
-    FragBuf *fbuf = pool.lookupFragBuf((struct sockaddr_in*)&pkt->from);
+    const struct sockaddr_in& from = *(struct sockaddr_in*)&pkt->from;
 
     u32 msg_seqno = hdr->getMsgSeqno();
     u32 data_size = hdr->getMsgSize();
@@ -132,12 +298,15 @@ Message *UDPM::recvFragment(Packet *pkt, u32 sz)
     u32 frag_size = hdr->getFragmentSize(sz);
     char *data_start = hdr->getDataPtr();
 
-    // discard any stale fragments from previous messages
-    if (fbuf && ((fbuf->msg_seqno != msg_seqno) ||
-                 (fbuf->buf.size != data_size + fbuf->channellen+1))) {
-        pool.removeFragBuf(fbuf);
+    // any existing fragment buffer for this message? If it doesn't match, the sender
+    // must have restarted and reused the seqno, the old message is not coming anymore
+    FragBuf *fbuf = pool.lookupFragBuf(from, msg_seqno);
+    if (fbuf && ((fbuf->buf.size != data_size) ||
+                 (fbuf->fragments_in_msg != fragments_in_msg))) {
         ZCM_DEBUG("Dropping message (missing %d fragments)", fbuf->fragments_remaining);
+        pool.removeFragBuf(fbuf);
         fbuf = NULL;
+        msgsIncomplete.add(1);
     }
 
     if (data_size > MTU) {
@@ -145,32 +314,53 @@ Message *UDPM::recvFragment(Packet *pkt, u32 sz)
         return NULL;
     }
 
-    // create a new fragment buffer if necessary
-    if (!fbuf && fragment_no == 0) {
-        char *channel = (char*) (hdr + 1);
-        int channel_sz = strlen(channel);
-        if (channel_sz > ZCM_CHANNEL_MAXLEN) {
-            ZCM_DEBUG("bad channel name length");
-            udp_discarded_bad++;
+    if (data_size == 0 || fragment_no >= fragments_in_msg) {
+        ZCM_DEBUG("dropping invalid fragment (%d / %d)", fragment_no, fragments_in_msg);
+        packetsBad.add(1);
+        return NULL;
+    }
+    fragmentsRecv.add(1);
+
+    // create a new fragment buffer if necessary. Any fragment can start a message,
+    // the channel is filled in whenever fragment 0 shows up
+    if (!fbuf) {
+        if (recentlyCompleted(from, msg_seqno)) {
+            ZCM_DEBUG("ignoring late fragment %d of message %u", fragment_no, msg_seqno);
             return NULL;
         }
 
-        fbuf = pool.addFragBuf(channel_sz + 1 + data_size);
-        fbuf->last_packet_utime = pkt->utime;
-        fbuf->msg_seqno = msg_seqno;
+        fbuf = pool.addFragBuf(from, msg_seqno, data_size, pkt->utime);
+        fbuf->fragments_in_msg = fragments_in_msg;
         fbuf->fragments_remaining = fragments_in_msg;
-        fbuf->channellen = channel_sz;
-        fbuf->from = *(struct sockaddr_in*)&pkt->from;
-        memcpy(fbuf->buf.data, data_start, frag_size);
+        fbuf->channellen = 0;
+        fbuf->received.assign((fragments_in_msg + 7) / 8, 0);
+        fbuf->last_nack_utime = 0;
+        fbuf->nacks_sent = 0;
+        nacksPending = params.reliable;
+    }
+    recvfd.checkAndWarnAboutSmallBuffer(data_size, kernel_rbuf_sz);
 
-        --fbuf->fragments_remaining;
+    if (fbuf->hasFragment(fragment_no)) {
+        ZCM_DEBUG("ignoring duplicate fragment %d of message %u", fragment_no, msg_seqno);
         return NULL;
     }
 
-    if (!fbuf) return NULL;
-    recvfd.checkAndWarnAboutSmallBuffer(data_size, kernel_rbuf_sz);
+    // first fragment is special. the channel comes before the data
+    if (fragment_no == 0) {
+        size_t channel_sz = strnlen(data_start, frag_size);
+        if (channel_sz > ZCM_CHANNEL_MAXLEN || channel_sz == frag_size) {
+            ZCM_DEBUG("bad channel name length");
+            packetsBad.add(1);
+            pool.removeFragBuf(fbuf);
+            return NULL;
+        }
+        memcpy(fbuf->channel, data_start, channel_sz + 1);
+        fbuf->channellen = channel_sz;
+        data_start += channel_sz + 1;
+        frag_size -= channel_sz + 1;
+    }
 
-    if (fbuf->channellen+1 + fragment_offset + frag_size > fbuf->buf.size) {
+    if (fragment_offset + frag_size > fbuf->buf.size) {
         ZCM_DEBUG("dropping invalid fragment (off: %d, %d / %zu)",
                 fragment_offset, frag_size, fbuf->buf.size);
         pool.removeFragBuf(fbuf);
@@ -178,98 +368,414 @@ Message *UDPM::recvFragment(Packet *pkt, u32 sz)
     }
 
     // copy data
-    memcpy(fbuf->buf.data + fbuf->channellen+1 + fragment_offset, data_start, frag_size);
+    memcpy(fbuf->buf.data + fragment_offset, data_start, frag_size);
+    fbuf->setFragment(fragment_no);
 
-    fbuf->last_packet_utime = pkt->utime;
+    pool.touchFragBuf(fbuf, pkt->utime);
     if (--fbuf->fragments_remaining > 0)
         return NULL;
 
     // we've received all the fragments, return a new Message
+    msgsRecv.add(1);
+    trackSeqno(fbuf->from, fbuf->msg_seqno, fbuf->last_packet_utime);
     Message *msg = pool.allocMessageEmpty();
     msg->utime = fbuf->last_packet_utime;
-    msg->channel = fbuf->buf.data;
-    msg->channellen = fbuf->channellen;
-    msg->data = fbuf->buf.data + fbuf->channellen + 1;
-    msg->datalen = fbuf->buf.size - (fbuf->channellen + 1);
+    msg->setChannel(fbuf->channel, fbuf->channellen);
+    msg->data = fbuf->buf.data;
+    msg->datalen = fbuf->buf.size;
     pool.moveBuffer(msg->buf, fbuf->buf);
 
+    CompletedMessage& c = completed[completedNext++ % NUM_COMPLETED];
+    c.addr = fbuf->from.sin_addr.s_addr;
+    c.port = fbuf->from.sin_port;
+    c.seqno = fbuf->msg_seqno;
+
     // don't need the fragment buffer anymore
     pool.removeFragBuf(fbuf);
 
     return msg;
 }
 
+void UDPM::trackSeqno(const struct sockaddr_in& from, u32 seqno, i64 utime)
+{
+    if (resetSenders.load(memory_order_relaxed) && resetSenders.exchange(false))
+        senders.clear();
+    bool countGaps = seesAll.load(memory_order_relaxed);
+
+    u64 key = ((u64)from.sin_addr.s_addr << 16) | from.sin_port;
+    auto it = senders.find(key);
+    if (it == senders.end()) {
+        if (senders.size() >= MAX_SENDERS) {
+            // forget quiet senders, or the quietest one if none has timed out
+            auto oldest = senders.begin();
+            for (auto s = senders.begin(); s != senders.end();) {
+                if (utime - s->second.last_utime > SENDER_TIMEOUT_US) {
+                    s = senders.erase(s);
+                    oldest = senders.begin();
+                    continue;
+                }
+                if (s->second.last_utime < oldest->second.last_utime) oldest = s;
+                ++s;
+            }
+            if (senders.size() >= MAX_SENDERS) senders.erase(oldest);
+        }
+        senders[key] = SenderSeqno{seqno, seqno, 0, utime};
+        return;
+    }
+
+    SenderSeqno& s = it->second;
+    i32 diff = (i32)(seqno - s.highest);
+    if (diff < -SEQNO_RESYNC || utime - s.last_utime > SENDER_TIMEOUT_US) {
+        // the sender restarted, or we don't know what it sent in the meantime
+        s = SenderSeqno{seqno, seqno, 0, utime};
+        return;
+    }
+    s.last_utime = utime;
+
+    if (diff > 0) {
+        // newer than anything before: everything in between is missing (so far)
+        if (diff > 1 && countGaps) {
+            seqGaps.add(diff - 1);
+            reportLoss(from, ZCM_LOSS_GAP, s.highest + 1, diff - 1, utime);
+        }
+        s.seen = (size_t)diff <= SEQNO_WINDOW ? (s.seen << 1 | 1) << (diff - 1) : 0;
+        s.highest = seqno;
+        return;
+    }
+
+    size_t age = (size_t)(-(i64)diff - 1);
+    if (diff == 0 || (age < SEQNO_WINDOW && (s.seen & ((u64)1 << age)))) {
+        seqDuplicate.add(1);
+        reportLoss(from, ZCM_LOSS_DUPLICATE, seqno, 1, utime);
+        return;
+    }
+
+    // Note: beyond the window a duplicate can't be told from a late message
+    if (age < SEQNO_WINDOW) s.seen |= (u64)1 << age;
+    seqReordered.add(1);
+    if (countGaps && (i32)(seqno - s.first) > 0) seqLate.add(1);
+    reportLoss(from, ZCM_LOSS_REORDER, seqno, 1, utime);
+}
+
+void UDPM::reportLoss(const struct sockaddr_in& from, zcm_loss_type type,
+                      u32 seqno, u32 count, i64 utime)
+{
+    ZCM_DEBUG("%s of %u message(s) at seqno %u from %s:%d",
+              type == ZCM_LOSS_GAP ? "gap" : type == ZCM_LOSS_REORDER ? "reorder" : "duplicate",
+              count, seqno, inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+
+    unique_lock<mutex> lk(lossHandlerLock);
+    if (!lossHandler) return;
+
+    char sender[32];
+    snprintf(sender, sizeof(sender), "%s:%d", inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+
+    zcm_loss_event_t ev;
+    ev.type = type;
+    ev.sender = sender;
+    ev.seqno = seqno;
+    ev.count = count;
+    ev.utime = utime;
+    lossHandler(&ev, lossHandlerUsr);
+}
+
+int UDPM::setLossHandler(zcm_loss_handler_t cb, void *usr)
+{
+    unique_lock<mutex> lk(lossHandlerLock);
+    lossHandler = cb;
+    lossHandlerUsr = usr;
+    return ZCM_EOK;
+}
+
+void UDPM::expireFragBufs()
+{
+    if (pool.getFragBufs().empty()) return;
+
+    size_t n = pool.expireFragBufs(TimeUtil::utime() - FRAG_BUF_TIMEOUT_US);
+    if (n > 0) {
+        ZCM_DEBUG("gave up on %zu incomplete messages", n);
+        msgsIncomplete.add(n);
+    }
+}
+
+bool UDPM::recentlyCompleted(const struct sockaddr_in& from, u32 seqno)
+{
+    size_t n = std::min(completedNext, NUM_COMPLETED);
+    for (size_t i = 0; i < n; ++i) {
+        const CompletedMessage& c = completed[i];
+        if (c.seqno == seqno && c.port == from.sin_port && c.addr == from.sin_addr.s_addr)
+            return true;
+    }
+    return false;
+}
+
+// Returns true if there may be incomplete messages that still need a NACK
+bool UDPM::sendNacks()
+{
+    if (!nacksPending) return false;
+
+    i64 now = TimeUtil::utime();
+    if (now - lastNackScan < NACK_CHECK_MS * 1000) return true;
+    lastNackScan = now;
+
+    char buf[sizeof(MsgHeaderNack) + 2 * MAX_NACK_LIST];
+    MsgHeaderNack *hdr = (MsgHeaderNack*) buf;
+    char *list = hdr->getListPtr();
+
+    nacksPending = false;
+    for (FragBuf *fbuf : pool.getFragBufs()) {
+        if (fbuf->nacks_sent >= MAX_NACKS) continue;
+        nacksPending = true;
+
+        if (now - fbuf->last_packet_utime < NACK_DELAY_US ||
+            now - fbuf->last_nack_utime < NACK_DELAY_US)
+            continue;
+
+        u16 n = 0;
+        for (u32 no = 0; no < fbuf->fragments_in_msg && n < MAX_NACK_LIST; ++no) {
+            if (fbuf->hasFragment(no)) continue;
+            u16 v = htons(no);
+            memcpy(list + 2 * n++, &v, 2);
+        }
+
+        hdr->setMagic(ZCM_MAGIC_NACK);
+        hdr->setMsgSeqno(fbuf->msg_seqno);
+        hdr->setSenderAddr(fbuf->from.sin_addr.s_addr);
+        hdr->setSenderPort(fbuf->from.sin_port);
+        hdr->setNumFragments(n);
+
+        ZCM_DEBUG("NACKing %d fragments of message %u", n, fbuf->msg_seqno);
+        sendfd.sendBuffers(destAddr, buf, sizeof(MsgHeaderNack) + 2 * n);
+
+        fbuf->last_nack_utime = now;
+        fbuf->nacks_sent++;
+        nacksSent.add(1);
+    }
+
+    return nacksPending;
+}
+
+void UDPM::handleNack(Packet *pkt, u32 sz)
+{
+    MsgHeaderNack *hdr = pkt->asHeaderNack();
+    if (sz < sizeof(MsgHeaderNack) ||
+        sz < sizeof(MsgHeaderNack) + 2 * (size_t)hdr->getNumFragments()) {
+        packetsBad.add(1);
+        return;
+    }
+
+    // Note: senders on other hosts may well use the same port
+    if (!params.reliable || hdr->getSenderPort() != localPort ||
+        (localAddr != INADDR_ANY && hdr->getSenderAddr() != localAddr))
+        return;
+
+    unique_lock<mutex> lk(windowLock);
+
+    u32 seqno = hdr->getMsgSeqno();
+    auto it = std::find_if(window.begin(), window.end(),
+                           [&](const SentMessage& sm) { return sm.seqno == seqno; });
+    if (it == window.end()) {
+        ZCM_DEBUG("NACK for message %u which is no longer in the window", seqno);
+        return;
+    }
+
+    // Several receivers may NACK the same fragments, only answer one of them
+    i64 now = TimeUtil::utime();
+    for (size_t i = 0; i < hdr->getNumFragments(); ++i) {
+        u16 no = hdr->getFragmentNo(i);
+        if (no >= it->nfragments || now - it->retransmitted[no] < NACK_DELAY_US / 2)
+            continue;
+        it->retransmitted[no] = now;
+        retransmit(*it, no);
+        retransmits.add(1);
+    }
+}
+
+void UDPM::retransmit(SentMessage& sm, u16 frag_no)
+{
+    size_t channel_size = sm.channel.size();
+    size_t firstfrag_datasize = sm.fragment_size - (channel_size + 1);
+    size_t fragment_offset = (frag_no == 0) ? 0 :
+                             firstfrag_datasize + (frag_no - 1) * sm.fragment_size;
+    size_t fraglen = (frag_no == 0) ? firstfrag_datasize :
+                     std::min(sm.fragment_size, sm.data.size() - fragment_offset);
+
+    MsgHeaderLong hdr;
+    hdr.magic = htonl(ZCM_MAGIC_LONG);
+    hdr.msg_seqno = htonl(sm.seqno);
+    hdr.msg_size = htonl(sm.data.size());
+    hdr.fragment_offset = htonl(fragment_offset);
+    hdr.fragment_no = htons(frag_no);
+    hdr.fragments_in_msg = htons(sm.nfragments);
+
+    const UDPMAddress& dest = destFor(sm.channel.c_str());
+    if (frag_no == 0)
+        sendfd.sendBuffers(dest, (char*)&hdr, sizeof(hdr),
+                           sm.channel.c_str(), channel_size + 1,
+                           sm.data.data(), fraglen);
+    else
+        sendfd.sendBuffers(dest, (char*)&hdr, sizeof(hdr),
+                           sm.data.data() + fragment_offset, fraglen);
+}
+
+void UDPM::rememberSent(const zcm_msg_t& msg, u32 seqno, size_t fragment_size, u16 nfragments)
+{
+    if (msg.len > RETRANSMIT_WINDOW_BYTES) return;
+
+    unique_lock<mutex> lk(windowLock);
+
+    SentMessage sm;
+    while (!window.empty() && (window.size() >= RETRANSMIT_WINDOW_MSGS ||
+                               windowBytes + msg.len > RETRANSMIT_WINDOW_BYTES)) {
+        windowBytes -= window.front().data.size();
+        // Recycle the buffers of the oldest message
+        sm = std::move(window.front());
+        window.pop_front();
+    }
+
+    sm.seqno = seqno;
+    sm.channel = msg.channel;
+    sm.data.assign((char*)msg.buf, (char*)msg.buf + msg.len);
+    sm.fragment_size = fragment_size;
+    sm.nfragments = nfragments;
+    sm.retransmitted.assign(nfragments, 0);
+
+    windowBytes += msg.len;
+    window.push_back(std::move(sm));
+}
+
+int UDPM::getStats(zcm_trans_stats_t *stats)
+{
+    UDPMSocket::RecvCounters rc = recvfd.getRecvCounters();
+
+    stats->msgs_sent         = msgsSent.get();
+    stats->msgs_recv         = msgsRecv.get();
+    stats->packets_sent      = packetsSent.get();
+    stats->packets_recv      = rc.packets;
+    stats->bytes_sent        = bytesSent.get();
+    stats->bytes_recv        = rc.bytes;
+    stats->fragments_sent    = fragmentsSent.get();
+    stats->fragments_recv    = fragmentsRecv.get();
+    stats->recv_syscalls     = rc.syscalls;
+    stats->packets_bad       = packetsBad.get();
+    stats->fragbuf_evictions = pool.getFragBufEvictions();
+    stats->msgs_incomplete   = msgsIncomplete.get() + stats->fragbuf_evictions;
+    stats->kernel_drops      = rc.kernelDrops;
+    stats->nacks_sent        = nacksSent.get();
+    stats->retransmits       = retransmits.get();
+    stats->msgs_reordered    = seqReordered.get();
+    stats->msgs_duplicate    = seqDuplicate.get();
+    // the two are read separately, a late message may have been counted in between
+    u64 late = seqLate.get();
+    u64 gaps = seqGaps.get();
+    stats->msgs_lost         = gaps > late ? gaps - late : 0;
+
+    return ZCM_EOK;
+}
+
+// Every couple of seconds, print a debug line if anything was lost since the last
+// report. Applications get the same numbers from zcm_get_trans_stats() and the loss
+// handler, the library itself stays quiet about it
 void UDPM::checkForMessageLoss()
 {
-    // ISSUE-101 TODO: add this back
-    // TODO warn about message loss somewhere else.
-    // u32 ring_capacity = ringbuf->get_capacity();
-    // u32 ring_used = ringbuf->get_used();
-
-    // double buf_avail = ((double)(ring_capacity - ring_used)) / ring_capacity;
-    // if (buf_avail < udp_low_watermark)
-    //     udp_low_watermark = buf_avail;
-
-    // i32 tm = utimeInSeconds();
-    // int elapsedsecs = tm - udp_last_report_secs;
-    // if (elapsedsecs > 2) {
-    //    if (udp_discarded_bad > 0 || udp_low_watermark < 0.5) {
-    //        fprintf(stderr,
-    //                "%d ZCM loss %4.1f%% : %5d err, "
-    //                "buf avail %4.1f%%\n",
-    //                (int) tm,
-    //                udp_discarded_bad * 100.0 / (udp_rx + udp_discarded_bad),
-    //                udp_discarded_bad,
-    //                100.0 * udp_low_watermark);
-
-    //        udp_rx = 0;
-    //        udp_discarded_bad = 0;
-    //        udp_last_report_secs = tm;
-    //        udp_low_watermark = HUGE;
-    //    }
-    // }
+#ifdef ZCM_DEBUG_ENV_ENABLE
+    if (!ZCM_DEBUG_ENABLED)
+        return;
+#endif
+
+    i32 tm = utimeInSeconds();
+    if (tm - udp_last_report_secs <= 2)
+        return;
+    udp_last_report_secs = tm;
+
+    zcm_trans_stats_t cur;
+    getStats(&cur);
+    zcm_trans_stats_t& last = udp_last_report;
+
+    u64 packets    = cur.packets_recv    - last.packets_recv;
+    u64 bad        = cur.packets_bad     - last.packets_bad;
+    u64 dropped    = cur.kernel_drops    - last.kernel_drops;
+    u64 incomplete = cur.msgs_incomplete - last.msgs_incomplete;
+    u64 lost       = cur.msgs_lost > last.msgs_lost ? cur.msgs_lost - last.msgs_lost : 0;
+    last = cur;
+
+    if (bad == 0 && dropped == 0 && incomplete == 0 && lost == 0)
+        return;
+
+    double lossPct = (packets + dropped) ? (bad + dropped) * 100.0 / (packets + dropped) : 0;
+
+    ZCM_DEBUG("%d ZCM loss %4.1f%% : %llu err, %llu dropped by the kernel, "
+              "%llu incomplete messages, %llu messages missing",
+              (int) tm,
+              lossPct,
+              (unsigned long long) bad,
+              (unsigned long long) dropped,
+              (unsigned long long) incomplete,
+              (unsigned long long) lost);
 }
 
 // read continuously until a complete message arrives
 Message *UDPM::readMessage(int timeout)
 {
-    Packet *pkt = pool.allocPacket(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
     UDPM::checkForMessageLoss();
 
     Message *msg = NULL;
     while (!msg) {
-        // // wait for either incoming UDP data, or for an abort message
-        if (!recvfd.waitUntilData(timeout))
-            break;
-
-        int sz = recvfd.recvPacket(pkt);
-        if (sz < 0) {
-            ZCM_DEBUG("udp_read_packet -- recvmsg");
-            udp_discarded_bad++;
+        if (recvNext == recvFilled) {
+            expireFragBufs();
+
+            // incomplete messages may need a NACK even if nothing else arrives
+            int wait = timeout;
+            if (sendNacks() && wait > NACK_CHECK_MS)
+                wait = NACK_CHECK_MS;
+
+            // wait for incoming UDP data, then take everything that is already queued
+            if (!recvfd.waitUntilData(wait)) {
+                if (wait < timeout) {
+                    timeout -= wait;
+                    continue;
+                }
+                break;
+            }
+
+            int cnt = recvfd.recvPackets(recvRing, RECV_RING_SIZE);
+            if (cnt < 0) {
+                ZCM_DEBUG("udp_read_packet -- recvmmsg");
+                packetsBad.add(1);
+                continue;
+            }
+            recvNext = 0;
+            recvFilled = cnt;
             continue;
         }
 
+        Packet *pkt = recvRing[recvNext++];
+        int sz = pkt->sz;
+
         ZCM_DEBUG("Got packet of size %d", sz);
 
         if (sz < (int)sizeof(MsgHeaderShort)) {
             // packet too short to be ZCM
-            udp_discarded_bad++;
+            packetsBad.add(1);
             continue;
         }
 
         u32 magic = pkt->asHeaderShort()->getMagic();
-        if (magic == ZCM_MAGIC_SHORT)
+        if (magic == ZCM_MAGIC_SHORT) {
             msg = recvShort(pkt, sz);
-        else if (magic == ZCM_MAGIC_LONG)
+            if (!pkt->buf.data)
+                pkt->buf = pool.allocBuffer(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
+        } else if (magic == ZCM_MAGIC_LONG) {
             msg = recvFragment(pkt, sz);
-        else {
+        } else if (magic == ZCM_MAGIC_NACK) {
+            handleNack(pkt, sz);
+        } else {
             ZCM_DEBUG("ZCM: bad magic");
-            udp_discarded_bad++;
+            packetsBad.add(1);
             continue;
         }
     }
 
-    pool.freePacket(pkt);
     return msg;
 }
 
@@ -289,7 +795,7 @@ int UDPM::sendmsg(zcm_msg_t msg)
         hdr.setMagic(ZCM_MAGIC_SHORT);
         hdr.setMsgSeqno(msg_seqno);
 
-        ssize_t status = sendfd.sendBuffers(destAddr,
+        ssize_t status = sendfd.sendBuffers(destFor(msg.channel),
                               (char*)&hdr, sizeof(hdr),
                               (char*)msg.channel, channel_size+1,
                               (char*)msg.buf, msg.len);
@@ -299,81 +805,338 @@ int UDPM::sendmsg(zcm_msg_t msg)
                   msg.len, msg.channel, packet_size);
         msg_seqno++;
 
+        if (status == packet_size) {
+            msgsSent.add(1);
+            packetsSent.add(1);
+            bytesSent.add(packet_size);
+        }
+
         return (status == packet_size) ? 0 : status;
     }
 
+    // message is large.  fragment into multiple packets
+    return sendFragmented(msg, channel_size, gso_size != 0);
+}
 
-    else {
-        // message is large.  fragment into multiple packets
-        int fragment_size = ZCM_FRAGMENT_MAX_PAYLOAD;
-        int nfragments = payload_size / fragment_size +
-            !!(payload_size % fragment_size);
+// Wait until 'bytes' more may be sent without exceeding the pacing rate
+void UDPM::paceBefore(size_t bytes)
+{
+    if (params.pace_mbps == 0) return;
 
-        if (nfragments > 65535) {
-            fprintf(stderr, "ZCM error: too much data for a single message\n");
-            return -1;
-        }
+    i64 now = TimeUtil::utime();
+    if (pace_next_utime > now) {
+        std::this_thread::sleep_for(std::chrono::microseconds(pace_next_utime - now));
+        now = pace_next_utime;
+    }
+    // megabits per second is the same as bits per microsecond
+    pace_next_utime = now + (i64)(bytes * 8 / params.pace_mbps);
+}
+
+// All fragment headers and iovecs are built up front and then submitted with as few
+// system calls as possible: one sendmmsg() for all of them unless pacing is enabled,
+// in which case every packet waits for its turn. With GSO, each packet carries as
+// many fragments as the kernel accepts in a single UDP send
+int UDPM::sendFragmented(const zcm_msg_t& msg, size_t channel_size, bool useGso)
+{
+    size_t payload_size = channel_size + 1 + msg.len;
+
+    size_t fragment_size = ZCM_FRAGMENT_MAX_PAYLOAD;
+    if (useGso) {
+        // Note: the first fragment has to hold the channel and some of the data
+        if (gso_size <= sizeof(MsgHeaderLong) + channel_size + 1 ||
+            gso_size - sizeof(MsgHeaderLong) >= payload_size)
+            useGso = false;
+        else
+            fragment_size = gso_size - sizeof(MsgHeaderLong);
+    }
 
-        // acquire transmit lock so that all fragments are transmitted
-        // together, and so that no other message uses the same sequence number
-        // (at least until the sequence # rolls over)
+    size_t nfragments = payload_size / fragment_size + !!(payload_size % fragment_size);
+    if (nfragments > 65535) {
+        if (useGso) return sendFragmented(msg, channel_size, false);
+        fprintf(stderr, "ZCM error: too much data for a single message\n");
+        return ZCM_EINVALID;
+    }
 
-        ZCM_DEBUG("transmitting %d byte [%s] payload in %d fragments",
-                  payload_size, msg.channel, nfragments);
+    ZCM_DEBUG("transmitting %zu byte [%s] payload in %zu fragments%s",
+              payload_size, msg.channel, nfragments, useGso ? " (gso)" : "");
 
-        u32 fragment_offset = 0;
+    fragHdrs.resize(nfragments);
+    fragIovs.resize(2 * nfragments + 1);
 
-        MsgHeaderLong hdr;
+    // first fragment is special.  insert channel before data
+    size_t firstfrag_datasize = fragment_size - (channel_size + 1);
+    assert(firstfrag_datasize <= msg.len);
+
+    size_t fragment_offset = 0;
+    size_t niov = 0;
+    for (size_t frag_no = 0; frag_no < nfragments; ++frag_no) {
+        size_t fraglen = (frag_no == 0) ? firstfrag_datasize :
+                         std::min(fragment_size, msg.len - fragment_offset);
+
+        MsgHeaderLong& hdr = fragHdrs[frag_no];
         hdr.magic = htonl(ZCM_MAGIC_LONG);
         hdr.msg_seqno = htonl(msg_seqno);
         hdr.msg_size = htonl(msg.len);
-        hdr.fragment_offset = 0;
-        hdr.fragment_no = 0;
+        hdr.fragment_offset = htonl(fragment_offset);
+        hdr.fragment_no = htons(frag_no);
         hdr.fragments_in_msg = htons(nfragments);
 
-        // first fragment is special.  insert channel before data
-        size_t firstfrag_datasize = fragment_size - (channel_size + 1);
-        assert(firstfrag_datasize <= msg.len);
+        fragIovs[niov].iov_base = (char*)&hdr;
+        fragIovs[niov++].iov_len = sizeof(hdr);
+        if (frag_no == 0) {
+            fragIovs[niov].iov_base = (char*)msg.channel;
+            fragIovs[niov++].iov_len = channel_size + 1;
+        }
+        fragIovs[niov].iov_base = (char*)(msg.buf + fragment_offset);
+        fragIovs[niov++].iov_len = fraglen;
+
+        fragment_offset += fraglen;
+    }
+    assert(fragment_offset == msg.len);
+
+    // Group the fragments into packets. Every fragment but the last one is exactly
+    // sizeof(MsgHeaderLong) + fragment_size bytes long, as GSO requires
+    size_t fragsPerPkt = 1;
+    if (useGso) {
+        static constexpr size_t GSO_MAX_SEGMENTS = 64;
+        static constexpr size_t GSO_MAX_BYTES = 65507;
+        fragsPerPkt = std::max<size_t>(1, std::min(GSO_MAX_SEGMENTS, GSO_MAX_BYTES / gso_size));
+    }
+
+    fragPkts.clear();
+    niov = 0;
+    for (size_t frag_no = 0; frag_no < nfragments; frag_no += fragsPerPkt) {
+        OutPacket pkt;
+        pkt.iov = &fragIovs[niov];
+        pkt.niov = 0;
+        pkt.len = 0;
+        size_t end = std::min(nfragments, frag_no + fragsPerPkt);
+        for (size_t i = frag_no; i < end; ++i) {
+            size_t n = (i == 0) ? 3 : 2;
+            for (size_t j = 0; j < n; ++j) pkt.len += fragIovs[niov + j].iov_len;
+            pkt.niov += n;
+            niov += n;
+        }
+        pkt.segSize = (useGso && end - frag_no > 1) ? gso_size : 0;
+        fragPkts.push_back(pkt);
+    }
+
+    // The sequence number is used up even if the send fails part way, so receivers
+    // never mix up fragments of this attempt with a retry
+    u32 seqno = msg_seqno++;
+
+    const UDPMAddress& dest = destFor(msg.channel);
+    size_t sent = 0;
+    while (sent < fragPkts.size()) {
+        size_t cnt = fragPkts.size() - sent;
+        if (params.pace_mbps != 0) {
+            cnt = 1;
+            paceBefore(fragPkts[sent].len);
+        }
+        size_t n = sendfd.sendPackets(dest, &fragPkts[sent], cnt);
+        for (size_t i = sent; i < sent + n; ++i) {
+            // a GSO packet leaves as one datagram per fragment
+            const OutPacket& pkt = fragPkts[i];
+            size_t nfrags = pkt.segSize ? (pkt.len + pkt.segSize - 1) / pkt.segSize : 1;
+            packetsSent.add(nfrags);
+            fragmentsSent.add(nfrags);
+            bytesSent.add(pkt.len);
+        }
+        sent += n;
+        if (n < cnt) break;
+    }
 
-        int packet_size = sizeof(hdr) + (channel_size + 1) + firstfrag_datasize;
-        fragment_offset += firstfrag_datasize;
+    if (sent < fragPkts.size()) {
+        if (useGso && sent == 0) {
+            // Not every device can segment for us, don't try again
+            ZCM_DEBUG("UDP GSO send failed (%s), disabling GSO", strerror(errno));
+            gso_size = 0;
+            return sendFragmented(msg, channel_size, false);
+        }
+        ZCM_DEBUG("failed to transmit fragments of [%s]: %s", msg.channel, strerror(errno));
+        return ZCM_EUNKNOWN;
+    }
 
-        ssize_t status = sendfd.sendBuffers(destAddr,
-                                            (char*)&hdr, sizeof(hdr),
-                                            (char*)msg.channel, channel_size+1,
-                                            (char*)msg.buf, firstfrag_datasize);
+    msgsSent.add(1);
+    if (params.reliable)
+        rememberSent(msg, seqno, fragment_size, nfragments);
 
-        // transmit the rest of the fragments
-        for (u16 frag_no = 1; packet_size == status && frag_no < nfragments; frag_no++) {
-            hdr.fragment_offset = htonl(fragment_offset);
-            hdr.fragment_no = htons(frag_no);
+    return ZCM_EOK;
+}
 
-            int fraglen = std::min(fragment_size, (int)msg.len - (int)fragment_offset);
-            status = sendfd.sendBuffers(destAddr,
-                                        (char*)&hdr, sizeof(hdr),
-                                        (char*)(msg.buf + fragment_offset), fraglen);
+int UDPM::sendmsgBatch(const zcm_msg_t *msgs, size_t *n)
+{
+    MsgHeaderShort hdrs[MAX_SEND_BATCH];
+    struct iovec iovs[MAX_SEND_BATCH][3];
+    OutPacket pkts[MAX_SEND_BATCH];
+
+    size_t count = *n;
+    size_t i = 0;
+    int rc = ZCM_EOK;
+
+    while (i < count) {
+        // Gather the run of short messages starting at i that go to the same group
+        // into one batch of packets
+        size_t npkts = 0;
+        const UDPMAddress *dest = nullptr;
+        while (i + npkts < count && npkts < MAX_SEND_BATCH) {
+            const zcm_msg_t& msg = msgs[i + npkts];
+            size_t channel_size = strlen(msg.channel);
+            if (channel_size > ZCM_CHANNEL_MAXLEN ||
+                channel_size + 1 + msg.len > ZCM_SHORT_MESSAGE_MAX_SIZE)
+                break;
+            const UDPMAddress *msgDest = &destFor(msg.channel);
+            if (dest && msgDest != dest)
+                break;
+            dest = msgDest;
+
+            MsgHeaderShort& hdr = hdrs[npkts];
+            hdr.setMagic(ZCM_MAGIC_SHORT);
+            hdr.setMsgSeqno(msg_seqno++);
+
+            OutPacket& pkt = pkts[npkts];
+            pkt.iov = iovs[npkts];
+            pkt.iov[0].iov_base = (char*)&hdr;
+            pkt.iov[0].iov_len = sizeof(hdr);
+            pkt.iov[1].iov_base = (char*)msg.channel;
+            pkt.iov[1].iov_len = channel_size + 1;
+            pkt.iov[2].iov_base = (char*)msg.buf;
+            pkt.iov[2].iov_len = msg.len;
+            pkt.niov = 3;
+            pkt.len = sizeof(hdr) + channel_size + 1 + msg.len;
+            pkt.segSize = 0;
+
+            ZCM_DEBUG("transmitting %zu byte [%s] payload (%zu byte pkt)",
+                      msg.len, msg.channel, pkt.len);
+            ++npkts;
+        }
 
-            fragment_offset += fraglen;
-            packet_size = sizeof(hdr) + fraglen;
+        // Anything else (large or invalid messages) goes through the regular path
+        if (npkts == 0) {
+            rc = sendmsg(msgs[i++]);
+            if (rc != ZCM_EOK) break;
+            continue;
         }
 
-        // sanity check
-        if (0 == status) {
-            assert(fragment_offset == msg.len);
+        size_t sent = sendfd.sendPackets(*dest, pkts, npkts);
+        for (size_t j = 0; j < sent; ++j)
+            bytesSent.add(pkts[j].len);
+        msgsSent.add(sent);
+        packetsSent.add(sent);
+        i += sent;
+        if (sent < npkts) {
+            // The packet after the last one sent failed, it is consumed too
+            ++i;
+            rc = ZCM_EUNKNOWN;
+            break;
         }
+    }
 
-        msg_seqno++;
+    *n = i;
+    return rc;
+}
+
+// FNV-1a, which every sender and receiver has to agree on
+size_t UDPM::channelGroup(const char *channel) const
+{
+    u32 hash = 2166136261u;
+    for (const char *c = channel; *c; ++c) {
+        hash ^= (u8)*c;
+        hash *= 16777619u;
     }
+    return hash % params.num_groups;
+}
 
-    return 0;
+const UDPMAddress& UDPM::destFor(const char *channel) const
+{
+    if (groupAddrs.empty()) return destAddr;
+    return groupAddrs[channelGroup(channel)];
 }
 
-int UDPM::recvmsg(zcm_msg_t *msg, int timeout)
+int UDPM::recvmsgEnable(const char *channel, bool enable)
+{
+    if (groupAddrs.empty() && !params.filter) return ZCM_EOK;
+
+    unique_lock<mutex> lk(subLock);
+    if (channel == NULL) {
+        subAll = enable;
+    } else if (enable) {
+        if (subChannels[channel]++ == 0 && !groupAddrs.empty())
+            groupRefs[channelGroup(channel)]++;
+    } else {
+        auto it = subChannels.find(channel);
+        if (it == subChannels.end()) return ZCM_EOK;
+        if (--it->second > 0) return ZCM_EOK;
+        subChannels.erase(it);
+        if (!groupAddrs.empty())
+            groupRefs[channelGroup(channel)]--;
+    }
+    updateMemberships();
+    updateFilter();
+    updateSeesAll();
+    return ZCM_EOK;
+}
+
+// Requires 'subLock'
+void UDPM::updateSeesAll()
 {
-    if (m)
+    bool all = subAll || (groupAddrs.empty() && !filterActive);
+    if (all == seesAll.load()) return;
+    seesAll.store(all);
+    resetSenders.store(true);
+}
+
+// Requires 'subLock'. Failures are not fatal: the kernel limits the number of groups
+// per socket (on Linux net.ipv4.igmp_max_memberships, 20 by default)
+void UDPM::updateMemberships()
+{
+    for (size_t i = 0; i < groupAddrs.size(); ++i) {
+        bool want = subAll || groupRefs[i] > 0;
+        if (want == groupJoined[i]) continue;
+        struct in_addr a = ((struct sockaddr_in*)groupAddrs[i].getAddrPtr())->sin_addr;
+        if (want ? recvfd.addMembership(a) : recvfd.dropMembership(a))
+            groupJoined[i] = want;
+        else
+            fprintf(stderr, "ZCM Warning: failed to %s multicast group %s\n",
+                    want ? "join" : "leave", groupAddrs[i].getIP().c_str());
+    }
+}
+
+// Requires 'subLock'. The filter is rebuilt from scratch on every change, which is
+// cheap next to how rarely subscriptions change
+void UDPM::updateFilter()
+{
+    if (!params.filter) return;
+
+    if (subAll) {
+        recvfd.clearChannelFilter();
+        filterActive = false;
+        return;
+    }
+    vector<string> channels;
+    for (auto& c : subChannels) channels.push_back(c.first);
+    filterActive = recvfd.setChannelFilter(channels);
+    if (!filterActive)
+        ZCM_DEBUG("no socket filter, receiving every channel");
+}
+
+void UDPM::freeReleasedMessages()
+{
+    {
+        unique_lock<mutex> lk(releasedLock);
+        if (released.empty()) return;
+        std::swap(released, releasedSwap);
+    }
+    for (Message *m : releasedSwap)
         pool.freeMessage(m);
+    releasedSwap.clear();
+}
 
-    m = readMessage(timeout);
+int UDPM::recvmsg(zcm_msg_t *msg, int timeout)
+{
+    freeReleasedMessages();
+
+    Message *m = readMessage(timeout);
     if (m == nullptr)
         return ZCM_EAGAIN;
 
@@ -385,15 +1148,63 @@ int UDPM::recvmsg(zcm_msg_t *msg, int timeout)
     return ZCM_EOK;
 }
 
+int UDPM::recvmsgBatch(zcm_msg_t *msgs, size_t *n, int timeout)
+{
+    size_t max = *n;
+    *n = 0;
+    if (max == 0) return ZCM_EINVALID;
+
+    freeReleasedMessages();
+
+    // Wait for the first message, then only take what has already arrived
+    Message *m = readMessage(timeout);
+    while (m) {
+        zcm_msg_t *msg = &msgs[(*n)++];
+        msg->utime = m->utime;
+        msg->channel = m->channel;
+        msg->len = m->datalen;
+        msg->buf = (uint8_t*) m->data;
+
+        if (*n == max) break;
+        m = readMessage(0);
+    }
+
+    return (*n > 0) ? ZCM_EOK : ZCM_EAGAIN;
+}
+
+void UDPM::recvmsgRelease(zcm_msg_t *msg)
+{
+    Message *m = Message::fromChannel(msg->channel);
+    unique_lock<mutex> lk(releasedLock);
+    released.push_back(m);
+}
+
 UDPM::~UDPM()
 {
     ZCM_DEBUG("closing zcm context");
+    freeReleasedMessages();
+
+    UDPMSocket::RecvCounters rc = recvfd.getRecvCounters();
+    ZCM_DEBUG("received %llu packets in %llu syscalls",
+              (unsigned long long)rc.packets, (unsigned long long)rc.syscalls);
+
+    for (Packet *pkt : recvRing)
+        if (pkt) pool.freePacket(pkt);
 }
 
-UDPM::UDPM(const string& ip, u16 port, size_t recv_buf_size, u8 ttl)
+UDPM::UDPM(const string& ip, u16 port, size_t recv_buf_size, u8 ttl,
+           u16 gso_size, u32 pace_mbps, bool reliable, u16 num_groups, bool filter)
     : params(ip, port, recv_buf_size, ttl),
       destAddr(ip, port)
 {
+    params.gso_size = gso_size;
+    params.pace_mbps = pace_mbps;
+    params.reliable = reliable;
+    params.num_groups = num_groups;
+    params.filter = filter;
+
+    for (Packet *&pkt : recvRing)
+        pkt = pool.allocPacket(ZCM_MAX_UNFRAGMENTED_PACKET_SIZE);
 }
 
 bool UDPM::init()
@@ -406,9 +1217,58 @@ bool UDPM::init()
     if (!sendfd.isOpen()) return false;
     kernel_sbuf_sz = sendfd.getSendBufSize();
 
+    if (params.reliable) {
+        // NACKs are addressed to our send port, so it has to be known up front
+        if (!sendfd.bindPort(0)) return false;
+        localPort = sendfd.getLocalPort();
+        localAddr = UDPMSocket::getSourceAddr(params.ip, params.port);
+        if (localAddr == INADDR_ANY)
+            ZCM_DEBUG("Unable to tell our source address, matching NACKs by port only");
+    }
+
+    if (params.gso_size != 0) {
+        // Receivers don't expect datagrams longer than those of regular fragments
+        static constexpr size_t GSO_MAX_SIZE = sizeof(MsgHeaderLong) + ZCM_FRAGMENT_MAX_PAYLOAD;
+        if (params.gso_size > GSO_MAX_SIZE) {
+            fprintf(stderr, "ZCM Warning: gso=%u is too large, using gso=%zu\n",
+                    params.gso_size, GSO_MAX_SIZE);
+            params.gso_size = GSO_MAX_SIZE;
+        }
+        if (sendfd.supportsGso())
+            gso_size = params.gso_size;
+        else
+            fprintf(stderr, "ZCM Warning: UDP GSO is not supported here, ignoring gso=%u\n",
+                    params.gso_size);
+    }
+
+    if (params.num_groups != 0) {
+        // The groups follow the base address and have to stay multicast addresses
+        u32 base = ntohl(params.addr.s_addr);
+        if ((base >> 28) != 0xE || ((base + params.num_groups) >> 28) != 0xE) {
+            fprintf(stderr, "ZCM Error: %u groups after %s leave the multicast range\n",
+                    params.num_groups, params.ip.c_str());
+            return false;
+        }
+        for (u32 i = 1; i <= params.num_groups; ++i) {
+            struct in_addr a;
+            a.s_addr = htonl(base + i);
+            groupAddrs.emplace_back(inet_ntoa(a), params.port);
+        }
+        groupRefs.assign(params.num_groups, 0);
+        groupJoined.assign(params.num_groups, false);
+    }
+
     recvfd = UDPMSocket::createRecvSocket(params.addr, params.port);
     if (!recvfd.isOpen()) return false;
     kernel_rbuf_sz = recvfd.getRecvBufSize();
+    if (params.num_groups != 0)
+        recvfd.disableMulticastAll();
+    {
+        unique_lock<mutex> lk(subLock);
+        // Nothing is subscribed yet
+        updateFilter();
+        updateSeesAll();
+    }
 
     if (!this->selftest()) {
         // self test failed.  destroy the read thread
@@ -436,8 +1296,11 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
 {
     UDPM udpm;
 
-    ZCM_TRANS_CLASSNAME(const string& ip, u16 port, size_t recv_buf_size, u8 ttl)
-        : udpm(ip, port, recv_buf_size, ttl)
+    ZCM_TRANS_CLASSNAME(const string& ip, u16 port, size_t recv_buf_size, u8 ttl,
+                        u16 gso_size, u32 pace_mbps, bool reliable, u16 num_groups,
+                        bool filter)
+        : udpm(ip, port, recv_buf_size, ttl, gso_size, pace_mbps, reliable, num_groups,
+               filter)
     {
         trans_type = ZCM_BLOCKING;
         vtbl = &methods;
@@ -460,14 +1323,29 @@ struct ZCM_TRANS_CLASSNAME : public zcm_trans_t
     { return cast(zt)->udpm.sendmsg(msg); }
 
     static int _recvmsgEnable(zcm_trans_t *zt, const char *channel, bool enable)
-    { return ZCM_EOK; }
+    { return cast(zt)->udpm.recvmsgEnable(channel, enable); }
 
     static int _recvmsg(zcm_trans_t *zt, zcm_msg_t *msg, int timeout)
     { return cast(zt)->udpm.recvmsg(msg, timeout); }
 
+    static int _sendmsgBatch(zcm_trans_t *zt, const zcm_msg_t *msgs, size_t *n)
+    { return cast(zt)->udpm.sendmsgBatch(msgs, n); }
+
+    static int _recvmsgBatch(zcm_trans_t *zt, zcm_msg_t *msgs, size_t *n, int timeout)
+    { return cast(zt)->udpm.recvmsgBatch(msgs, n, timeout); }
+
     static void _destroy(zcm_trans_t *zt)
     { delete cast(zt); }
 
+    static void _recvmsgRelease(zcm_trans_t *zt, zcm_msg_t *msg)
+    { cast(zt)->udpm.recvmsgRelease(msg); }
+
+    static int _getStats(zcm_trans_t *zt, zcm_trans_stats_t *stats)
+    { return cast(zt)->udpm.getStats(stats); }
+
+    static int _setLossHandler(zcm_trans_t *zt, zcm_loss_handler_t cb, void *usr)
+    { return cast(zt)->udpm.setLossHandler(cb, usr); }
+
     static const TransportRegister regUdpm;
 };
 
@@ -478,6 +1356,11 @@ zcm_trans_methods_t ZCM_TRANS_CLASSNAME::methods = {
     &ZCM_TRANS_CLASSNAME::_recvmsg,
     NULL, // update
     &ZCM_TRANS_CLASSNAME::_destroy,
+    &ZCM_TRANS_CLASSNAME::_recvmsgRelease,
+    &ZCM_TRANS_CLASSNAME::_sendmsgBatch,
+    &ZCM_TRANS_CLASSNAME::_recvmsgBatch,
+    &ZCM_TRANS_CLASSNAME::_getStats,
+    &ZCM_TRANS_CLASSNAME::_setLossHandler,
 };
 
 static const char *optFind(zcm_url_opts_t *opts, const string& key)
@@ -506,6 +1389,15 @@ static vector<string> split(const string& str, char delimiter)
     return v;
 }
 
+// Parses a whole decimal number between lo and hi. Returns false if invalid
+static bool parseNum(const char *str, long long lo, long long hi, long long& num)
+{
+    char *end;
+    errno = 0;
+    num = strtoll(str, &end, 10);
+    return errno == 0 && end != str && *end == '\0' && num >= lo && num <= hi;
+}
+
 static zcm_trans_t *createUdpm(zcm_url_t *url)
 {
     auto *ip = zcm_url_address(url);
@@ -523,8 +1415,29 @@ static zcm_trans_t *createUdpm(zcm_url_t *url)
         ZCM_DEBUG("No ttl specified. Using default ttl=0");
         ttl = "0";
     }
+    auto *gso = optFind(opts, "gso");
+    // Note: init() clamps it further, this only keeps it from wrapping around
+    int gsoSize = gso ? std::max(0, std::min(atoi(gso), 65535)) : 0;
+    auto *pace = optFind(opts, "pace");
+    long long paceMbps = 0;
+    if (pace && !parseNum(pace, 0, UINT32_MAX, paceMbps)) {
+        ZCM_DEBUG("ERROR: pace must be between 0 and %u Mbit/s", UINT32_MAX);
+        return nullptr;
+    }
+    auto *reliable = optFind(opts, "reliable");
+    auto *groups = optFind(opts, "groups");
+    long long numGroups = 0;
+    if (groups && !parseNum(groups, 0, UINT16_MAX, numGroups)) {
+        ZCM_DEBUG("ERROR: groups must be between 0 and %d", UINT16_MAX);
+        return nullptr;
+    }
+    auto *filter = optFind(opts, "filter");
     size_t recv_buf_size = 1024;
-    auto *trans = new ZCM_TRANS_CLASSNAME(address, atoi(port.c_str()), recv_buf_size, atoi(ttl));
+    auto *trans = new ZCM_TRANS_CLASSNAME(address, atoi(port.c_str()), recv_buf_size, atoi(ttl),
+                                          gsoSize, (u32) paceMbps,
+                                          reliable && atoi(reliable) != 0,
+                                          (u16) numGroups,
+                                          filter && atoi(filter) != 0);
     if (!trans->init()) {
         delete trans;
         return nullptr;
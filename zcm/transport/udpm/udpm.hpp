@@ -12,6 +12,7 @@
 #include <cassert>
 
 // TODO: get rid of these
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -20,7 +21,9 @@
 #include <algorithm>
 #include <vector>
 #include <stack>
+#include <deque>
 #include <unordered_map>
+#include <unordered_set>
 #include <string>
 using namespace std;
 
@@ -36,8 +39,12 @@ using namespace std;
 # include <sys/socket.h>
 # include <sys/poll.h>
 # include <sys/select.h>
+# include <netinet/udp.h>
 typedef int SOCKET;
 #endif
+#ifdef __linux__
+# include <linux/filter.h>
+#endif
 
 // Misc. Compatability
 #ifdef SO_TIMESTAMP
@@ -84,9 +91,22 @@ typedef int64_t  i64;
 #define zcm_internal_pipe_close close
 #define zcm_internal_pipe_create pipe
 
+// A statistics counter with a single writer that may be read from any thread.
+// Since only one thread ever adds to it, no atomic read-modify-write is needed
+struct StatCounter
+{
+    void add(u64 n) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(u64 n) { v.store(n, std::memory_order_relaxed); }
+    u64  get() const { return v.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<u64> v {0};
+};
+
 /************************* Important Defines *******************/
 #define ZCM_MAGIC_SHORT 0x4c433032   // hex repr of ascii "LC02"
 #define ZCM_MAGIC_LONG  0x4c433033   // hex repr of ascii "LC03"
+#define ZCM_MAGIC_NACK  0x4c433034   // hex repr of ascii "LC04"
 
 #ifdef __APPLE__
 # define ZCM_SHORT_MESSAGE_MAX_SIZE 1435
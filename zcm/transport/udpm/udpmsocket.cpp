@@ -105,6 +105,35 @@ bool UDPMSocket::joinMulticastGroup(struct in_addr multiaddr)
     return true;
 }
 
+bool UDPMSocket::addMembership(struct in_addr multiaddr)
+{
+    return Platform::setMulticastGroup(fd, multiaddr);
+}
+
+bool UDPMSocket::dropMembership(struct in_addr multiaddr)
+{
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = multiaddr;
+    mreq.imr_interface.s_addr = INADDR_ANY;
+    ZCM_DEBUG("ZCM: leaving multicast group");
+    if (setsockopt(fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, (char*)&mreq, sizeof(mreq)) < 0) {
+        perror("setsockopt (IPPROTO_IP, IP_DROP_MEMBERSHIP)");
+        return false;
+    }
+    return true;
+}
+
+bool UDPMSocket::disableMulticastAll()
+{
+    /* Failing here only means we may receive packets we are not interested in */
+#ifdef IP_MULTICAST_ALL
+    int opt = 0;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &opt, sizeof(opt)) < 0)
+        ZCM_DEBUG("setsockopt(IPPROTO_IP, IP_MULTICAST_ALL) failed: %s", strerror(errno));
+#endif
+    return true;
+}
+
 bool UDPMSocket::setTTL(u8 ttl)
 {
     if (ttl == 0)
@@ -175,6 +204,17 @@ bool UDPMSocket::enablePacketTimestamp()
     return true;
 }
 
+bool UDPMSocket::enableDropCounter()
+{
+    /* Failing here only means kernel drops won't show up in the statistics */
+#ifdef SO_RXQ_OVFL
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt)) < 0)
+        ZCM_DEBUG("setsockopt(SOL_SOCKET, SO_RXQ_OVFL) failed: %s", strerror(errno));
+#endif
+    return true;
+}
+
 bool UDPMSocket::enableLoopback()
 {
     // NOTE: For support on SUN Operating Systems, send_lo_opt should be 'u8'
@@ -187,6 +227,118 @@ bool UDPMSocket::enableLoopback()
     return true;
 }
 
+#ifdef __linux__
+// Appends the instructions that compare the channel name (including its terminating
+// '\0') at 'off' in the packet, 4, 2 and 1 bytes at a time, followed by a ret that
+// accepts the packet. Only a full match falls through to that ret, any mismatch jumps
+// past it to whatever comes after the block: the next channel's block, or the ret
+// that rejects the packet
+static void appendChannelMatch(vector<struct sock_filter>& prog, const string& channel, u32 off)
+{
+    string name = channel;
+    name.push_back('\0');
+
+    size_t start = prog.size();
+    size_t i = 0;
+    while (i < name.size()) {
+        size_t width = name.size() - i >= 4 ? 4 : name.size() - i >= 2 ? 2 : 1;
+        u16 size = width == 4 ? BPF_W : width == 2 ? BPF_H : BPF_B;
+        // BPF loads are big endian
+        u32 val = 0;
+        for (size_t j = 0; j < width; ++j)
+            val = (val << 8) | (u8)name[i + j];
+        prog.push_back(BPF_STMT(BPF_LD | size | BPF_ABS, (u32)(off + i)));
+        prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, val, 0, 0));
+        i += width;
+    }
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+
+    // Now that the block is complete, point every mismatch past its end
+    size_t end = prog.size();
+    for (size_t k = start + 1; k < end; k += 2)
+        prog[k].jf = (u8)(end - k - 1);
+}
+#endif
+
+bool UDPMSocket::setChannelFilter(const vector<string>& channels)
+{
+#ifdef __linux__
+    // The filter sees the packet from its UDP header on
+    static constexpr u32 PAYLOAD = sizeof(struct udphdr);
+    static constexpr u32 CHANNEL = PAYLOAD + 2 * sizeof(u32); // after magic and seqno
+
+    vector<struct sock_filter> prog;
+    prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, PAYLOAD));
+    prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ZCM_MAGIC_SHORT, 1, 0));
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+    for (auto& ch : channels) {
+        appendChannelMatch(prog, ch, CHANNEL);
+        if (prog.size() >= BPF_MAXINSNS) {
+            ZCM_DEBUG("too many channels for a socket filter");
+            clearChannelFilter();
+            return false;
+        }
+    }
+    prog.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+
+    struct sock_fprog fprog;
+    fprog.len = prog.size();
+    fprog.filter = prog.data();
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0) {
+        ZCM_DEBUG("setsockopt(SOL_SOCKET, SO_ATTACH_FILTER) failed: %s", strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool UDPMSocket::clearChannelFilter()
+{
+#ifdef __linux__
+    int opt = 0;
+    // Fails if there was no filter, which is fine
+    setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, &opt, sizeof(opt));
+#endif
+    return true;
+}
+
+bool UDPMSocket::supportsGso()
+{
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    int segSize = 0;
+    socklen_t len = sizeof(segSize);
+    return getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segSize, &len) == 0;
+#else
+    return false;
+#endif
+}
+
+u16 UDPMSocket::getLocalPort()
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0) return 0;
+    return addr.sin_port;
+}
+
+u32 UDPMSocket::getSourceAddr(const string& ip, u16 port)
+{
+    // Note: connect() on a datagram socket sends nothing, it only picks the route
+    UDPMAddress addr{ip, port};
+    SOCKET testfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (testfd < 0) return INADDR_ANY;
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    u32 ret = INADDR_ANY;
+    if (connect(testfd, addr.getAddrPtr(), addr.getAddrSize()) == 0 &&
+        getsockname(testfd, (struct sockaddr*)&local, &len) == 0)
+        ret = local.sin_addr.s_addr;
+    Platform::closesocket(testfd);
+    return ret;
+}
+
 size_t UDPMSocket::getRecvBufSize()
 {
     int size;
@@ -209,6 +361,7 @@ bool UDPMSocket::waitUntilData(int timeout)
 {
     assert(isOpen());
 
+#ifdef WIN32
     fd_set fds;
     FD_ZERO(&fds);
     FD_SET(fd, &fds);
@@ -229,6 +382,76 @@ bool UDPMSocket::waitUntilData(int timeout)
         perror("udp_read_packet -- select:");
         return false;
     }
+#else
+    // Unlike select(), poll() is not limited to fds below FD_SETSIZE
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int status = poll(&pfd, 1, timeout);
+    if (status == 0) {
+        // timeout
+        return false;
+    } else if (status > 0 && (pfd.revents & POLLIN)) {
+        // data is available
+        return true;
+    } else {
+        if (status < 0 && errno != EINTR) perror("udp_read_packet -- poll:");
+        return false;
+    }
+#endif
+}
+
+void UDPMSocket::parseControlData(Packet *pkt, struct msghdr *msg)
+{
+    pkt->utime = 0;
+#ifdef MSG_EXT_HDR
+    struct cmsghdr *cmsg = msg->msg_controllen ? CMSG_FIRSTHDR(msg) : NULL;
+    while (cmsg) {
+        if (cmsg->cmsg_level == SOL_SOCKET) {
+# ifdef SO_TIMESTAMP
+            /* Get the receive timestamp out of the packet headers if possible */
+            if (cmsg->cmsg_type == SCM_TIMESTAMP) {
+                struct timeval *t = (struct timeval*) CMSG_DATA (cmsg);
+                pkt->utime = (int64_t) t->tv_sec * 1000000 + t->tv_usec;
+            }
+# endif
+# ifdef SO_RXQ_OVFL
+            /* The kernel's running total of packets dropped on this socket */
+            if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                u32 drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+                kernelDrops.set(drops);
+            }
+# endif
+        }
+        cmsg = CMSG_NXTHDR(msg, cmsg);
+    }
+#endif
+
+    if (pkt->utime == 0) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        pkt->utime = (i64)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+void UDPMSocket::countReceived(size_t npackets, size_t nbytes)
+{
+    numSyscalls.add(1);
+    numPackets.add(npackets);
+    numBytes.add(nbytes);
+}
+
+UDPMSocket::RecvCounters UDPMSocket::getRecvCounters() const
+{
+    RecvCounters rc;
+    rc.syscalls    = numSyscalls.get();
+    rc.packets     = numPackets.get();
+    rc.bytes       = numBytes.get();
+    rc.kernelDrops = kernelDrops.get();
+    return rc;
 }
 
 int UDPMSocket::recvPacket(Packet *pkt)
@@ -256,30 +479,61 @@ int UDPMSocket::recvPacket(Packet *pkt)
 
     int ret = ::recvmsg(fd, &msg, 0);
     pkt->fromlen = msg.msg_namelen;
+    pkt->sz = ret < 0 ? 0 : ret;
+    parseControlData(pkt, &msg);
 
-    bool got_utime = false;
-#ifdef SO_TIMESTAMP
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    /* Get the receive timestamp out of the packet headers if possible */
-    while (!pkt->utime && cmsg) {
-        if (cmsg->cmsg_level == SOL_SOCKET &&
-            cmsg->cmsg_type == SCM_TIMESTAMP) {
-            struct timeval *t = (struct timeval*) CMSG_DATA (cmsg);
-            pkt->utime = (int64_t) t->tv_sec * 1000000 + t->tv_usec;
-            got_utime = true;
-            break;
-        }
-        cmsg = CMSG_NXTHDR(&msg, cmsg);
-    }
+    if (ret >= 0)
+        countReceived(1, ret);
+
+    return ret;
+}
+
+int UDPMSocket::recvPackets(Packet **pkts, size_t n)
+{
+#ifdef __linux__
+    static constexpr size_t MAX_MMSG = 64;
+    static constexpr size_t CONTROL_SIZE = 64;
+    struct mmsghdr mhdrs[MAX_MMSG];
+    struct iovec vecs[MAX_MMSG];
+    char controlbufs[MAX_MMSG][CONTROL_SIZE];
+
+    if (n > MAX_MMSG) n = MAX_MMSG;
+    for (size_t i = 0; i < n; ++i) {
+        vecs[i].iov_base = pkts[i]->buf.data;
+        vecs[i].iov_len = pkts[i]->buf.size;
+
+        struct msghdr& msg = mhdrs[i].msg_hdr;
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_name = &pkts[i]->from;
+        msg.msg_namelen = sizeof(struct sockaddr);
+        msg.msg_iov = &vecs[i];
+        msg.msg_iovlen = 1;
+#ifdef MSG_EXT_HDR
+        msg.msg_control = controlbufs[i];
+        msg.msg_controllen = CONTROL_SIZE;
 #endif
+        mhdrs[i].msg_len = 0;
+    }
 
-    if (!got_utime) {
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        pkt->utime = (i64)tv.tv_sec * 1000000 + tv.tv_usec;
+    int ret = ::recvmmsg(fd, mhdrs, n, MSG_DONTWAIT, NULL);
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    size_t nbytes = 0;
+    for (int i = 0; i < ret; ++i) {
+        pkts[i]->sz = mhdrs[i].msg_len;
+        pkts[i]->fromlen = mhdrs[i].msg_hdr.msg_namelen;
+        parseControlData(pkts[i], &mhdrs[i].msg_hdr);
+        nbytes += mhdrs[i].msg_len;
     }
 
+    if (ret > 0)
+        countReceived(ret, nbytes);
     return ret;
+#else
+    if (n == 0) return 0;
+    return recvPacket(pkts[0]) < 0 ? -1 : 1;
+#endif
 }
 
 ssize_t UDPMSocket::sendBuffers(const UDPMAddress& dest, const char *a, size_t alen)
@@ -344,6 +598,71 @@ ssize_t UDPMSocket::sendBuffers(const UDPMAddress& dest, const char *a, size_t a
     return::sendmsg(fd, &mhdr, 0);
 }
 
+// Fill in the msghdr of one outgoing packet. 'control' must have room for
+// CMSG_SPACE(sizeof(u16)) bytes and is only used if the packet is to be segmented
+static void fillOutHeader(struct msghdr& mhdr, const UDPMAddress& dest,
+                          const OutPacket& p, char *control)
+{
+    mhdr.msg_name = dest.getAddrPtr();
+    mhdr.msg_namelen = dest.getAddrSize();
+    mhdr.msg_iov = p.iov;
+    mhdr.msg_iovlen = p.niov;
+    mhdr.msg_control = NULL;
+    mhdr.msg_controllen = 0;
+    mhdr.msg_flags = 0;
+
+#if defined(__linux__) && defined(UDP_SEGMENT)
+    if (p.segSize != 0) {
+        mhdr.msg_control = control;
+        mhdr.msg_controllen = CMSG_SPACE(sizeof(u16));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mhdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(u16));
+        memcpy(CMSG_DATA(cmsg), &p.segSize, sizeof(u16));
+    }
+#endif
+}
+
+size_t UDPMSocket::sendPackets(const UDPMAddress& dest, const OutPacket *pkts, size_t n)
+{
+    // Enough room for a UDP_SEGMENT control message, kept aligned for cmsghdr
+    union Control { char buf[CMSG_SPACE(sizeof(u16))]; struct cmsghdr align; };
+
+    size_t sent = 0;
+#ifdef __linux__
+    static constexpr size_t MAX_MMSG = 64;
+    struct mmsghdr mhdrs[MAX_MMSG];
+    Control controls[MAX_MMSG];
+
+    while (sent < n) {
+        size_t cnt = std::min(n - sent, MAX_MMSG);
+        for (size_t i = 0; i < cnt; ++i) {
+            fillOutHeader(mhdrs[i].msg_hdr, dest, pkts[sent + i], controls[i].buf);
+            mhdrs[i].msg_len = 0;
+        }
+
+        int ret = ::sendmmsg(fd, mhdrs, cnt, 0);
+        if (ret <= 0) break;
+        sent += ret;
+        if ((size_t)ret < cnt) {
+            // Partial batch: let a plain sendmsg() report the error on the next packet
+            break;
+        }
+    }
+#endif
+
+    for (; sent < n; ++sent) {
+        const OutPacket& p = pkts[sent];
+        struct msghdr mhdr;
+        Control control;
+        fillOutHeader(mhdr, dest, p, control.buf);
+        if (::sendmsg(fd, &mhdr, 0) != (ssize_t)p.len) break;
+    }
+
+    return sent;
+}
+
 bool UDPMSocket::checkConnection(const string& ip, u16 port)
 {
     UDPMAddress addr{ip, port};
@@ -395,6 +714,7 @@ UDPMSocket UDPMSocket::createRecvSocket(struct in_addr multiaddr, u16 port)
     if (!sock.setReuseAddr())                { sock.close(); return sock; }
     if (!sock.setReusePort())                { sock.close(); return sock; }
     if (!sock.enablePacketTimestamp())       { sock.close(); return sock; }
+    if (!sock.enableDropCounter())           { sock.close(); return sock; }
     if (!sock.bindPort(port))                { sock.close(); return sock; }
     if (!sock.joinMulticastGroup(multiaddr)) { sock.close(); return sock; }
     return sock;
@@ -27,6 +27,16 @@ class UDPMAddress
     struct sockaddr_in addr;
 };
 
+// One outgoing packet, gathered from the buffers in iov (see sendPackets())
+struct OutPacket
+{
+    struct iovec *iov;
+    size_t niov;
+    size_t len;    // total bytes in iov
+    u16 segSize;   // if non-zero, the kernel cuts the packet into datagrams of
+                   // segSize bytes (the last one may be shorter), see supportsGso()
+};
+
 class UDPMSocket
 {
   public:
@@ -37,14 +47,38 @@ class UDPMSocket
 
     bool init();
     bool joinMulticastGroup(struct in_addr multiaddr);
+    // Join or leave a further group on a socket that is already set up. Unlike
+    // joinMulticastGroup(), a failure leaves the socket open
+    bool addMembership(struct in_addr multiaddr);
+    bool dropMembership(struct in_addr multiaddr);
+    // Only receive from the groups this socket joined itself, not from every group
+    // any socket on the host joined on the same port (Linux only)
+    bool disableMulticastAll();
     bool setTTL(u8 ttl);
     bool bindPort(u16 port);
     bool setReuseAddr();
     bool setReusePort();
     bool enablePacketTimestamp();
+    // Have the kernel report how many packets it dropped because the receive buffer
+    // was full (SO_RXQ_OVFL), see getRecvCounters()
+    bool enableDropCounter();
     bool enableLoopback();
+    // Have the kernel drop short (unfragmented) messages on any channel but these
+    // before they are queued on the socket, with a classic BPF socket filter (Linux
+    // only). Fragments and anything else always pass. Returns false if no filter
+    // could be installed, in which case every packet passes
+    bool setChannelFilter(const vector<string>& channels);
+    bool clearChannelFilter();
+    // True if the kernel can segment packets for us (UDP GSO)
+    bool supportsGso();
     bool setDestination(const string& ip, u16 port);
 
+    // In network byte order, 0 if the socket is not bound yet
+    u16 getLocalPort();
+    // The address the kernel sends packets to the group from, which is what their
+    // receivers see. In network byte order, INADDR_ANY if it can't be told
+    static u32 getSourceAddr(const string& ip, u16 port);
+
     size_t getRecvBufSize();
     size_t getSendBufSize();
 
@@ -52,12 +86,34 @@ class UDPMSocket
     bool waitUntilData(int timeout);
     int recvPacket(Packet *pkt);
 
+    // Receives up to n packets that are already waiting on the socket, with a single
+    // recvmmsg() where the platform supports it. Sets 'sz', 'from' and 'utime' of
+    // every packet received. Returns the number of packets received or -1 on error
+    int recvPackets(Packet **pkts, size_t n);
+
+    // Totals since the socket was opened. Only the receiving thread updates them,
+    // but they may be read from any thread
+    struct RecvCounters
+    {
+        u64 syscalls;    // recvmsg()/recvmmsg() calls that returned packets
+        u64 packets;     // packets they returned
+        u64 bytes;       // bytes in those packets
+        u64 kernelDrops; // packets dropped by the kernel, if enableDropCounter() worked
+    };
+    RecvCounters getRecvCounters() const;
+
     ssize_t sendBuffers(const UDPMAddress& dest, const char *a, size_t alen);
     ssize_t sendBuffers(const UDPMAddress& dest, const char *a, size_t alen,
                             const char *b, size_t blen);
     ssize_t sendBuffers(const UDPMAddress& dest, const char *a, size_t alen,
                         const char *b, size_t blen, const char *c, size_t clen);
 
+    // Sends the packets in order, with a single system call per batch where the
+    // platform supports it (sendmmsg). Returns the number of packets that were sent,
+    // which is less than n only if the packet after the last one sent failed (errno
+    // is left as set by the failing call)
+    size_t sendPackets(const UDPMAddress& dest, const OutPacket *pkts, size_t n);
+
     static bool checkConnection(const string& ip, u16 port);
     void checkAndWarnAboutSmallBuffer(size_t datalen, size_t kbufsize);
 
@@ -67,6 +123,14 @@ class UDPMSocket
   private:
     SOCKET fd = -1;
     bool warnedAboutSmallBuffer = false;
+    StatCounter numSyscalls;
+    StatCounter numPackets;
+    StatCounter numBytes;
+    StatCounter kernelDrops;
+
+    // Pulls the receive timestamp and the kernel drop count out of the control data
+    void parseControlData(Packet *pkt, struct msghdr *msg);
+    void countReceived(size_t npackets, size_t nbytes);
 
   private:
     // Disallow copies
@@ -2,6 +2,7 @@
 #include "zcm/util/debug.h"
 
 #include <cassert>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <tuple>
@@ -66,13 +67,17 @@ struct zcm_url
 
         sep = url.find("://");
         if (sep == string::npos) {
-            protocol = url;
-            return;
+            // Options are allowed without an address too (e.g. "ipc?hwm=10")
+            sep = url.find("?");
+            protocol = string(url.c_str(), min(sep, url.size()));
+            if (sep == string::npos)
+                return;
+            rest = url.substr(sep);
+        } else {
+            protocol = string(url.c_str(), sep);
+            rest = string(url.c_str()+(sep+3), url.size()-(sep+3));
         }
 
-        protocol = string(url.c_str(), sep);
-        rest = string(url.c_str()+(sep+3), url.size()-(sep+3));
-
         sep = rest.find("?");
         if (sep == string::npos) {
             address = std::move(rest);
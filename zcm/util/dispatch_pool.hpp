@@ -0,0 +1,290 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <cstdint>
+
+// A work-stealing thread pool that runs tasks posted to "strands". Tasks posted to
+// the same strand run one at a time and in FIFO order, while tasks on different
+// strands run in parallel on any of the pool threads.
+//
+// Every strand has a home thread (assigned round-robin the first time it is
+// posted to). A strand with pending tasks sits in exactly one thread's deque; the
+// owner takes strands from the front of its deque, idle threads steal from the back
+// of the others. After running one task the strand is put back into the deque of
+// the thread that ran it if it has more work, which keeps a busy strand from
+// starving the others.
+//
+// Note: strands are not owned by the pool. They may outlive it, in which case any
+//       tasks still pending when the pool is destroyed are dropped. Call waitIdle()
+//       first to run them.
+template<class Key, class Task>
+class DispatchPool
+{
+  public:
+    class Strand
+    {
+        friend class DispatchPool;
+
+        std::mutex mut;
+        std::deque<Task> pending;
+        bool scheduled = false;
+        size_t home = SIZE_MAX;
+
+      public:
+        const Key key;
+
+        explicit Strand(Key key) : key(std::move(key)) {}
+    };
+    using StrandPtr = std::shared_ptr<Strand>;
+
+    using Runner = std::function<void(Strand&, Task&)>;
+    using ThreadInit = std::function<void(size_t)>;
+
+    struct ThreadStats
+    {
+        size_t   queueDepth; // strands waiting in this thread's deque
+        uint64_t dispatched; // tasks run by this thread
+        uint64_t stolen;     // strands this thread took from another thread's deque
+        uint64_t dropped;    // tasks dropped because their strand was full
+    };
+
+  private:
+    struct Worker
+    {
+        std::mutex mut;
+        std::deque<StrandPtr> strands;
+        std::atomic<size_t>   depth      {0};
+        std::atomic<uint64_t> dispatched {0};
+        std::atomic<uint64_t> stolen     {0};
+        std::atomic<uint64_t> dropped    {0};
+        std::thread thread;
+    };
+
+    Runner runner;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> nextHome {0};
+    std::atomic<size_t> maxPending;
+
+    // Used by idle workers to sleep and by stop()
+    std::mutex sleepMut;
+    std::condition_variable sleepCond;
+    std::atomic<size_t> queued {0};
+    size_t sleepers = 0;
+    bool halting = false;
+
+    // Tasks that are either pending or running, used by waitIdle()
+    std::mutex idleMut;
+    std::condition_variable idleCond;
+    size_t outstanding = 0;
+
+    void schedule(size_t idx, const StrandPtr& s)
+    {
+        Worker& w = *workers[idx];
+        {
+            std::unique_lock<std::mutex> lk(w.mut);
+            w.strands.push_back(s);
+            w.depth.store(w.strands.size(), std::memory_order_relaxed);
+        }
+        queued.fetch_add(1);
+
+        std::unique_lock<std::mutex> lk(sleepMut);
+        if (sleepers > 0) sleepCond.notify_one();
+    }
+
+    StrandPtr takeFront(Worker& w)
+    {
+        std::unique_lock<std::mutex> lk(w.mut);
+        if (w.strands.empty()) return nullptr;
+        StrandPtr s = std::move(w.strands.front());
+        w.strands.pop_front();
+        w.depth.store(w.strands.size(), std::memory_order_relaxed);
+        queued.fetch_sub(1);
+        return s;
+    }
+
+    StrandPtr takeBack(Worker& w)
+    {
+        std::unique_lock<std::mutex> lk(w.mut);
+        if (w.strands.empty()) return nullptr;
+        StrandPtr s = std::move(w.strands.back());
+        w.strands.pop_back();
+        w.depth.store(w.strands.size(), std::memory_order_relaxed);
+        queued.fetch_sub(1);
+        return s;
+    }
+
+    // Returns the next strand to run, or nullptr if the pool is halting
+    StrandPtr next(size_t idx)
+    {
+        Worker& self = *workers[idx];
+        while (true) {
+            StrandPtr s = takeFront(self);
+            if (s) return s;
+
+            for (size_t i = 1; i < workers.size(); ++i) {
+                Worker& victim = *workers[(idx + i) % workers.size()];
+                s = takeBack(victim);
+                if (s) {
+                    self.stolen.fetch_add(1, std::memory_order_relaxed);
+                    return s;
+                }
+            }
+
+            std::unique_lock<std::mutex> lk(sleepMut);
+            if (halting) return nullptr;
+            if (queued.load() != 0) continue;
+            ++sleepers;
+            sleepCond.wait(lk, [&](){ return halting || queued.load() != 0; });
+            --sleepers;
+            if (halting) return nullptr;
+        }
+    }
+
+    void finished(size_t ntasks)
+    {
+        if (ntasks == 0) return;
+        std::unique_lock<std::mutex> lk(idleMut);
+        outstanding -= ntasks;
+        if (outstanding == 0) idleCond.notify_all();
+    }
+
+    void threadFunc(size_t idx, ThreadInit init)
+    {
+        if (init) init(idx);
+
+        Worker& self = *workers[idx];
+        while (true) {
+            StrandPtr s = next(idx);
+            if (!s) break;
+
+            std::unique_lock<std::mutex> lk(s->mut);
+            if (s->pending.empty()) {
+                s->scheduled = false;
+                continue;
+            }
+            {
+                Task t(std::move(s->pending.front()));
+                s->pending.pop_front();
+                lk.unlock();
+
+                runner(*s, t);
+                self.dispatched.fetch_add(1, std::memory_order_relaxed);
+            }
+            finished(1);
+
+            lk.lock();
+            if (s->pending.empty()) {
+                s->scheduled = false;
+            } else {
+                lk.unlock();
+                schedule(idx, s);
+            }
+        }
+    }
+
+  public:
+    DispatchPool(size_t nthreads, size_t maxPending, Runner runner, ThreadInit init = nullptr) :
+        runner(std::move(runner)), maxPending(maxPending)
+    {
+        if (nthreads == 0) nthreads = 1;
+        for (size_t i = 0; i < nthreads; ++i)
+            workers.emplace_back(new Worker());
+        for (size_t i = 0; i < nthreads; ++i)
+            workers[i]->thread = std::thread(&DispatchPool::threadFunc, this, i, init);
+    }
+
+    ~DispatchPool()
+    {
+        {
+            std::unique_lock<std::mutex> lk(sleepMut);
+            halting = true;
+            sleepCond.notify_all();
+        }
+        for (auto& w : workers) w->thread.join();
+
+        // Drop anything that did not get to run
+        size_t dropped = 0;
+        for (auto& w : workers) {
+            for (auto& s : w->strands) {
+                std::unique_lock<std::mutex> lk(s->mut);
+                dropped += s->pending.size();
+                s->pending.clear();
+                s->scheduled = false;
+            }
+            w->strands.clear();
+        }
+        finished(dropped);
+    }
+
+    size_t numThreads() const { return workers.size(); }
+
+    // Upper bound on the number of tasks waiting on a single strand. When a strand
+    // is full, its oldest pending task is dropped to make room for the new one, so a
+    // slow strand cannot hold up any of the others
+    void setMaxPending(size_t n) { maxPending.store(n == 0 ? 1 : n); }
+
+    void post(const StrandPtr& s, Task&& t)
+    {
+        {
+            std::unique_lock<std::mutex> lk(idleMut);
+            ++outstanding;
+        }
+
+        bool dropped = false;
+        bool needsSchedule = false;
+        size_t home;
+        {
+            std::unique_lock<std::mutex> lk(s->mut);
+            if (s->pending.size() >= maxPending.load(std::memory_order_relaxed)) {
+                s->pending.pop_front();
+                dropped = true;
+            }
+            s->pending.push_back(std::move(t));
+            if (!s->scheduled) {
+                s->scheduled = needsSchedule = true;
+                if (s->home == SIZE_MAX) s->home = nextHome.fetch_add(1);
+            }
+            // Note: strands may outlive a pool with a different number of threads
+            home = s->home % workers.size();
+        }
+
+        if (dropped) {
+            workers[home]->dropped.fetch_add(1, std::memory_order_relaxed);
+            finished(1);
+        }
+
+        if (needsSchedule) schedule(home, s);
+    }
+
+    // Block until every posted task has either run or been dropped
+    void waitIdle()
+    {
+        std::unique_lock<std::mutex> lk(idleMut);
+        idleCond.wait(lk, [&](){ return outstanding == 0; });
+    }
+
+    std::vector<ThreadStats> getStats()
+    {
+        std::vector<ThreadStats> ret;
+        for (auto& w : workers) {
+            ThreadStats st;
+            st.queueDepth = w->depth.load(std::memory_order_relaxed);
+            st.dispatched = w->dispatched.load(std::memory_order_relaxed);
+            st.stolen     = w->stolen.load(std::memory_order_relaxed);
+            st.dropped    = w->dropped.load(std::memory_order_relaxed);
+            ret.push_back(st);
+        }
+        return ret;
+    }
+
+  private:
+    DispatchPool(const DispatchPool& other) = delete;
+    DispatchPool& operator=(const DispatchPool& other) = delete;
+};
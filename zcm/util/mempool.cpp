@@ -0,0 +1,202 @@
+#include "zcm/util/mempool.hpp"
+#include "zcm/util/debug.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <sys/mman.h>
+# define USE_MMAP
+#endif
+
+// The smallest size class that holds sz bytes, or NUMCLASSES if there is none
+static size_t sizeToClass(size_t sz)
+{
+    size_t bits = MemPool::MIN_BLOCK_BITS;
+    while (bits <= MemPool::MAX_BLOCK_BITS && ((size_t)1 << bits) < sz)
+        ++bits;
+    return bits - MemPool::MIN_BLOCK_BITS;
+}
+
+static size_t classToSize(size_t cls)
+{
+    return (size_t)1 << (cls + MemPool::MIN_BLOCK_BITS);
+}
+
+MemPool::MemPool(size_t maxCachedBytes, size_t maxCachedBlock, HugePages hugePages)
+    : maxCachedBytes(maxCachedBytes), maxCachedBlock(maxCachedBlock), hugePages(hugePages)
+{
+    for (size_t i = 0; i < NUMCLASSES; i++)
+        classes[i].stats.blockSize = classToSize(i);
+}
+
+MemPool::~MemPool()
+{
+    trim();
+}
+
+MemPool& MemPool::global()
+{
+    // Note: intentionally leaked so that it outlives every static object using it
+    static MemPool *pool = new MemPool();
+    return *pool;
+}
+
+char *MemPool::sysAlloc(size_t sz)
+{
+#ifdef USE_MMAP
+    if (sz >= HUGE_PAGE_SIZE) {
+        size_t len = (sz + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void *mem = MAP_FAILED;
+# ifdef MAP_HUGETLB
+        if (hugePages == HUGE_PAGES_HUGETLB && !hugetlbFailed.load(std::memory_order_relaxed)) {
+            mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem == MAP_FAILED) {
+                // No huge pages reserved (see /proc/sys/vm/nr_hugepages), don't try again
+                ZCM_DEBUG("MemPool: MAP_HUGETLB failed: %s", strerror(errno));
+                hugetlbFailed.store(true, std::memory_order_relaxed);
+            }
+        }
+# endif
+        if (mem == MAP_FAILED) {
+            mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) return nullptr;
+# ifdef MADV_HUGEPAGE
+            if (hugePages != HUGE_PAGES_NONE)
+                madvise(mem, len, MADV_HUGEPAGE);
+# endif
+        }
+        return (char*)mem;
+    }
+#endif
+    return (char*)malloc(sz);
+}
+
+void MemPool::sysFree(char *mem, size_t sz)
+{
+#ifdef USE_MMAP
+    if (sz >= HUGE_PAGE_SIZE) {
+        size_t len = (sz + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        munmap(mem, len);
+        return;
+    }
+#endif
+    std::free(mem);
+}
+
+char *MemPool::alloc(size_t sz)
+{
+    size_t cls = sizeToClass(sz);
+    if (cls >= NUMCLASSES)
+        return sysAlloc(sz);
+
+    SizeClass& c = classes[cls];
+    {
+        std::unique_lock<std::mutex> lk(c.mut);
+        if (++c.stats.inUse > c.stats.highWater)
+            c.stats.highWater = c.stats.inUse;
+
+        Block *mem = c.free;
+        if (mem) {
+            c.free = mem->next;
+            c.stats.cached--;
+            c.stats.hits++;
+            cachedBytes.fetch_sub(c.stats.blockSize, std::memory_order_relaxed);
+            return (char*)mem;
+        }
+        c.stats.misses++;
+    }
+
+    char *mem = sysAlloc(c.stats.blockSize);
+    if (!mem) {
+        std::unique_lock<std::mutex> lk(c.mut);
+        c.stats.inUse--;
+    }
+    return mem;
+}
+
+void MemPool::free(char *mem, size_t sz)
+{
+    size_t cls = sizeToClass(sz);
+    if (cls >= NUMCLASSES) {
+        sysFree(mem, sz);
+        return;
+    }
+
+    SizeClass& c = classes[cls];
+    bool cache = c.stats.blockSize <= maxCachedBlock &&
+                 c.stats.blockSize <= maxCachedBytes;
+    {
+        std::unique_lock<std::mutex> lk(c.mut);
+        assert(c.stats.inUse > 0);
+        c.stats.inUse--;
+        if (cache) {
+            Block *blk = (Block*)mem;
+            blk->next = c.free;
+            c.free = blk;
+            c.stats.cached++;
+            cachedBytes.fetch_add(c.stats.blockSize, std::memory_order_relaxed);
+        }
+    }
+    if (!cache) {
+        sysFree(mem, c.stats.blockSize);
+        return;
+    }
+
+    // Note: the block just freed is the most likely one to be wanted again, but it
+    //       is also the one that might have pushed the cache over its limit. Giving
+    //       back the largest blocks first keeps the small, frequent ones around
+    if (cachedBytes.load(std::memory_order_relaxed) > maxCachedBytes)
+        trimTo(maxCachedBytes);
+}
+
+size_t MemPool::trimTo(size_t target)
+{
+    size_t released = 0;
+    for (size_t i = NUMCLASSES; i-- > 0;) {
+        SizeClass& c = classes[i];
+        Block *blk = nullptr;
+        {
+            std::unique_lock<std::mutex> lk(c.mut);
+            while (c.free && cachedBytes.load(std::memory_order_relaxed) > target) {
+                Block *b = c.free;
+                c.free = b->next;
+                c.stats.cached--;
+                cachedBytes.fetch_sub(c.stats.blockSize, std::memory_order_relaxed);
+                b->next = blk;
+                blk = b;
+            }
+        }
+        while (blk) {
+            Block *next = blk->next;
+            sysFree((char*)blk, c.stats.blockSize);
+            released += c.stats.blockSize;
+            blk = next;
+        }
+        if (cachedBytes.load(std::memory_order_relaxed) <= target) break;
+    }
+    return released;
+}
+
+size_t MemPool::trim()
+{
+    return trimTo(0);
+}
+
+size_t MemPool::getCachedBytes() const
+{
+    return cachedBytes.load(std::memory_order_relaxed);
+}
+
+std::vector<MemPool::ClassStats> MemPool::getStats()
+{
+    std::vector<ClassStats> ret;
+    for (size_t i = 0; i < NUMCLASSES; i++) {
+        std::unique_lock<std::mutex> lk(classes[i].mut);
+        ret.push_back(classes[i].stats);
+    }
+    return ret;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// A thread-safe pool of memory blocks in power-of-two size classes from 2^6 to 2^28
+// bytes. Freed blocks of up to maxCachedBlock bytes are cached and handed out again by
+// later allocations of the same class, which keeps frequent allocations away from the
+// system allocator. The cache of all classes together holds at most maxCachedBytes;
+// a free() that goes over it returns cached blocks to the system, largest first.
+// Larger blocks and requests go straight to the system.
+//
+// Blocks of at least 2 MB are mapped directly and can be backed by huge pages, either
+// transparently (madvise(MADV_HUGEPAGE)) or from the reserved pool (MAP_HUGETLB,
+// falling back to normal pages when none are available).
+//
+// Note: the caller has to pass the same size to free() that it passed to alloc()
+class MemPool
+{
+  public:
+    enum HugePages
+    {
+        HUGE_PAGES_NONE,
+        HUGE_PAGES_MADVISE,
+        HUGE_PAGES_HUGETLB,
+    };
+
+    struct ClassStats
+    {
+        size_t   blockSize;
+        uint64_t hits;      // allocations served from the cache
+        uint64_t misses;    // allocations that had to go to the system
+        size_t   inUse;     // blocks currently allocated
+        size_t   highWater; // most blocks allocated at once
+        size_t   cached;    // blocks waiting in the cache
+    };
+
+    MemPool(size_t maxCachedBytes = DEFAULT_MAX_CACHED,
+            size_t maxCachedBlock = DEFAULT_MAX_CACHED_BLOCK,
+            HugePages hugePages = HUGE_PAGES_MADVISE);
+    ~MemPool();
+
+    // The pool shared by the whole process (the blocking core, UDPM, the logger)
+    static MemPool& global();
+
+    char *alloc(size_t sz);
+    void free(char *mem, size_t sz);
+
+    template<class T>
+    T *alloc();
+
+    template<class T>
+    void free(T *ptr);
+
+    // Returns every cached block to the system. Returns the number of bytes released
+    size_t trim();
+
+    // Bytes held in the cache of all classes together
+    size_t getCachedBytes() const;
+
+    // One entry per size class, smallest first
+    std::vector<ClassStats> getStats();
+
+    static constexpr size_t DEFAULT_MAX_CACHED = 8 << 20;
+    static constexpr size_t DEFAULT_MAX_CACHED_BLOCK = 2 << 20;
+    static constexpr size_t MIN_BLOCK_BITS = 6;
+    static constexpr size_t MAX_BLOCK_BITS = 28;
+    static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+  private:
+    struct Block { Block *next; };
+
+    struct SizeClass
+    {
+        std::mutex mut;
+        Block *free = nullptr;
+        ClassStats stats = {};
+    };
+
+    static const size_t NUMCLASSES = MAX_BLOCK_BITS - MIN_BLOCK_BITS + 1;
+    SizeClass classes[NUMCLASSES];
+    size_t maxCachedBytes;
+    size_t maxCachedBlock;
+    HugePages hugePages;
+    std::atomic<bool> hugetlbFailed {false};
+    // Note: only changes under the lock of the class whose cache grows or shrinks
+    std::atomic<size_t> cachedBytes {0};
+
+    char *sysAlloc(size_t sz);
+    void sysFree(char *mem, size_t sz);
+    // Returns cached blocks to the system, largest first, until at most target bytes
+    // are cached. Returns the number of bytes released
+    size_t trimTo(size_t target);
+
+  private:
+    // Disallow copies and moves
+    MemPool(const MemPool&) = delete;
+    MemPool& operator=(const MemPool&) = delete;
+    MemPool(MemPool&& other) = delete;
+    MemPool& operator=(MemPool&& other) = delete;
+};
+
+template<class T>
+T *MemPool::alloc()
+{
+    return (T*)this->alloc(sizeof(T));
+}
+
+template<class T>
+void MemPool::free(T *ptr)
+{
+    this->free((char*)ptr, sizeof(*ptr));
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <cstdint>
+
+// A pointer to an immutable object that readers can use without taking a lock while
+// writers replace it with new versions (copy-on-write, read-copy-update style).
+//
+// Old versions are reclaimed with epoch-based reclamation: every reader has its own
+// slot (on its own cache line) in which it announces the epoch it entered in, so a
+// read costs no shared atomic read-modify-write. A version retired in epoch E is
+// freed once every slot is either quiescent or has entered in epoch E or later.
+// Writers never wait for readers: versions that are still in use are simply kept
+// until a later publish() or reclaim() finds them unused.
+//
+// Note: each reader slot may only be used by one thread at a time, and reads on the
+//       same slot must not be nested. publish() and reclaim() must be serialized by
+//       the user.
+template<class T>
+class RcuPtr
+{
+    static constexpr size_t CACHE_LINE = 64;
+    static constexpr uint64_t QUIESCENT = 0;
+
+    struct Slot
+    {
+        std::atomic<uint64_t> epoch {QUIESCENT};
+        char pad[CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+    };
+
+    std::atomic<T*> cur;
+    std::atomic<uint64_t> epoch {1};
+    std::unique_ptr<Slot[]> slots;
+    size_t nslots;
+
+    // Only touched by writers
+    std::vector<std::pair<T*, uint64_t>> retired;
+
+  public:
+    class ReadGuard
+    {
+        friend class RcuPtr;
+        Slot* slot;
+        T* ptr;
+
+        ReadGuard(Slot* slot, T* ptr) : slot(slot), ptr(ptr) {}
+
+      public:
+        ReadGuard(ReadGuard&& other) : slot(other.slot), ptr(other.ptr) { other.slot = nullptr; }
+        ~ReadGuard() { if (slot) slot->epoch.store(QUIESCENT, std::memory_order_release); }
+
+        const T* operator->() const { return ptr; }
+        const T& operator*() const { return *ptr; }
+        const T* get() const { return ptr; }
+
+      private:
+        ReadGuard(const ReadGuard& other) = delete;
+        ReadGuard& operator=(const ReadGuard& other) = delete;
+    };
+
+    RcuPtr(T* initial, size_t nreaders) :
+        cur(initial), slots(new Slot[nreaders]), nslots(nreaders) {}
+
+    ~RcuPtr()
+    {
+        for (auto& r : retired) delete r.first;
+        delete cur.load();
+    }
+
+    // The returned guard keeps the version it points to alive until it is destroyed
+    ReadGuard read(size_t reader)
+    {
+        Slot* slot = &slots[reader];
+        slot->epoch.store(epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        return ReadGuard(slot, cur.load(std::memory_order_seq_cst));
+    }
+
+    // Only for writers (serialized by the user): the current version to copy from
+    const T* current() const { return cur.load(std::memory_order_relaxed); }
+
+    // Make 'next' the current version and retire the previous one
+    void publish(T* next)
+    {
+        T* prev = cur.exchange(next, std::memory_order_seq_cst);
+        uint64_t e = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+        retired.emplace_back(prev, e);
+        reclaim();
+    }
+
+    // Free every retired version that no reader can still be using
+    void reclaim()
+    {
+        uint64_t oldest = UINT64_MAX;
+        for (size_t i = 0; i < nslots; ++i) {
+            uint64_t e = slots[i].epoch.load(std::memory_order_seq_cst);
+            if (e != QUIESCENT && e < oldest) oldest = e;
+        }
+
+        size_t kept = 0;
+        for (auto& r : retired) {
+            if (r.second <= oldest) delete r.first;
+            else retired[kept++] = r;
+        }
+        retired.resize(kept);
+    }
+
+  private:
+    RcuPtr(const RcuPtr& other) = delete;
+    RcuPtr& operator=(const RcuPtr& other) = delete;
+};
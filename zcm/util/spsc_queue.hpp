@@ -0,0 +1,369 @@
+#pragma once
+
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <cassert>
+
+#include "zcm/zcm.h"
+
+// A lock-free single-producer/single-consumer ring designed as a drop-in
+// replacement for the former mutex-based ThreadsafeQueue. The slots are
+// preallocated and the producer and consumer indices live on separate cache
+// lines. Neither side touches a mutex or the kernel unless the ring is empty
+// (consumer) or full (producer): in that case it spins for a while (on
+// multi-core machines) and then parks on a condition variable.
+//
+// With MultiProducer, any number of threads may push: they are serialized by a
+// producer mutex, so only the consumer side stays lock-free.
+//
+// Note: There may only be one consumer (top()/pop()) at a time; the user is
+//       responsible for that. Without MultiProducer, the same goes for the
+//       producer (push()/pushIfRoom()). setCapacity() requires that the consumer
+//       is excluded by the user (see zcm_blocking_t::setQueueSize()) and waits
+//       for a producer that is in the middle of a push; disable() the queue
+//       first so that push() doesn't wait for room meanwhile.
+template<class Element, bool MultiProducer = false>
+class SpscQueue
+{
+    static constexpr size_t CACHE_LINE = 64;
+
+    static constexpr unsigned MIN_SPINS = 16;
+    static constexpr unsigned MAX_SPINS = 4096;
+
+    // Note: the hot fields are separated by explicit padding rather than alignas()
+    //       so that the queue can be embedded in heap objects without requiring
+    //       over-aligned new
+    char pad0[CACHE_LINE];
+
+    // Written by the consumer, read by the producer
+    std::atomic<size_t> front {0};
+    // Consumer-private copy of 'back' to avoid touching the producer's line
+    size_t backCache = 0;
+    unsigned consumerSpins = initialSpins();
+    char pad1[CACHE_LINE];
+
+    // Written by the producer, read by the consumer
+    std::atomic<size_t> back {0};
+    // Producer-private copy of 'front' to avoid touching the consumer's line
+    size_t frontCache = 0;
+    unsigned producerSpins = initialSpins();
+    char pad2[CACHE_LINE];
+
+    // Read-mostly by both sides
+    Element* queue;
+    size_t capacity;
+    std::atomic<bool> disabled {false};
+    char pad3[CACHE_LINE];
+
+    // Only used when one of the sides needs to go to sleep or serialize producers
+    std::atomic<uint32_t> sleepers {0};
+    std::mutex parkMut;
+    std::condition_variable cond;
+    std::mutex producerMut;
+    // Single producer only: keeps setCapacity() and the producer apart
+    std::atomic<bool> producing {false};
+    std::atomic<bool> resizing {false};
+
+    size_t incIdx(size_t i) const
+    {
+        size_t nextIdx = i + 1;
+        if (nextIdx == capacity) return 0;
+        return nextIdx;
+    }
+
+    // Number of elements between the front index f and the back index b
+    size_t distance(size_t f, size_t b) const
+    {
+        if (b >= f) {
+            return b - f;
+        } else {
+            return capacity - (f - b);
+        }
+    }
+
+    // Spinning only makes sense if the other side can run at the same time
+    static unsigned initialSpins()
+    {
+        static const unsigned spins = std::thread::hardware_concurrency() > 1 ? MIN_SPINS : 0;
+        return spins;
+    }
+
+    static inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
+
+    // Producer side: is there a free slot?
+    bool producerHasRoom()
+    {
+        size_t nextBack = incIdx(back.load(std::memory_order_relaxed));
+        if (nextBack != frontCache) return true;
+        frontCache = front.load(std::memory_order_acquire);
+        return nextBack != frontCache;
+    }
+
+    // Consumer side: is there a message?
+    bool consumerHasMessage()
+    {
+        size_t f = front.load(std::memory_order_relaxed);
+        if (f != backCache) return true;
+        backCache = back.load(std::memory_order_acquire);
+        return f != backCache;
+    }
+
+    // Wait until pred() is true. Spin first (adapting the spin count to how
+    // often spinning was enough) and then park. A spin count of 0 stays 0.
+    template<class Pred>
+    void waitFor(unsigned& spins, Pred pred)
+    {
+        for (unsigned i = 0; i < spins; ++i) {
+            if (pred()) {
+                if (spins < MAX_SPINS) spins *= 2;
+                return;
+            }
+            cpuRelax();
+        }
+        if (spins > MIN_SPINS) spins /= 2;
+
+        std::unique_lock<std::mutex> lk(parkMut);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        // Pairs with the fence in wakeSleepers(): either we see the other
+        // side's update, or it sees us in 'sleepers' and notifies under parkMut
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait(lk, pred);
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void wakeSleepers()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) == 0) return;
+        std::unique_lock<std::mutex> lk(parkMut);
+        cond.notify_all();
+    }
+
+    // Producer side: entered around every push, see setCapacity()
+    void enterProducer()
+    {
+        if (MultiProducer) {
+            producerMut.lock();
+            return;
+        }
+        while (true) {
+            // Pairs with setCapacity(): either we see 'resizing', or it sees
+            // 'producing' and waits for us
+            producing.store(true, std::memory_order_seq_cst);
+            if (!resizing.load(std::memory_order_seq_cst)) return;
+            producing.store(false, std::memory_order_release);
+
+            std::unique_lock<std::mutex> lk(parkMut);
+            cond.wait(lk, [&](){ return !resizing.load(std::memory_order_relaxed); });
+        }
+    }
+
+    void leaveProducer()
+    {
+        if (MultiProducer) producerMut.unlock();
+        else               producing.store(false, std::memory_order_release);
+    }
+
+    struct ProducerScope
+    {
+        SpscQueue& q;
+        ProducerScope(SpscQueue& q) : q(q) { q.enterProducer(); }
+        ~ProducerScope() { q.leaveProducer(); }
+    };
+
+    template<class... Args>
+    void doPush(Args&&... args)
+    {
+        size_t b = back.load(std::memory_order_relaxed);
+
+        // Initialize the Element by forwarding the parameter pack
+        // directly to the constructor called via Placement New
+        new (&queue[b]) Element(std::forward<Args>(args)...);
+
+        back.store(incIdx(b), std::memory_order_release);
+        wakeSleepers();
+    }
+
+  public:
+    SpscQueue(size_t capacity) : capacity(capacity)
+    {
+        // We are avoiding initializing the structs here
+        queue = (Element*) new uint8_t[capacity * sizeof(Element)];
+        ZCM_ASSERT(queue);
+    }
+
+    ~SpscQueue()
+    {
+        // We need to deconstruct any elements still in the queue
+        while (hasMessage()) pop();
+        delete[] ((uint8_t*) queue);
+    }
+
+    size_t getCapacity()
+    {
+        return capacity;
+    }
+
+    // Requires that the consumer is not using the queue
+    void setCapacity(size_t capacity)
+    {
+        std::unique_lock<std::mutex> lk(producerMut, std::defer_lock);
+        if (MultiProducer) {
+            lk.lock();
+        } else {
+            // Rare enough that the producer doesn't need to tell us when it's done
+            resizing.store(true, std::memory_order_seq_cst);
+            while (producing.load(std::memory_order_seq_cst)) std::this_thread::yield();
+        }
+
+        uint8_t* newQueue = new uint8_t[capacity * sizeof(Element)];
+        ZCM_ASSERT(newQueue);
+
+        // Elements are relocated bitwise, just like in Queue::setCapacity().
+        // Note: one slot is always kept free to tell full from empty
+        size_t newBack = 0;
+        while (hasMessage() && newBack + 1 < capacity) {
+            size_t f = front.load(std::memory_order_relaxed);
+            std::uninitialized_copy_n((uint8_t*) &queue[f], sizeof(Element),
+                                      newQueue + newBack * sizeof(Element));
+            front.store(incIdx(f), std::memory_order_relaxed);
+            ++newBack;
+        }
+        // Anything that does not fit anymore is dropped
+        while (hasMessage()) pop();
+
+        delete[] ((uint8_t*) queue);
+        queue = (Element*) newQueue;
+        this->capacity = capacity;
+        front.store(0, std::memory_order_relaxed);
+        back.store(newBack, std::memory_order_release);
+        frontCache = 0;
+        backCache = newBack;
+        if (!MultiProducer) {
+            // Note: a producer waiting in enterProducer() doesn't count as a sleeper.
+            //       One that didn't wait reads the new ring through 'resizing'
+            std::unique_lock<std::mutex> plk(parkMut);
+            resizing.store(false, std::memory_order_release);
+            cond.notify_all();
+        }
+        wakeSleepers();
+    }
+
+    bool hasFreeSpace()
+    {
+        return front.load(std::memory_order_acquire) !=
+               incIdx(back.load(std::memory_order_acquire));
+    }
+
+    bool hasMessage()
+    {
+        return front.load(std::memory_order_acquire) !=
+               back.load(std::memory_order_acquire);
+    }
+
+    size_t numMessages()
+    {
+        return distance(front.load(std::memory_order_acquire),
+                        back.load(std::memory_order_acquire));
+    }
+
+    // Wait for hasFreeSpace() and then push the new element
+    // Returns true if the value was pushed, otherwise it
+    // was forcibly awoken by disable()
+    template<class... Args>
+    bool push(Args&&... args)
+    {
+        ProducerScope scope(*this);
+        waitFor(producerSpins, [&](){
+            return disabled.load(std::memory_order_acquire) || producerHasRoom();
+        });
+        if (!producerHasRoom()) return false;
+
+        doPush(std::forward<Args>(args)...);
+        return true;
+    }
+
+    // Check for hasFreeSpace() and if so, push the new element
+    // Returns true if the value was pushed, returns false if no room
+    template<class... Args>
+    bool pushIfRoom(Args&&... args)
+    {
+        ProducerScope scope(*this);
+        if (!producerHasRoom()) return false;
+
+        doPush(std::forward<Args>(args)...);
+        return true;
+    }
+
+    // Wait for hasMessage() and then return the top element
+    // Always returns a valid Element* except when is was
+    // forcibly awoken by disable(). In such a case
+    // nullptr is returned to the user
+    Element* top()
+    {
+        waitFor(consumerSpins, [&](){
+            return disabled.load(std::memory_order_acquire) || consumerHasMessage();
+        });
+        if (disabled.load(std::memory_order_acquire)) return nullptr;
+
+        return &queue[front.load(std::memory_order_relaxed)];
+    }
+
+    // Consumer side: returns the i'th element behind the front without waiting,
+    // or nullptr if fewer than i+1 elements are in the queue. peek(0) is what top()
+    // would return. Used to hand several queued elements to the transport at once
+    Element* peek(size_t i)
+    {
+        size_t f = front.load(std::memory_order_relaxed);
+        if (distance(f, backCache) <= i) {
+            backCache = back.load(std::memory_order_acquire);
+            if (distance(f, backCache) <= i) return nullptr;
+        }
+        size_t idx = f + i;
+        if (idx >= capacity) idx -= capacity;
+        return &queue[idx];
+    }
+
+    // Requires that hasMessage() == true
+    void pop()
+    {
+        size_t f = front.load(std::memory_order_relaxed);
+        assert(f != back.load(std::memory_order_acquire));
+        // Manually call the destructor
+        queue[f].~Element();
+        front.store(incIdx(f), std::memory_order_release);
+        wakeSleepers();
+    }
+
+    // Forcefully wakes up top() and push(). top() *will not* return a message from
+    // the queue, even if one exists. push() *will* push the message if there is room.
+    void disable()
+    {
+        disabled.store(true, std::memory_order_release);
+        std::unique_lock<std::mutex> lk(parkMut);
+        cond.notify_all();
+    }
+
+    void enable()
+    {
+        disabled.store(false, std::memory_order_release);
+    }
+
+  private:
+    SpscQueue(const SpscQueue& other) = delete;
+    SpscQueue(SpscQueue&& other) = delete;
+    SpscQueue& operator=(const SpscQueue& other) = delete;
+    SpscQueue& operator=(SpscQueue&& other) = delete;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+
+#include "cxxtest/TestSuite.h"
+
+#include "zcm/util/mempool.hpp"
+
+class MemPoolTest : public CxxTest::TestSuite
+{
+  public:
+    void setUp() override {}
+    void tearDown() override {}
+
+    void testReuse()
+    {
+        MemPool pool;
+
+        char *buf = pool.alloc(70000);
+        TS_ASSERT(buf);
+        pool.free(buf, 70000);
+        // Same size class (2^17)
+        char *buf2 = pool.alloc(1 << 17);
+        TS_ASSERT_EQUALS(buf, buf2);
+        pool.free(buf2, 1 << 17);
+
+        char *buf3 = pool.alloc(1 << 18);
+        TS_ASSERT(buf3 && buf3 != buf);
+        pool.free(buf3, 1 << 18);
+
+        // Too large to be pooled, goes straight to the system
+        char *buf4 = pool.alloc((1 << 28) + 1);
+        TS_ASSERT(buf4);
+        pool.free(buf4, (1 << 28) + 1);
+    }
+
+    void testStats()
+    {
+        MemPool pool;
+
+        char *a = pool.alloc(100);
+        char *b = pool.alloc(128);
+        pool.free(a, 100);
+        char *c = pool.alloc(120);
+        TS_ASSERT_EQUALS(a, c);
+
+        auto stats = pool.getStats();
+        TS_ASSERT_EQUALS(stats.size(), MemPool::MAX_BLOCK_BITS - MemPool::MIN_BLOCK_BITS + 1);
+        const MemPool::ClassStats& st = stats[1];
+        TS_ASSERT_EQUALS(st.blockSize, 128);
+        TS_ASSERT_EQUALS(st.hits, 1);
+        TS_ASSERT_EQUALS(st.misses, 2);
+        TS_ASSERT_EQUALS(st.inUse, 2);
+        TS_ASSERT_EQUALS(st.highWater, 2);
+        TS_ASSERT_EQUALS(st.cached, 0);
+
+        pool.free(b, 128);
+        pool.free(c, 120);
+        TS_ASSERT_EQUALS(pool.getStats()[1].cached, 2);
+        TS_ASSERT_EQUALS(pool.trim(), 2 * 128);
+        TS_ASSERT_EQUALS(pool.getStats()[1].cached, 0);
+    }
+
+    void testBoundedCache()
+    {
+        // Room for two 1 MB blocks in all classes together
+        MemPool pool(2 << 20, 1 << 20, MemPool::HUGE_PAGES_NONE);
+
+        std::vector<char*> bufs;
+        for (int i = 0; i < 4; ++i) bufs.push_back(pool.alloc(1 << 20));
+        char *small = pool.alloc(1 << 10);
+        for (char *b : bufs) pool.free(b, 1 << 20);
+
+        const MemPool::ClassStats st = pool.getStats()[20 - MemPool::MIN_BLOCK_BITS];
+        TS_ASSERT_EQUALS(st.cached, 2);
+        TS_ASSERT_EQUALS(st.inUse, 0);
+        TS_ASSERT_EQUALS(st.highWater, 4);
+        TS_ASSERT_EQUALS(pool.getCachedBytes(), 2 << 20);
+
+        // Going over the limit gives back the largest blocks first
+        pool.free(small, 1 << 10);
+        TS_ASSERT_EQUALS(pool.getStats()[20 - MemPool::MIN_BLOCK_BITS].cached, 1);
+        TS_ASSERT_EQUALS(pool.getStats()[10 - MemPool::MIN_BLOCK_BITS].cached, 1);
+        TS_ASSERT_EQUALS(pool.getCachedBytes(), (1 << 20) + (1 << 10));
+
+        // Blocks larger than maxCachedBlock are never cached
+        char *big = pool.alloc(1 << 21);
+        pool.free(big, 1 << 21);
+        TS_ASSERT_EQUALS(pool.getStats()[21 - MemPool::MIN_BLOCK_BITS].cached, 0);
+        TS_ASSERT_EQUALS(pool.getCachedBytes(), (1 << 20) + (1 << 10));
+    }
+
+    void testHugeBlocks()
+    {
+        MemPool pool(8 * MemPool::HUGE_PAGE_SIZE, 8 * MemPool::HUGE_PAGE_SIZE,
+                     MemPool::HUGE_PAGES_HUGETLB);
+
+        // Falls back to normal pages if no huge pages are reserved
+        size_t sz = 3 * MemPool::HUGE_PAGE_SIZE;
+        char *buf = pool.alloc(sz);
+        TS_ASSERT(buf);
+        buf[0] = buf[sz - 1] = 1;
+        pool.free(buf, sz);
+        TS_ASSERT_EQUALS(pool.alloc(sz), buf);
+        pool.free(buf, sz);
+    }
+
+    void testThreaded()
+    {
+        MemPool pool;
+
+        auto worker = [&pool]() {
+            for (int i = 0; i < 10000; ++i) {
+                size_t sz = 64 << (i % 8);
+                char *b = pool.alloc(sz);
+                b[0] = b[sz - 1] = 0;
+                pool.free(b, sz);
+            }
+        };
+        std::thread t1(worker), t2(worker);
+        t1.join();
+        t2.join();
+
+        for (const auto& st : pool.getStats()) {
+            TS_ASSERT_EQUALS(st.inUse, 0);
+            TS_ASSERT_EQUALS(st.hits + st.misses, st.blockSize <= (64 << 7) ? 2500u : 0u);
+        }
+    }
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+
+#include "cxxtest/TestSuite.h"
+
+#include "zcm/util/spsc_queue.hpp"
+
+class SpscQueueTest : public CxxTest::TestSuite
+{
+  public:
+    void setUp() override {}
+    void tearDown() override {}
+
+    void testPushPop()
+    {
+        SpscQueue<int> q(4);
+        TS_ASSERT(!q.hasMessage());
+        TS_ASSERT(q.pushIfRoom(1));
+        TS_ASSERT(q.pushIfRoom(2));
+        TS_ASSERT(q.pushIfRoom(3));
+        // One slot is always kept free
+        TS_ASSERT(!q.pushIfRoom(4));
+        TS_ASSERT_EQUALS(q.numMessages(), 3);
+
+        for (int i = 1; i <= 3; ++i) {
+            int* v = q.top();
+            TS_ASSERT(v);
+            TS_ASSERT_EQUALS(*v, i);
+            q.pop();
+        }
+        TS_ASSERT(!q.hasMessage());
+    }
+
+    void testPeek()
+    {
+        SpscQueue<int> q(4);
+        TS_ASSERT(q.peek(0) == nullptr);
+
+        // Wrap the indices around the end of the ring
+        TS_ASSERT(q.pushIfRoom(0));
+        TS_ASSERT(q.pushIfRoom(0));
+        q.pop();
+        q.pop();
+        for (int i = 1; i <= 3; ++i) TS_ASSERT(q.pushIfRoom(i));
+
+        for (int i = 0; i < 3; ++i) {
+            int* v = q.peek(i);
+            TS_ASSERT(v);
+            if (v) TS_ASSERT_EQUALS(*v, i + 1);
+        }
+        TS_ASSERT(q.peek(3) == nullptr);
+        TS_ASSERT_EQUALS(q.peek(0), q.top());
+    }
+
+    void testDisable()
+    {
+        SpscQueue<int> q(4);
+        TS_ASSERT(q.pushIfRoom(1));
+        q.disable();
+        TS_ASSERT(q.top() == nullptr);
+        q.enable();
+        TS_ASSERT(q.top() != nullptr);
+    }
+
+    void testSetCapacity()
+    {
+        SpscQueue<int> q(8);
+        for (int i = 0; i < 7; ++i) TS_ASSERT(q.pushIfRoom(i));
+
+        q.setCapacity(4);
+        TS_ASSERT_EQUALS(q.getCapacity(), 4);
+        TS_ASSERT_EQUALS(q.numMessages(), 3);
+        TS_ASSERT_EQUALS(*q.top(), 0);
+
+        q.setCapacity(16);
+        TS_ASSERT_EQUALS(q.numMessages(), 3);
+        for (int i = 0; i < 3; ++i) {
+            TS_ASSERT_EQUALS(*q.top(), i);
+            q.pop();
+        }
+    }
+
+    void testThreaded()
+    {
+        constexpr int numMsgs = 200000;
+        SpscQueue<int> q(16);
+
+        std::thread producer([&](){
+            for (int i = 0; i < numMsgs; ++i) q.push(i);
+        });
+
+        bool inOrder = true;
+        for (int i = 0; i < numMsgs; ++i) {
+            int* v = q.top();
+            if (!v || *v != i) inOrder = false;
+            q.pop();
+        }
+        producer.join();
+
+        TS_ASSERT(inOrder);
+        TS_ASSERT(!q.hasMessage());
+    }
+
+    void testMultiProducer()
+    {
+        constexpr int numMsgs = 50000;
+        SpscQueue<int, true> q(16);
+
+        auto producer = [&](int first) {
+            for (int i = 0; i < numMsgs; ++i) q.push(first + i);
+        };
+        std::thread p1(producer, 0), p2(producer, numMsgs);
+
+        // Each producer's messages have to stay in order
+        int next[2] = {0, numMsgs};
+        bool inOrder = true;
+        for (int i = 0; i < 2 * numMsgs; ++i) {
+            int* v = q.top();
+            int& expected = next[*v / numMsgs];
+            if (*v != expected) inOrder = false;
+            expected = *v + 1;
+            q.pop();
+        }
+        p1.join();
+        p2.join();
+
+        TS_ASSERT(inOrder);
+        TS_ASSERT(!q.hasMessage());
+    }
+
+    void testResizeWhileProducing()
+    {
+        SpscQueue<int> q(16);
+        std::atomic<bool> done {false};
+
+        std::thread producer([&](){
+            int i = 0;
+            while (!done) {
+                if (q.pushIfRoom(i)) ++i;
+                else std::this_thread::yield();
+            }
+        });
+
+        // Values only ever increase, whatever got dropped by a resize
+        int last = -1;
+        bool increasing = true;
+        for (int round = 0; round < 1000; ++round) {
+            q.disable();
+            q.setCapacity(round % 2 ? 8 : 32);
+            q.enable();
+            while (!q.hasMessage()) std::this_thread::yield();
+            for (int i = 0; i < 4 && q.hasMessage(); ++i) {
+                int v = *q.top();
+                if (v <= last) increasing = false;
+                last = v;
+                q.pop();
+            }
+        }
+        done = true;
+        producer.join();
+
+        TS_ASSERT(increasing);
+        TS_ASSERT(last >= 0);
+    }
+};
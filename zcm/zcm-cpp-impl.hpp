@@ -81,6 +81,13 @@ inline void ZCM::start()
 }
 #endif
 
+#ifndef ZCM_EMBEDDED
+inline void ZCM::startPool(uint32_t nthreads)
+{
+    return zcm_start_pool(zcm, nthreads);
+}
+#endif
+
 #ifndef ZCM_EMBEDDED
 inline void ZCM::stop()
 {
@@ -116,11 +123,36 @@ inline void ZCM::setQueueSize(uint32_t sz)
 }
 #endif
 
+#ifndef ZCM_EMBEDDED
+inline std::vector<zcm_dispatch_stats_t> ZCM::getDispatchStats()
+{
+    std::vector<zcm_dispatch_stats_t> stats;
+    uint32_t n = zcm_get_dispatch_stats(zcm, nullptr, 0);
+    stats.resize(n);
+    if (n > 0) {
+        // Note: the pool may have been stopped in between
+        uint32_t m = zcm_get_dispatch_stats(zcm, &stats[0], n);
+        if (m < n) stats.resize(m);
+    }
+    return stats;
+}
+#endif
+
 inline int ZCM::handleNonblock()
 {
     return zcm_handle_nonblock(zcm);
 }
 
+inline int ZCM::getTransStats(zcm_trans_stats_t& stats)
+{
+    return zcm_get_trans_stats(zcm, &stats);
+}
+
+inline int ZCM::setLossHandler(zcm_loss_handler_t cb, void* usr)
+{
+    return zcm_set_loss_handler(zcm, cb, usr);
+}
+
 inline void ZCM::flush()
 {
     return zcm_flush(zcm);
@@ -465,6 +497,16 @@ inline FILE* LogFile::getFilePtr()
     return zcm_eventlog_get_fileptr(eventlog);
 }
 
+inline int LogFile::enableIndex(const std::string& idxpath)
+{
+    return zcm_eventlog_enable_index(eventlog, idxpath.c_str());
+}
+
+inline int LogFile::setCompression(int codec, int level, int nthreads)
+{
+    return zcm_eventlog_set_compression(eventlog, codec, level, nthreads);
+}
+
 inline const LogEvent* LogFile::cplusplusIfyEvent(zcm_eventlog_event_t* evt)
 {
     if (lastevent)
@@ -497,6 +539,20 @@ inline const LogEvent* LogFile::readEventAtOffset(off_t offset)
     return cplusplusIfyEvent(evt);
 }
 
+inline const LogEventView* LogFile::readNextEventView()
+{
+    zcm_eventlog_event_view_t view;
+    if (zcm_eventlog_read_next_event_view(eventlog, &view) != 0)
+        return nullptr;
+    curView.eventnum = view.eventnum;
+    curView.timestamp = view.timestamp;
+    curView.channel = view.channel;
+    curView.channellen = view.channellen;
+    curView.datalen = view.datalen;
+    curView.data = view.data;
+    return &curView;
+}
+
 inline int LogFile::writeEvent(const LogEvent* event)
 {
     zcm_eventlog_event_t evt;
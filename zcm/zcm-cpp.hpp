@@ -38,14 +38,18 @@ class ZCM
     #ifndef ZCM_EMBEDDED
     virtual inline void run();
     virtual inline void start();
+    virtual inline void startPool(uint32_t nthreads);
     virtual inline void stop();
     virtual inline void pause();
     virtual inline void resume();
     virtual inline int  handle();
     virtual inline void setQueueSize(uint32_t sz);
+    virtual inline std::vector<zcm_dispatch_stats_t> getDispatchStats();
     #endif
     virtual inline int  handleNonblock();
     virtual inline void flush();
+    virtual inline int  getTransStats(zcm_trans_stats_t& stats);
+    virtual inline int  setLossHandler(zcm_loss_handler_t cb, void* usr);
 
   public:
     inline int publish(const std::string& channel, const uint8_t* data, uint32_t len);
@@ -148,6 +152,17 @@ struct LogEvent
     uint8_t*       data;
 };
 
+// See zcm_eventlog_read_next_event_view(). The channel is not NUL terminated
+struct LogEventView
+{
+    int64_t        eventnum;
+    int64_t        timestamp;
+    const char*    channel;
+    int32_t        channellen;
+    int32_t        datalen;
+    const uint8_t* data;
+};
+
 struct LogFile
 {
     /**** Methods for ctor/dtor/check ****/
@@ -159,6 +174,10 @@ struct LogFile
     /**** Methods general operations ****/
     inline int seekToTimestamp(int64_t timestamp);
     inline FILE* getFilePtr();
+    // See zcm_eventlog_enable_index()
+    inline int enableIndex(const std::string& idxpath);
+    // See zcm_eventlog_set_compression()
+    inline int setCompression(int codec, int level = 0, int nthreads = 0);
 
     /**** Methods for read/write ****/
     // NOTE: user should NOT hold-onto the returned ptr across successive calls
@@ -166,10 +185,14 @@ struct LogFile
     inline const LogEvent* readPrevEvent();
     inline const LogEvent* readEventAtOffset(off_t offset);
     inline int             writeEvent(const LogEvent* event);
+    // Like readNextEvent() but without any allocations or copies, for scanning
+    // through large logs. Same rule: the returned view is only valid until the next call
+    inline const LogEventView* readNextEventView();
 
   private:
     inline const LogEvent* cplusplusIfyEvent(zcm_eventlog_event_t* le);
     LogEvent curEvent;
+    LogEventView curView;
     zcm_eventlog_t* eventlog;
     zcm_eventlog_event_t* lastevent;
 };
@@ -268,6 +268,14 @@ void zcm_start(zcm_t* zcm)
 }
 #endif
 
+#ifndef ZCM_EMBEDDED
+void zcm_start_pool(zcm_t* zcm, uint32_t nthreads)
+{
+    ZCM_ASSERT(zcm->type == ZCM_BLOCKING);
+    return zcm_blocking_start_pool(zcm->impl, nthreads);
+}
+#endif
+
 #ifndef ZCM_EMBEDDED
 void zcm_stop(zcm_t* zcm)
 {
@@ -332,6 +340,47 @@ int  zcm_try_set_queue_size(zcm_t* zcm, uint32_t numMsgs)
 }
 #endif
 
+#ifndef ZCM_EMBEDDED
+uint32_t zcm_get_dispatch_stats(zcm_t* zcm, zcm_dispatch_stats_t* stats, uint32_t n)
+{
+    ZCM_ASSERT(zcm->type == ZCM_BLOCKING);
+    return zcm_blocking_get_dispatch_stats(zcm->impl, stats, n);
+}
+#endif
+
+int zcm_get_trans_stats(zcm_t* zcm, zcm_trans_stats_t* stats)
+{
+    zcm_trans_stats_t zero = {0};
+    *stats = zero;
+
+#ifndef ZCM_EMBEDDED
+    switch (zcm->type) {
+        case ZCM_BLOCKING: return zcm_blocking_get_trans_stats(zcm->impl, stats);
+        case ZCM_NONBLOCKING: return zcm_nonblocking_get_trans_stats(zcm->impl, stats);
+    }
+#else
+    ZCM_ASSERT(zcm->type == ZCM_NONBLOCKING);
+    return zcm_nonblocking_get_trans_stats(zcm->impl, stats);
+#endif
+
+    return ZCM_EINVALID;
+}
+
+int zcm_set_loss_handler(zcm_t* zcm, zcm_loss_handler_t cb, void* usr)
+{
+#ifndef ZCM_EMBEDDED
+    switch (zcm->type) {
+        case ZCM_BLOCKING: return zcm_blocking_set_loss_handler(zcm->impl, cb, usr);
+        case ZCM_NONBLOCKING: return zcm_nonblocking_set_loss_handler(zcm->impl, cb, usr);
+    }
+#else
+    ZCM_ASSERT(zcm->type == ZCM_NONBLOCKING);
+    return zcm_nonblocking_set_loss_handler(zcm->impl, cb, usr);
+#endif
+
+    return ZCM_EINVALID;
+}
+
 int zcm_handle_nonblock(zcm_t* zcm)
 {
     ZCM_ASSERT(zcm->type == ZCM_NONBLOCKING);
@@ -42,11 +42,17 @@ typedef struct zcm_trans_t    zcm_trans_t;
 typedef struct zcm_t          zcm_t;
 typedef struct zcm_recv_buf_t zcm_recv_buf_t;
 typedef struct zcm_sub_t      zcm_sub_t;
+typedef struct zcm_dispatch_stats_t zcm_dispatch_stats_t;
+typedef struct zcm_trans_stats_t zcm_trans_stats_t;
+typedef struct zcm_loss_event_t zcm_loss_event_t;
 
 /* Generic message handler function type */
 typedef void (*zcm_msg_handler_t)(const zcm_recv_buf_t* rbuf,
                                   const char* channel, void* usr);
 
+/* Loss handler function type (see zcm_set_loss_handler()) */
+typedef void (*zcm_loss_handler_t)(const zcm_loss_event_t* ev, void* usr);
+
 /* Note: some language bindings depend on the specific memory layout
  *       of ZCM structures. If you change these, be sure to update
  *       language bindings to match. */
@@ -69,6 +75,64 @@ struct zcm_recv_buf_t
     uint32_t data_size;
 };
 
+/* Statistics for one thread of the dispatch pool (see zcm_start_pool()) */
+struct zcm_dispatch_stats_t
+{
+    uint32_t thread;      /* index of the pool thread */
+    uint32_t queue_depth; /* subscriptions with messages waiting in this thread's queue */
+    uint64_t dispatched;  /* number of callbacks run by this thread */
+    uint64_t stolen;      /* number of times this thread took work from another thread */
+    uint64_t dropped;     /* messages dropped because a subscription fell too far behind */
+};
+
+/* Statistics kept by the transport (see zcm_get_trans_stats()). All counters are totals
+   since the transport was created. Transports only fill in what applies to them, the rest
+   is left at 0 */
+struct zcm_trans_stats_t
+{
+    uint64_t msgs_sent;         /* messages handed to the transport for sending */
+    uint64_t msgs_recv;         /* complete messages received */
+    uint64_t packets_sent;      /* packets (datagrams, frames, ...) sent */
+    uint64_t packets_recv;      /* packets received */
+    uint64_t bytes_sent;        /* bytes sent, including transport headers */
+    uint64_t bytes_recv;        /* bytes received, including transport headers */
+    uint64_t fragments_sent;    /* packets sent that carry part of a larger message */
+    uint64_t fragments_recv;    /* packets received that carry part of a larger message */
+    uint64_t recv_syscalls;     /* system calls that returned received packets */
+
+    uint64_t packets_bad;       /* packets discarded because they were malformed */
+    uint64_t msgs_incomplete;   /* messages dropped because some of their fragments never came */
+    uint64_t fragbuf_evictions; /* partially received messages evicted to make room */
+    uint64_t kernel_drops;      /* packets the kernel dropped before we could receive them */
+
+    uint64_t nacks_sent;        /* requests for missing fragments sent to other senders */
+    uint64_t retransmits;       /* fragments sent again because another receiver asked */
+
+    uint64_t msgs_lost;         /* messages missing from their sender's sequence. Messages
+                                   that turn up late are no longer counted as lost */
+    uint64_t msgs_reordered;    /* messages received after a later one of the same sender */
+    uint64_t msgs_duplicate;    /* messages received more than once */
+
+    uint64_t msgs_dropped;      /* messages dropped instead of sent because a receiver
+                                   couldn't take them */
+};
+
+enum zcm_loss_type {
+    ZCM_LOSS_GAP,      /* messages were skipped in the sender's sequence */
+    ZCM_LOSS_REORDER,  /* a message arrived after a later one of the same sender */
+    ZCM_LOSS_DUPLICATE /* a message arrived more than once */
+};
+
+/* Passed to the loss handler whenever the transport notices a sequence problem */
+struct zcm_loss_event_t
+{
+    enum zcm_loss_type type;
+    const char* sender; /* transport specific, e.g. "192.168.1.7:40125" for udpm */
+    uint32_t    seqno;  /* the first missing seqno for ZCM_LOSS_GAP, otherwise the one received */
+    uint32_t    count;  /* number of messages missing for ZCM_LOSS_GAP, otherwise 1 */
+    int64_t     utime;  /* receive time of the message that revealed the problem */
+};
+
 #ifndef ZCM_EMBEDDED
 int zcm_retcode_name_to_enum(const char* zcm_retcode_name);
 #endif
@@ -118,7 +182,10 @@ zcm_sub_t* zcm_try_subscribe(zcm_t* zcm, const char* channel, zcm_msg_handler_t
 
 /* Unsubscribe to zcm messages, freeing the subscription object
    Returns ZCM_EOK on success, error code on failure
-   Does NOT set zcm errno on failure */
+   Does NOT set zcm errno on failure
+   Blocking Mode: subscribing and unsubscribing may be done from within a callback.
+   When called from outside of a callback, the subscription's callback is no longer
+   running once this returns */
 int zcm_unsubscribe(zcm_t* zcm, zcm_sub_t* sub);
 
 /* Unsubscribe to zcm messages, freeing the subscription object
@@ -136,7 +203,9 @@ int zcm_publish(zcm_t* zcm, const char* channel, const uint8_t* data, uint32_t l
 
 /* Block until all published messages have been sent even if the underlying
    transport is nonblocking. Additionally, dispatches all messages that have
-   already been received sequentially in this thread. */
+   already been received sequentially in this thread. In pool mode (see
+   zcm_start_pool()) it also waits for their callbacks to finish, unless it is
+   called from a callback itself. */
 void zcm_flush(zcm_t* zcm);
 
 /* Nonblocking version of flush (ZCM_EAGAIN if fail, ZCM_EOK if success) as defined
@@ -163,8 +232,29 @@ int  zcm_handle(zcm_t* zcm); /* returns ZCM_EOK normally, error code on failure.
    issues depending on the transport. */
 void zcm_set_queue_size(zcm_t* zcm, uint32_t numMsgs);
 int  zcm_try_set_queue_size(zcm_t* zcm, uint32_t numMsgs); /* returns ZCM_EOK or ZCM_EAGAIN */
+/* Like zcm_start(), but callbacks are run by a pool of 'nthreads' dispatch threads instead of
+   by the single handler thread. Callbacks of the same subscription never run concurrently and
+   always see messages in the order they were received, but callbacks of different
+   subscriptions may run in parallel, so a slow callback does not hold up the others.
+   If a subscription falls more than the queue size (see zcm_set_queue_size()) messages
+   behind, its oldest waiting messages are dropped. Stop with zcm_stop() as usual. */
+void zcm_start_pool(zcm_t* zcm, uint32_t nthreads);
+/* Fills 'stats' with up to 'n' entries, one per dispatch pool thread.
+   Returns the number of pool threads (0 if not running with zcm_start_pool()) */
+uint32_t zcm_get_dispatch_stats(zcm_t* zcm, zcm_dispatch_stats_t* stats, uint32_t n);
 #endif
 
+/* Fills 'stats' with the statistics of the underlying transport. In blocking mode this is
+   safe to call from any thread. Returns ZCM_EOK, or ZCM_EINVALID if the transport doesn't
+   keep statistics */
+int zcm_get_trans_stats(zcm_t* zcm, zcm_trans_stats_t* stats);
+
+/* Has 'cb' called whenever the transport notices that messages were lost, reordered or
+   duplicated on their way from a sender. The handler runs on the transport's receive
+   thread and should return quickly. Pass NULL to remove it. Returns ZCM_EOK, or
+   ZCM_EINVALID if the transport doesn't track sequence numbers */
+int zcm_set_loss_handler(zcm_t* zcm, zcm_loss_handler_t cb, void* usr);
+
 /* Non-Blocking Mode Only: Functions checking and dispatching messages
    Returns ZCM_EOK if a message was dispatched, ZCM_EAGAIN if no messages,
    error code otherwise */